@@ -0,0 +1,889 @@
+/*
+    Compress RAW and JPEG images in a folder utilizing all CPU cores. The
+    tree is walked once, every image is recompressed in-process by a pool
+    of worker threads, and the results are written straight into a
+    destination folder with the same layout.
+*/
+// Needed for fdopendir, fstatat, mkstemp and d_type under -std=c99
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifndef _WIN32
+    #include <dirent.h>
+    #include <fcntl.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+#endif
+
+#include "src/digest.h"
+#include "src/jpegarchive.h"
+#include "src/journal.h"
+#include "src/parallel.h"
+#include "src/resultcache.h"
+#include "src/scans.h"
+#include "src/util.h"
+
+// Recompression options, which default to the high quality preset
+struct jpeg_archive_ctx options;
+
+// Number of worker threads
+int jobs = 0;
+
+// Scan scripts to use, and the file to learn scan scripts into
+const char *scansPath = NULL;
+const char *learnPath = NULL;
+struct scanScripts scans;
+
+// Quiet mode (less output)
+int quiet = 0;
+
+/* Long command line options. */
+enum longopts {
+    OPT_CACHE_OUTPUT = 1000,
+    OPT_SCANS,
+    OPT_LEARN_SCANS,
+    OPT_TOLERANCE,
+    OPT_MIN_SAVINGS
+};
+
+// Logs an informational message, taking quiet mode into account
+void info(const char *format, ...) {
+    va_list argptr;
+
+    if (!quiet) {
+        va_start(argptr, format);
+        vfprintf(stderr, format, argptr);
+        va_end(argptr);
+    }
+}
+
+void usage(void) {
+    printf("usage: %s [options] [source [destination]]\n\n", progname);
+    printf("Compress RAW and JPEG images in source [.] into destination [source/Comp].\n");
+    printf("Images that are unchanged since an earlier run into destination are skipped.\n\n");
+    printf("options:\n\n");
+    printf("  -V, --version                output program version\n");
+    printf("  -h, --help                   output program help\n");
+    printf("  -t, --target [arg]           set target quality [0.99995]\n");
+    printf("  -q, --quality [arg]          set a quality preset: low, medium, high, veryhigh [high]\n");
+    printf("  -n, --min [arg]              minimum JPEG quality [40]\n");
+    printf("  -x, --max [arg]              maximum JPEG quality [95]\n");
+    printf("  -l, --loops [arg]            set the number of runs to attempt [6]\n");
+    printf("  -a, --accurate               favor accuracy over speed\n");
+    printf("  -f, --fine                   search fractional qualities as well, for outputs closer to the target\n");
+    printf("      --tolerance [arg]        stop searching at a quality that meets the target by at most this much [0]\n");
+    printf("  -m, --method [arg]           set comparison method to one of 'mpe', 'ssim', 'ms-ssim', 'smallfry' [ssim]\n");
+    printf("  -s, --strip                  strip metadata\n");
+    printf("  -c, --no-copy                disable copying files that will not be compressed\n");
+    printf("      --min-savings [arg]      copy files that would not get at least this many percent smaller [0]\n");
+    printf("  -p, --no-progressive         disable progressive encoding\n");
+    printf("      --scans [arg]            use progressive scan scripts from this file\n");
+    printf("      --learn-scans [arg]      learn progressive scan scripts from the images into this file\n");
+    printf("  -S, --subsample [arg]        set subsampling method to one of 'default', 'disable' [default]\n");
+    printf("  -M, --max-memory [arg]       stream large images in strips to stay within this many MB\n");
+    printf("  -H, --hash                   embed an image hash in the output\n");
+    printf("  -C, --cache [arg]            reuse and store results of identical inputs in a cache directory\n");
+    printf("      --cache-output           store whole outputs in the cache, not just their quality\n");
+    printf("  -j, --jobs [arg]             number of worker threads [CPU count]\n");
+    printf("  -Q, --quiet                  only print out errors\n");
+}
+
+#ifndef _WIN32
+
+// Journal of finished images, kept in the destination
+#define JOURNAL_NAME ".jpeg-archive-journal"
+
+enum imageKind {
+    IMAGE_JPEG,
+    // Converted to PPM with dcraw first
+    IMAGE_RAW
+};
+
+struct task {
+    char *source;
+    char *destination;
+    // Path within the source folder, which the journal goes by
+    const char *relative;
+    enum imageKind kind;
+    uint64_t size;
+    int64_t mtime;
+};
+
+struct archive {
+    struct task *tasks;
+    long count;
+    long capacity;
+    size_t rootLength;
+    struct journal journal;
+    // The destination, which is skipped if it is inside the source
+    dev_t skipDev;
+    ino_t skipIno;
+    int haveExiftool;
+    mode_t mode;
+    pthread_mutex_t lock;
+    long done;
+    long compressed;
+    long copied;
+    long skipped;
+    long failed;
+    unsigned long long inputBytes;
+    unsigned long long outputBytes;
+    // Scan scripts of the outputs, with --learn-scans
+    struct scanScripts learned;
+    long learnedCount;
+};
+
+static int64_t mtimeNs(const struct stat *st) {
+#ifdef __APPLE__
+    return (int64_t) st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+static char *joinPath(const char *dir, const char *name) {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+
+    if (path != NULL)
+        sprintf(path, "%s/%s", dir, name);
+
+    return path;
+}
+
+// Find out what kind of image a file is from its extension
+static int imageKind(const char *name, enum imageKind *kind) {
+    const char *ext = strrchr(name, '.');
+
+    if (ext == NULL)
+        return 0;
+
+    if (!strcasecmp(ext, ".jpg") || !strcasecmp(ext, ".jpeg")) {
+        *kind = IMAGE_JPEG;
+        return 1;
+    }
+
+    if (!strcasecmp(ext, ".cr2") || !strcasecmp(ext, ".nef") || !strcasecmp(ext, ".dng")) {
+        *kind = IMAGE_RAW;
+        return 1;
+    }
+
+    return 0;
+}
+
+static int addTask(struct archive *archive, const char *sourceDir, const char *destinationDir, const char *name, enum imageKind kind, const struct stat *st) {
+    struct task *task;
+
+    if (archive->count == archive->capacity) {
+        long capacity = archive->capacity ? archive->capacity * 2 : 1024;
+        struct task *tasks = realloc(archive->tasks, capacity * sizeof *tasks);
+
+        if (tasks == NULL)
+            return 1;
+
+        archive->tasks = tasks;
+        archive->capacity = capacity;
+    }
+
+    task = &archive->tasks[archive->count];
+    task->kind = kind;
+    task->size = st->st_size;
+    task->mtime = mtimeNs(st);
+    task->source = joinPath(sourceDir, name);
+    task->destination = joinPath(destinationDir, name);
+    if (task->source == NULL || task->destination == NULL)
+        return 1;
+
+    task->relative = task->source + archive->rootLength + 1;
+
+    // RAW files become JPEGs of the same name
+    if (kind == IMAGE_RAW)
+        strcpy(strrchr(task->destination, '.'), ".jpg");
+
+    archive->count++;
+    return 0;
+}
+
+/*
+    Walk a directory tree, creating the same directories in the
+    destination and queueing every image. readdir reads entries in
+    batches (getdents on Linux) and usually knows their type, so only
+    images and entries of unknown type are looked up, relative to the
+    open directory. Symbolic links to images are followed, links to
+    directories are not.
+*/
+static int walk(struct archive *archive, const char *sourceDir, const char *destinationDir) {
+    struct dirent *entry;
+    struct stat st;
+    DIR *dir;
+    int fd;
+    int ret = 0;
+
+    fd = open(sourceDir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || fstat(fd, &st) || (dir = fdopendir(fd)) == NULL) {
+        error("could not read directory: %s", sourceDir);
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+
+    dev_t dev = st.st_dev;
+
+    if (mkdir(destinationDir, 0777) && errno != EEXIST) {
+        error("could not create directory: %s", destinationDir);
+        closedir(dir);
+        return 1;
+    }
+
+    while (!ret && (entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        int type = entry->d_type;
+        enum imageKind kind;
+
+        if (!strcmp(name, ".") || !strcmp(name, ".."))
+            continue;
+
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            if (fstatat(fd, name, &st, type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW))
+                continue;
+
+            if (S_ISREG(st.st_mode))
+                type = DT_REG;
+            else if (S_ISDIR(st.st_mode) && type == DT_UNKNOWN)
+                type = DT_DIR;
+            else
+                continue;
+        }
+
+        if (type == DT_DIR) {
+            char *source, *destination;
+
+            // Never descend into our own output
+            if (dev == archive->skipDev && entry->d_ino == archive->skipIno)
+                continue;
+
+            source = joinPath(sourceDir, name);
+            destination = joinPath(destinationDir, name);
+            ret = (source == NULL || destination == NULL) ? 1 : walk(archive, source, destination);
+            free(source);
+            free(destination);
+        } else if (type == DT_REG && imageKind(name, &kind)) {
+            // The size and modification time tell whether it changed
+            if (fstatat(fd, name, &st, 0))
+                continue;
+
+            ret = addTask(archive, sourceDir, destinationDir, name, kind, &st);
+        }
+    }
+
+    closedir(dir);
+    return ret;
+}
+
+static pthread_mutex_t spawnLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+    Start a command with its standard output going to a pipe, or to
+    /dev/null if output is NULL. Pipes are created and marked close on
+    exec while no other thread can fork, so a command never keeps the
+    pipe of another one open.
+*/
+static pid_t spawn(char *const argv[], int *output) {
+    int fds[2] = { -1, -1 };
+    pid_t pid;
+
+    pthread_mutex_lock(&spawnLock);
+
+    if (output != NULL) {
+        if (pipe(fds)) {
+            pthread_mutex_unlock(&spawnLock);
+            return -1;
+        }
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        int out = (output != NULL) ? fds[1] : open("/dev/null", O_WRONLY);
+
+        dup2(out, STDOUT_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    pthread_mutex_unlock(&spawnLock);
+
+    if (output != NULL) {
+        close(fds[1]);
+        if (pid < 0)
+            close(fds[0]);
+        else
+            *output = fds[0];
+    }
+
+    return pid;
+}
+
+// Wait for a command, returning its exit status or -1 if it did not exit
+static int finish(pid_t pid) {
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Convert a RAW file to PPM with dcraw
+static long readRaw(const char *path, unsigned char **buf) {
+    char *argv[] = { "dcraw", "-w", "-q", "3", "-c", (char *) path, NULL };
+    FILE *file;
+    long size;
+    int fd;
+    pid_t pid;
+
+    *buf = NULL;
+
+    pid = spawn(argv, &fd);
+    if (pid < 0) {
+        error("could not run dcraw for %s", path);
+        return 0;
+    }
+
+    file = fdopen(fd, "rb");
+    size = (file != NULL) ? readStream(file, (void **) buf) : 0;
+    if (file != NULL)
+        fclose(file);
+    else
+        close(fd);
+
+    if (finish(pid) || !size) {
+        error("dcraw could not convert %s", path);
+        free(*buf);
+        *buf = NULL;
+        return 0;
+    }
+
+    return size;
+}
+
+/*
+    Read the EXIF data exiftool extracted from a RAW file, as a marker
+    to write along with the output. Leaves meta NULL if there is none.
+*/
+static void readRawMetadata(pid_t pid, int fd, const char *path, unsigned char **meta, unsigned int *metaSize) {
+    FILE *file = fdopen(fd, "rb");
+    unsigned char *blob = NULL;
+    long size = 0;
+
+    *meta = NULL;
+    *metaSize = 0;
+
+    if (file != NULL) {
+        size = readStream(file, (void **) &blob);
+        fclose(file);
+    } else {
+        close(fd);
+    }
+
+    if (!finish(pid) && size && metadataFromBlob(blob, size, meta, metaSize))
+        error("metadata of %s does not fit into a JPEG, leaving it out", path);
+
+    free(blob);
+}
+
+/*
+    Write the output to a temporary file next to the destination and
+    rename it into place, so the destination is either missing or
+    complete.
+*/
+static int writeAtomically(struct archive *archive, const char *destination, const struct slice *slices, int count) {
+    char *tmpName = malloc(strlen(destination) + 8);
+    int fd;
+    int ret = 0;
+
+    if (tmpName == NULL)
+        return 1;
+
+    sprintf(tmpName, "%s.XXXXXX", destination);
+    fd = mkstemp(tmpName);
+    if (fd < 0) {
+        error("could not create output file: %s", destination);
+        free(tmpName);
+        return 1;
+    }
+
+    fchmod(fd, archive->mode);
+    ret = writeSlicesFd(fd, slices, count);
+    ret |= close(fd);
+
+    if (ret || rename(tmpName, destination)) {
+        error("could not write output file: %s", destination);
+        remove(tmpName);
+        ret = 1;
+    }
+
+    free(tmpName);
+    return ret;
+}
+
+/*
+    Whether an image that was read before was finished and has not
+    changed since, even though its modification time did, and its
+    output is still there.
+*/
+static int unchanged(const struct journalRecord *previous, const struct journalRecord *record, const char *destination) {
+    return previous != NULL && previous->status != JOURNAL_FAILED && !memcmp(previous->digest, record->digest, DIGEST_SIZE) && !access(destination, F_OK);
+}
+
+static void processImage(long item, void *data) {
+    struct archive *archive = data;
+    struct task *task = &archive->tasks[item];
+    const struct journalRecord *previous = findJournal(&archive->journal, task->relative);
+    struct journalRecord record;
+    struct jpeg_archive_ctx ctx = options;
+    struct jpeg_archive_image image;
+    struct jpeg_archive_stats stats;
+    struct slice slices[JPEG_ARCHIVE_SLICES];
+    enum jpeg_archive_status status = JPEG_ARCHIVE_FAILED;
+    unsigned char *buf;
+    long bufSize;
+    unsigned char *meta = NULL;
+    unsigned int metaSize = 0;
+    int failed = 1;
+
+    memset(&record, 0, sizeof record);
+    record.size = task->size;
+    record.mtime = task->mtime;
+
+    // The digest is of the file itself, so for RAW files it comes before dcraw
+    bufSize = readFile(task->source, (void **) &buf);
+    if (bufSize)
+        digestBuffer(buf, bufSize, record.digest);
+    else if (!task->size)
+        error("file is empty: %s", task->source);
+
+    if (bufSize && unchanged(previous, &record, task->destination)) {
+        record.status = previous->status;
+        record.quality = previous->quality;
+        record.outputSize = previous->outputSize;
+        if (appendJournal(&archive->journal, task->relative, &record))
+            error("could not write to journal");
+
+        free(buf);
+
+        pthread_mutex_lock(&archive->lock);
+        archive->done++;
+        archive->skipped++;
+        info("[%li/%li] %s: unchanged\n", archive->done, archive->count, task->source);
+        pthread_mutex_unlock(&archive->lock);
+        return;
+    }
+
+    if (task->kind == IMAGE_RAW) {
+        pid_t exifPid = -1;
+        int exifFd;
+
+        // Extract the metadata while dcraw converts the image
+        if (bufSize && archive->haveExiftool && !options.strip) {
+            char *argv[] = { "exiftool", "-b", "-Exif", task->source, NULL };
+
+            exifPid = spawn(argv, &exifFd);
+        }
+
+        free(buf);
+        buf = NULL;
+        bufSize = bufSize ? readRaw(task->source, &buf) : 0;
+        ctx.inputFiletype = FILETYPE_PPM;
+
+        if (exifPid > 0) {
+            readRawMetadata(exifPid, exifFd, task->source, &meta, &metaSize);
+            ctx.metadata = meta;
+            ctx.metadataSize = metaSize;
+        }
+    } else {
+        ctx.inputFiletype = FILETYPE_JPEG;
+    }
+
+    if (bufSize) {
+        status = jpeg_archive_recompress(&ctx, task->source, buf, bufSize, NULL, NULL, 0, 0, &image, &stats);
+
+        if (status == JPEG_ARCHIVE_OK) {
+            jpeg_archive_slices(&image, &stats, slices);
+            failed = writeAtomically(archive, task->destination, slices, JPEG_ARCHIVE_SLICES);
+
+            if (learnPath != NULL) {
+                pthread_mutex_lock(&archive->lock);
+                if (!learnScanScript(&archive->learned, options.subsample, image.compressed, image.compressedSize))
+                    archive->learnedCount++;
+                pthread_mutex_unlock(&archive->lock);
+            }
+        } else if (status != JPEG_ARCHIVE_FAILED && task->kind == IMAGE_JPEG && options.copyFiles) {
+            // Keep the original, which is either already ours or smaller
+            slices[0] = (struct slice) { buf, bufSize };
+            failed = writeAtomically(archive, task->destination, slices, 1);
+        } else if (status == JPEG_ARCHIVE_PROCESSED) {
+            error("file already processed by jpeg-recompress: %s", task->source);
+        } else if (status == JPEG_ARCHIVE_LARGER) {
+            error("output file would be larger than input: %s", task->source);
+        }
+
+        jpeg_archive_free_image(&image);
+    }
+
+    free(buf);
+    free(meta);
+
+    if (failed) {
+        record.status = JOURNAL_FAILED;
+    } else if (status == JPEG_ARCHIVE_OK) {
+        record.status = JOURNAL_COMPRESSED;
+        record.quality = stats.quality;
+        record.outputSize = stats.size;
+    } else {
+        record.status = JOURNAL_COPIED;
+        record.outputSize = bufSize;
+    }
+
+    // Only written once the output is in place, so it can be trusted
+    if (appendJournal(&archive->journal, task->relative, &record))
+        error("could not write to journal");
+
+    pthread_mutex_lock(&archive->lock);
+    archive->done++;
+    if (failed) {
+        archive->failed++;
+    } else if (status == JPEG_ARCHIVE_OK) {
+        archive->compressed++;
+        archive->inputBytes += bufSize;
+        archive->outputBytes += stats.size;
+        info("[%li/%li] %s: q=%g, %lu%% of original\n", archive->done, archive->count, task->source, stats.quality, stats.size * 100 / bufSize);
+    } else {
+        archive->copied++;
+        archive->inputBytes += bufSize;
+        archive->outputBytes += bufSize;
+        info("[%li/%li] %s: copied, %s\n", archive->done, archive->count, task->source, status == JPEG_ARCHIVE_PROCESSED ? "already processed" : "would be larger");
+    }
+    pthread_mutex_unlock(&archive->lock);
+}
+
+/*
+    Drop images that were finished by an earlier run and still have the
+    same size and modification time, without reading them at all.
+*/
+static void skipUnchanged(struct archive *archive) {
+    long kept = 0;
+
+    for (long x = 0; x < archive->count; x++) {
+        struct task *task = &archive->tasks[x];
+        const struct journalRecord *record = findJournal(&archive->journal, task->relative);
+
+        if (record != NULL && record->status != JOURNAL_FAILED && record->size == task->size && record->mtime == task->mtime && !access(task->destination, F_OK)) {
+            free(task->source);
+            free(task->destination);
+            archive->skipped++;
+        } else {
+            archive->tasks[kept++] = *task;
+        }
+    }
+
+    archive->count = kept;
+}
+
+// Check whether a command can be run at all
+static int haveCommand(char *const argv[]) {
+    pid_t pid = spawn(argv, NULL);
+
+    return pid > 0 && finish(pid) == 0;
+}
+
+static int archiveTree(const char *source, const char *destination) {
+    struct archive archive;
+    struct stat st;
+    uint8_t digest[DIGEST_SIZE];
+    char *journalName;
+    mode_t mask;
+    int ret;
+
+    memset(&archive, 0, sizeof archive);
+    pthread_mutex_init(&archive.lock, NULL);
+
+    // Outputs get the usual permissions, not those of a temporary file
+    mask = umask(0);
+    umask(mask);
+    archive.mode = 0666 & ~mask;
+
+    if (mkdir(destination, 0777) && errno != EEXIST) {
+        error("could not create directory: %s", destination);
+        return 1;
+    }
+
+    if (!stat(destination, &st)) {
+        archive.skipDev = st.st_dev;
+        archive.skipIno = st.st_ino;
+    }
+
+    // Results of a run with other options are not reused
+    journalName = joinPath(destination, JOURNAL_NAME);
+    jpeg_archive_options_digest(&options, digest);
+    if (journalName == NULL || openJournal(journalName, digest, &archive.journal)) {
+        free(journalName);
+        return 1;
+    }
+    free(journalName);
+
+    if (archive.journal.restarted)
+        info("Options changed since the last run, processing all images again\n");
+
+    // Samples of earlier runs count as well
+    if (learnPath != NULL && !stat(learnPath, &st) && loadScanScripts(learnPath, &archive.learned)) {
+        closeJournal(&archive.journal);
+        return 1;
+    }
+
+    archive.rootLength = strlen(source);
+    if (walk(&archive, source, destination)) {
+        closeJournal(&archive.journal);
+        return 1;
+    }
+
+    skipUnchanged(&archive);
+
+    for (long x = 0; x < archive.count && !options.strip; x++) {
+        if (archive.tasks[x].kind == IMAGE_RAW) {
+            char *argv[] = { "exiftool", "-ver", NULL };
+
+            archive.haveExiftool = haveCommand(argv);
+            if (!archive.haveExiftool)
+                error("exiftool not found, RAW outputs will have no metadata");
+            break;
+        }
+    }
+
+    if (archive.skipped)
+        info("Skipping %li images that are unchanged since the last run\n", archive.skipped);
+
+    info("Compressing %li images with %i threads...\n", archive.count, jobs);
+    runParallel(archive.count, jobs, processImage, &archive);
+
+    unsigned long long saved = (archive.inputBytes > archive.outputBytes) ? archive.inputBytes - archive.outputBytes : 0;
+    info("Done! Compressed %li, copied %li and skipped %li images into %s, saving %llu kb", archive.compressed, archive.copied, archive.skipped, destination, saved / 1024);
+    info(archive.failed ? ", %li failed.\n" : ".\n", archive.failed);
+
+    ret = archive.failed ? 1 : 0;
+
+    if (learnPath != NULL) {
+        if (saveScanScripts(learnPath, &archive.learned)) {
+            error("could not write scan script file: %s", learnPath);
+            ret = 1;
+        } else {
+            info("Learned scan scripts from %li images into %s\n", archive.learnedCount, learnPath);
+        }
+        freeScanScripts(&archive.learned);
+    }
+
+    for (long x = 0; x < archive.count; x++) {
+        free(archive.tasks[x].source);
+        free(archive.tasks[x].destination);
+    }
+    free(archive.tasks);
+    closeJournal(&archive.journal);
+    pthread_mutex_destroy(&archive.lock);
+
+    return ret;
+}
+
+#else
+
+static int archiveTree(const char *source, const char *destination) {
+    error("archiving a folder is not supported on this platform");
+    return 1;
+}
+
+#endif
+
+int main(int argc, char **argv) {
+    const char *optstring = "Vht:q:n:x:l:afm:scpS:M:HC:j:Q";
+    static const struct option opts[] = {
+        { "version", no_argument, 0, 'V' },
+        { "help", no_argument, 0, 'h' },
+        { "target", required_argument, 0, 't' },
+        { "quality", required_argument, 0, 'q' },
+        { "min", required_argument, 0, 'n' },
+        { "max", required_argument, 0, 'x' },
+        { "loops", required_argument, 0, 'l' },
+        { "accurate", no_argument, 0, 'a' },
+        { "fine", no_argument, 0, 'f' },
+        { "tolerance", required_argument, 0, OPT_TOLERANCE },
+        { "method", required_argument, 0, 'm' },
+        { "strip", no_argument, 0, 's' },
+        { "no-copy", no_argument, 0, 'c' },
+        { "min-savings", required_argument, 0, OPT_MIN_SAVINGS },
+        { "no-progressive", no_argument, 0, 'p' },
+        { "scans", required_argument, 0, OPT_SCANS },
+        { "learn-scans", required_argument, 0, OPT_LEARN_SCANS },
+        { "subsample", required_argument, 0, 'S' },
+        { "max-memory", required_argument, 0, 'M' },
+        { "hash", no_argument, 0, 'H' },
+        { "cache", required_argument, 0, 'C' },
+        { "cache-output", no_argument, 0, OPT_CACHE_OUTPUT },
+        { "jobs", required_argument, 0, 'j' },
+        { "quiet", no_argument, 0, 'Q' },
+        { 0, 0, 0, 0 }
+    };
+    int opt, longind = 0;
+    const char *source = ".";
+    char *destination = NULL;
+    int ret;
+
+    progname = "jpeg-archive";
+
+    jpeg_archive_init(&options);
+    options.preset = JPEG_ARCHIVE_HIGH;
+
+    while ((opt = getopt_long(argc, argv, optstring, opts, &longind)) != -1) {
+        switch (opt) {
+        case 'V':
+            version();
+            return 0;
+        case 'h':
+            usage();
+            return 0;
+        case 't':
+            options.target = atof(optarg);
+            break;
+        case 'q':
+            options.preset = jpeg_archive_parse_preset(optarg);
+            break;
+        case 'n':
+            options.jpegMin = atoi(optarg);
+            break;
+        case 'x':
+            options.jpegMax = atoi(optarg);
+            break;
+        case 'l':
+            options.attempts = atoi(optarg);
+            break;
+        case 'a':
+            options.accurate = 1;
+            break;
+        case 'f':
+            options.fineQuality = 1;
+            break;
+        case OPT_TOLERANCE:
+            options.tolerance = atof(optarg);
+            break;
+        case OPT_MIN_SAVINGS:
+            options.minSavings = atof(optarg);
+            break;
+        case 'm':
+            options.method = jpeg_archive_parse_method(optarg);
+            break;
+        case 's':
+            options.strip = 1;
+            break;
+        case 'c':
+            options.copyFiles = 0;
+            break;
+        case 'p':
+            options.noProgressive = 1;
+            break;
+        case 'S':
+            options.subsample = jpeg_archive_parse_subsample(optarg);
+            break;
+        case 'M':
+            options.maxMemory = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'H':
+            options.embedHash = 1;
+            break;
+        case 'C':
+            options.cacheDir = optarg;
+            break;
+        case OPT_CACHE_OUTPUT:
+            options.cacheOutput = 1;
+            break;
+        case OPT_SCANS:
+            scansPath = optarg;
+            break;
+        case OPT_LEARN_SCANS:
+            learnPath = optarg;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'Q':
+            quiet = 1;
+            break;
+        };
+    }
+
+    if (argc - optind > 2) {
+        usage();
+        return 255;
+    }
+
+    if (options.method == JPEG_ARCHIVE_UNKNOWN) {
+        error("invalid method!");
+        usage();
+        return 255;
+    }
+
+    if (options.jpegMin > options.jpegMax) {
+        error("maximum JPEG quality must not be smaller than minimum JPEG quality!");
+        return 1;
+    }
+
+    if (learnPath != NULL && (scansPath != NULL || options.noProgressive)) {
+        error("learning scan scripts needs progressive output and no --scans");
+        return 1;
+    }
+
+    if (scansPath != NULL) {
+        if (loadScanScripts(scansPath, &scans))
+            return 1;
+        options.scans = &scans;
+    }
+
+    // Messages of the workers would only interleave
+    options.quiet = 1;
+
+    if (options.cacheDir && openResultCache(options.cacheDir))
+        return 1;
+
+    if (jobs < 1)
+        jobs = cpuCount();
+
+    if (argc - optind >= 1)
+        source = argv[optind];
+
+    if (argc - optind == 2) {
+        destination = strdup(argv[optind + 1]);
+    } else {
+        destination = malloc(strlen(source) + 6);
+        if (destination != NULL)
+            sprintf(destination, "%s/Comp", source);
+    }
+
+    if (destination == NULL) {
+        error("out of memory");
+        return 1;
+    }
+
+    ret = archiveTree(source, destination);
+    free(destination);
+
+    return ret;
+}
@@ -16,6 +16,7 @@
 */
 
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,7 +24,9 @@
 
 #include "src/edit.h"
 #include "src/hash.h"
+#include "src/hashcache.h"
 #include "src/iqa/include/iqa.h"
+#include "src/parallel.h"
 #include "src/smallfry.h"
 #include "src/util.h"
 
@@ -49,6 +52,21 @@ int printPrefix = 1;
 // Hash size when method is FAST
 int size = 16;
 
+// List of images to compare against a single query image
+char *againstFile = NULL;
+
+// Sidecar file caching hashes of unchanged files for FAST
+char *cacheFile = NULL;
+struct hashCache cache;
+
+// With --against, only report images whose hashes differ by at most
+// this many percent, -1 reports all. Only hashes of the selected size
+// decide, so the same images are reported with or without a cache.
+int threshold = -1;
+
+// Number of worker threads when comparing against a list
+int jobs = 0;
+
 // Use PPM input?
 enum filetype inputFiletype1 = FILETYPE_AUTO;
 enum filetype inputFiletype2 = FILETYPE_AUTO;
@@ -78,7 +96,7 @@ static enum filetype parseInputFiletype(const char *s) {
 }
 
 int compareFastFromBuffer(unsigned char *imageBuf1, long bufSize1, unsigned char *imageBuf2, long bufSize2) {
-    unsigned char *hash1, *hash2;
+    uint64_t *hash1, *hash2;
 
     // Generate hashes
     if (jpegHashFromBuffer(imageBuf1, bufSize1, &hash1, size)) {
@@ -92,7 +110,7 @@ int compareFastFromBuffer(unsigned char *imageBuf1, long bufSize1, unsigned char
     }
 
     // Compare and print out hamming distance
-    printf("%u\n", hammingDist(hash1, hash2, size * size) * 100 / (size * size));
+    printf("%u\n", hashDiff(hash1, hash2, size));
 
     // Cleanup
     free(hash1);
@@ -101,45 +119,95 @@ int compareFastFromBuffer(unsigned char *imageBuf1, long bufSize1, unsigned char
     return 0;
 }
 
-int compareFromBuffer(unsigned char *imageBuf1, long bufSize1, unsigned char *imageBuf2, long bufSize2) {
-    unsigned char *image1, *image2, *image1Gray = NULL, *image2Gray = NULL;
-    int width1, width2, height1, height2;
-    int format, components;
-    float diff;
+// Like compareFastFromBuffer, but files whose hash is cached are not read
+int compareFastFromCache(const char *fileName1, const char *fileName2) {
+    uint64_t *hash1, *hash2;
+
+    if (cachedJpegHash(&cache, fileName1, &hash1, size)) {
+        error("error hashing image 1!");
+        return 1;
+    }
+
+    if (cachedJpegHash(&cache, fileName2, &hash2, size)) {
+        error("error hashing image 2!");
+        return 1;
+    }
+
+    printf("%u\n", hashDiff(hash1, hash2, size));
+
+    free(hash1);
+    free(hash2);
 
-    // Set requested pixel format
+    return 0;
+}
+
+// Pixel format and number of components used by the selected method
+static int methodFormat(int *components) {
     switch (method) {
         case PSNR:
-            format = JCS_RGB;
-            components = 3;
-            break;
+            *components = 3;
+            return JCS_RGB;
         case SSIM: case MS_SSIM: default:
-            format = JCS_GRAYSCALE;
-            components = 1;
-            break;
+            *components = 1;
+            return JCS_GRAYSCALE;
     }
+}
 
-    // Decode files
-    if (!decodeFileFromBuffer(imageBuf1, bufSize1, &image1, inputFiletype1, &width1, &height1, format)) {
-        error("invalid input reference file");
+// Decode an image into the given pixel format, converting PPM to grayscale if needed
+static int decodeImage(unsigned char *buf, long bufSize, enum filetype type, int format, unsigned char **image, int *width, int *height) {
+    unsigned char *imageGray;
+
+    if (!decodeFileFromBuffer(buf, bufSize, image, type, width, height, format))
         return 1;
+
+    if (JCS_GRAYSCALE == format && FILETYPE_PPM == type) {
+        grayscale(*image, &imageGray, *width, *height);
+        free(*image);
+        *image = imageGray;
     }
 
-    if (1 == components && FILETYPE_PPM == inputFiletype1) {
-        grayscale(image1, &image1Gray, width1, height1);
-        free(image1);
-        image1 = image1Gray;
+    return 0;
+}
+
+// Decode an image into the pixel format needed by the selected method
+static int decodeForMethod(unsigned char *buf, long bufSize, enum filetype type, unsigned char **image, int *width, int *height) {
+    int components;
+
+    return decodeImage(buf, bufSize, type, methodFormat(&components), image, width, height);
+}
+
+// Compare two decoded images of the same size with the selected method
+static float compareImages(unsigned char *image1, unsigned char *image2, int width, int height) {
+    int components;
+
+    methodFormat(&components);
+
+    switch (method) {
+        case PSNR:
+            return iqa_psnr(image1, image2, width, height, width * components);
+        case SMALLFRY:
+            return smallfry_metric(image1, image2, width, height);
+        case MS_SSIM:
+            return iqa_ms_ssim(image1, image2, width, height, width * components, 0);
+        case SSIM: default:
+            return iqa_ssim(image1, image2, width, height, width * components, 0, 0);
     }
+}
 
-    if (!decodeFileFromBuffer(imageBuf2, bufSize2, &image2, inputFiletype2, &width2, &height2, format)) {
-        error("invalid input query file");
+int compareFromBuffer(unsigned char *imageBuf1, long bufSize1, unsigned char *imageBuf2, long bufSize2) {
+    unsigned char *image1, *image2;
+    int width1, width2, height1, height2;
+    float diff;
+
+    // Decode files
+    if (decodeForMethod(imageBuf1, bufSize1, inputFiletype1, &image1, &width1, &height1)) {
+        error("invalid input reference file");
         return 1;
     }
 
-    if (1 == components && FILETYPE_PPM == inputFiletype2) {
-        grayscale(image2, &image2Gray, width2, height2);
-        free(image2);
-        image2 = image2Gray;
+    if (decodeForMethod(imageBuf2, bufSize2, inputFiletype2, &image2, &width2, &height2)) {
+        error("invalid input query file");
+        return 1;
     }
 
     // Ensure width/height are equal
@@ -149,32 +217,25 @@ int compareFromBuffer(unsigned char *imageBuf1, long bufSize1, unsigned char *im
     }
 
     // Calculate and print comparison
-    switch (method) {
-        case PSNR:
-            diff = iqa_psnr(image1, image2, width1, height1, width1 * components);
-            if (printPrefix)
+    diff = compareImages(image1, image2, width1, height1);
+
+    if (printPrefix) {
+        switch (method) {
+            case PSNR:
                 printf("PSNR: ");
-            printf("%f\n", diff);
-            break;
-        case SMALLFRY:
-            diff = smallfry_metric(image1, image2, width1, height1);
-            if (printPrefix)
+                break;
+            case SMALLFRY:
                 printf("SMALLFRY: ");
-            printf("%f\n", diff);
-            break;
-        case MS_SSIM:
-            diff = iqa_ms_ssim(image1, image2, width1, height1, width1 * components, 0);
-            if (printPrefix)
+                break;
+            case MS_SSIM:
                 printf("MS-SSIM: ");
-            printf("%f\n", diff);
-            break;
-        case SSIM: default:
-            diff = iqa_ssim(image1, image2, width1, height1, width1 * components, 0, 0);
-            if (printPrefix)
+                break;
+            case SSIM: default:
                 printf("SSIM: ");
-            printf("%f\n", diff);
-            break;
+                break;
+        }
     }
+    printf("%f\n", diff);
 
     // Cleanup
     free(image1);
@@ -183,8 +244,210 @@ int compareFromBuffer(unsigned char *imageBuf1, long bufSize1, unsigned char *im
     return 0;
 }
 
+/*
+    State shared by the workers when comparing one query image against
+    a list of candidates. The query is decoded (or hashed) once up front
+    and only read by the workers. Results are printed in list order as
+    soon as all earlier candidates are done.
+*/
+struct against {
+    char **paths;
+    long count;
+    unsigned char *image;
+    int width;
+    int height;
+    uint64_t *hash;
+    float *scores;
+    char *status;
+    long next;
+    int failed;
+    pthread_mutex_t lock;
+};
+
+enum candidateStatus {
+    CANDIDATE_PENDING,
+    CANDIDATE_DONE,
+    CANDIDATE_FAILED,
+    CANDIDATE_SKIPPED
+};
+
+// Candidates whose hashes differ by more than the threshold are dropped
+static enum candidateStatus thresholdStatus(unsigned int diff) {
+    return threshold < 0 || diff <= (unsigned int) threshold ? CANDIDATE_DONE : CANDIDATE_SKIPPED;
+}
+
+// Hash an image like jpegHash, from a full grayscale decode for PPM
+static int hashForThreshold(unsigned char *buf, long bufSize, enum filetype type, uint64_t **hash) {
+    unsigned char *gray;
+    int width, height;
+
+    if (type == FILETYPE_JPEG)
+        return jpegHashFromBuffer(buf, bufSize, hash, size);
+
+    if (decodeImage(buf, bufSize, type, JCS_GRAYSCALE, &gray, &width, &height))
+        return 1;
+
+    hashGrayImage(gray, width, height, hash, size);
+    free(gray);
+
+    return 0;
+}
+
+static enum candidateStatus scoreCandidate(struct against *against, const char *path, float *score) {
+    unsigned char *buf, *image;
+    uint64_t *hash;
+    int width, height;
+    unsigned int diff;
+    long bufSize;
+    enum filetype type = inputFiletype2;
+
+    if (method == FAST && cacheFile) {
+        if (type == FILETYPE_PPM || cachedJpegHash(&cache, path, &hash, size)) {
+            error("error hashing image: %s", path);
+            return CANDIDATE_FAILED;
+        }
+
+        *score = hashDiff(against->hash, hash, size);
+        free(hash);
+        return thresholdStatus(*score);
+    }
+
+    bufSize = readFile((char *) path, (void **) &buf);
+    if (!bufSize) {
+        error("failed to read file: %s", path);
+        return CANDIDATE_FAILED;
+    }
+
+    if (type == FILETYPE_AUTO)
+        type = detectFiletypeFromBuffer(buf, bufSize);
+
+    if (method == FAST && type != FILETYPE_JPEG) {
+        error("error hashing image: %s", path);
+        free(buf);
+        return CANDIDATE_FAILED;
+    }
+
+    // Reject unrelated images with the hash first, which only needs a
+    // reduced decode instead of the full one of the other methods
+    if (method == FAST || threshold >= 0) {
+        if (hashForThreshold(buf, bufSize, type, &hash)) {
+            error("error hashing image: %s", path);
+            free(buf);
+            return CANDIDATE_FAILED;
+        }
+
+        diff = hashDiff(against->hash, hash, size);
+        free(hash);
+
+        if (method == FAST || thresholdStatus(diff) == CANDIDATE_SKIPPED) {
+            *score = diff;
+            free(buf);
+            return thresholdStatus(diff);
+        }
+    }
+
+    if (decodeForMethod(buf, bufSize, type, &image, &width, &height)) {
+        error("invalid input file: %s", path);
+        free(buf);
+        return CANDIDATE_FAILED;
+    }
+    free(buf);
+
+    if (width != against->width || height != against->height) {
+        error("images must be identical sizes for selected method: %s", path);
+        free(image);
+        return CANDIDATE_FAILED;
+    }
+
+    *score = compareImages(against->image, image, width, height);
+    free(image);
+
+    return CANDIDATE_DONE;
+}
+
+static void compareCandidate(long item, void *data) {
+    struct against *against = data;
+    float score = 0;
+    enum candidateStatus status;
+
+    status = scoreCandidate(against, against->paths[item], &score);
+
+    pthread_mutex_lock(&against->lock);
+    against->scores[item] = score;
+    against->status[item] = status;
+    if (status == CANDIDATE_FAILED)
+        against->failed = 1;
+
+    // Flush every result that is no longer waiting on an earlier one
+    while (against->next < against->count && against->status[against->next] != CANDIDATE_PENDING) {
+        if (against->status[against->next] == CANDIDATE_DONE) {
+            if (method == FAST)
+                printf("%u %s\n", (unsigned int) against->scores[against->next], against->paths[against->next]);
+            else
+                printf("%f %s\n", against->scores[against->next], against->paths[against->next]);
+        }
+        against->next++;
+    }
+    pthread_mutex_unlock(&against->lock);
+}
+
+int compareAgainstList(unsigned char *imageBuf, long bufSize, char *listFile) {
+    struct against against;
+    char *listBuf;
+
+    memset(&against, 0, sizeof(against));
+
+    // Prepare the query once for all candidates
+    if (method == FAST && inputFiletype1 != FILETYPE_JPEG) {
+        error("fast comparison only works with JPEG files!");
+        return 255;
+    }
+
+    if ((method == FAST || threshold >= 0) && hashForThreshold(imageBuf, bufSize, inputFiletype1, &against.hash)) {
+        error("error hashing image 1!");
+        return 1;
+    }
+
+    if (method != FAST && decodeForMethod(imageBuf, bufSize, inputFiletype1, &against.image, &against.width, &against.height)) {
+        error("invalid input reference file");
+        free(against.hash);
+        return 1;
+    }
+
+    against.count = readLines(listFile, &listBuf, &against.paths);
+    if (!against.count) {
+        error("no images listed in %s", listFile);
+        free(against.hash);
+        free(against.image);
+        free(listBuf);
+        return 1;
+    }
+
+    against.scores = malloc(against.count * sizeof(float));
+    against.status = calloc(against.count, 1);
+    if (against.scores == NULL || against.status == NULL) {
+        error("out of memory");
+        return 1;
+    }
+    pthread_mutex_init(&against.lock, NULL);
+
+    runParallel(against.count, jobs, compareCandidate, &against);
+
+    // Cleanup
+    pthread_mutex_destroy(&against.lock);
+    free(against.scores);
+    free(against.status);
+    free(against.paths);
+    free(listBuf);
+    free(against.hash);
+    free(against.image);
+
+    return against.failed;
+}
+
 void usage(void) {
-    printf("usage: %s [options] image1.jpg image2.jpg\n\n", progname);
+    printf("usage: %s [options] image1.jpg image2.jpg\n", progname);
+    printf("       %s [options] --against list.txt image.jpg\n\n", progname);
     printf("options:\n\n");
     printf("  -V, --version                output program version\n");
     printf("  -h, --help                   output program help\n");
@@ -193,11 +456,15 @@ void usage(void) {
     printf("  -r, --ppm                    parse first input as PPM instead of JPEG\n");
     printf("  -T, --input-filetype [arg]   set first input file type to one of 'auto', 'jpeg', 'ppm' [auto]\n");
     printf("  -U, --second-filetype [arg]  set second input file type to one of 'auto', 'jpeg', 'ppm' [auto]\n");
+    printf("  -a, --against [arg]          compare the image against every file listed in arg, one per line\n");
+    printf("  -j, --jobs [arg]             number of images to compare at once with --against [number of CPUs]\n");
+    printf("  -t, --threshold [arg]        with --against, skip images whose hashes differ by more than arg percent\n");
+    printf("  -c, --cache [arg]            reuse and store fast hashes of unchanged files in a cache file\n");
     printf("      --short                  do not prefix output with the name of the used method\n");
 }
 
 int main (int argc, char **argv) {
-    const char *optstring = "VhS:m:rT:U:";
+    const char *optstring = "VhS:m:rT:U:a:j:c:t:";
     static const struct option opts[] = {
         { "version", no_argument, 0, 'V' },
         { "help", no_argument, 0, 'h' },
@@ -206,6 +473,10 @@ int main (int argc, char **argv) {
         { "ppm", no_argument, 0, 'r' },
         { "input-filetype", required_argument, 0, 'T' },
         { "second-filetype", required_argument, 0, 'U' },
+        { "against", required_argument, 0, 'a' },
+        { "jobs", required_argument, 0, 'j' },
+        { "cache", required_argument, 0, 'c' },
+        { "threshold", required_argument, 0, 't' },
         { "short", no_argument, 0, OPT_SHORT },
         { 0, 0, 0, 0 }
     };
@@ -248,17 +519,78 @@ int main (int argc, char **argv) {
             }
             inputFiletype2 = parseInputFiletype(optarg);
             break;
+        case 'a':
+            againstFile = optarg;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'c':
+            cacheFile = optarg;
+            break;
+        case 't':
+            threshold = atoi(optarg);
+            break;
         case OPT_SHORT:
             printPrefix = 0;
             break;
         };
     }
 
-    if (argc - optind != 2) {
+    if (argc - optind != (againstFile ? 1 : 2)) {
         usage();
         return 255;
     }
 
+    if (jobs <= 0)
+        jobs = cpuCount();
+
+    // Hashes are only cached for the fast method
+    if (method != FAST)
+        cacheFile = NULL;
+
+    if (cacheFile && openHashCache(cacheFile, size, &cache))
+        return 1;
+
+    if (againstFile) {
+        unsigned char *imageBuf;
+        long bufSize;
+        int ret;
+
+        bufSize = readFile(argv[optind], (void **)&imageBuf);
+        if (!bufSize) {
+            error("failed to read file: %s", argv[optind]);
+            return 1;
+        }
+
+        if (inputFiletype1 == FILETYPE_AUTO)
+            inputFiletype1 = detectFiletypeFromBuffer(imageBuf, bufSize);
+
+        if (method == UNKNOWN) {
+            error("unknown comparison method!");
+            return 255;
+        }
+
+        ret = compareAgainstList(imageBuf, bufSize, againstFile);
+        free(imageBuf);
+        if (cacheFile)
+            closeHashCache(&cache);
+        return ret;
+    }
+
+    if (cacheFile) {
+        int ret;
+
+        if (inputFiletype1 == FILETYPE_PPM || inputFiletype2 == FILETYPE_PPM) {
+            error("fast comparison only works with JPEG files!");
+            return 255;
+        }
+
+        ret = compareFastFromCache(argv[optind], argv[optind + 1]);
+        closeHashCache(&cache);
+        return ret;
+    }
+
     // Read the images
     unsigned char *imageBuf1, *imageBuf2;
     long bufSize1, bufSize2;
@@ -0,0 +1,319 @@
+/*
+    Find groups of similar images in a list of JPEG files. Every image
+    is hashed once, in parallel. Images whose hashes are identical in
+    at least one 16-bit band are compared (see src/dedupe.h). Matches
+    within the radius are merged into clusters with union-find and
+    printed as JSON, optionally after confirming each match with SSIM
+    on small grayscale planes.
+*/
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "src/dedupe.h"
+#include "src/hash.h"
+#include "src/hashcache.h"
+#include "src/iqa/include/iqa.h"
+#include "src/parallel.h"
+#include "src/util.h"
+
+// Size of the grayscale planes compared to confirm a match
+#define CONFIRM_SIZE 64
+
+int size = 16;
+
+// Maximum distance in bits for a match, -1 means 10% of the hash
+int radius = -1;
+
+// Minimum SSIM to confirm a match, 0 accepts all matches unconfirmed
+float minSsim = 0;
+
+// Number of parallel jobs, 0 means one per CPU
+int jobs = 0;
+
+// Sidecar file caching hashes of unchanged files
+char *cacheFile = NULL;
+struct hashCache cache;
+
+/* State shared by the workers. */
+struct corpus {
+    char **paths;
+    long count;
+    int words;
+    uint64_t *hashes;
+    char *hashed;
+    char *inPair;
+    unsigned char **planes;
+    struct dedupePair *pairs;
+    long pairCount;
+};
+
+static void hashWork(long item, void *data) {
+    struct corpus *corpus = data;
+    uint64_t *hash;
+
+    if (cachedJpegHash(cacheFile ? &cache : NULL, corpus->paths[item], &hash, size)) {
+        error("error hashing image: %s", corpus->paths[item]);
+        return;
+    }
+
+    memcpy(corpus->hashes + item * corpus->words, hash, corpus->words * sizeof(uint64_t));
+    corpus->hashed[item] = 1;
+    free(hash);
+}
+
+/* Decode the plane used to confirm matches of an image. */
+static void planeWork(long item, void *data) {
+    struct corpus *corpus = data;
+    unsigned char *image;
+    int width, height;
+    FILE *file;
+
+    if (!corpus->inPair[item])
+        return;
+
+    file = fopen(corpus->paths[item], "rb");
+    if (!file) {
+        error("unable to open file: %s", corpus->paths[item]);
+        return;
+    }
+
+    if (decodeHashPlane(file, NULL, 0, CONFIRM_SIZE, &image, &width, &height)) {
+        // Scale to a common size so images of any size line up
+        scale(image, width, height, &corpus->planes[item], CONFIRM_SIZE, CONFIRM_SIZE);
+        free(image);
+    }
+
+    fclose(file);
+}
+
+static void confirmWork(long item, void *data) {
+    struct corpus *corpus = data;
+    struct dedupePair *pair = corpus->pairs + item;
+    unsigned char *plane1 = corpus->planes[pair->a];
+    unsigned char *plane2 = corpus->planes[pair->b];
+
+    pair->confirmed = plane1 && plane2 &&
+        iqa_ssim(plane1, plane2, CONFIRM_SIZE, CONFIRM_SIZE, CONFIRM_SIZE, 0, 0) >= minSsim;
+}
+
+/* Confirm every pair with SSIM, decoding each involved image once. */
+static void confirmPairs(struct corpus *corpus) {
+    corpus->inPair = calloc(corpus->count ? corpus->count : 1, 1);
+    if (corpus->inPair == NULL) {
+        error("out of memory");
+        return;
+    }
+
+    for (long x = 0; x < corpus->pairCount; x++) {
+        corpus->inPair[corpus->pairs[x].a] = 1;
+        corpus->inPair[corpus->pairs[x].b] = 1;
+    }
+
+    runParallel(corpus->count, jobs, planeWork, corpus);
+    runParallel(corpus->pairCount, jobs, confirmWork, corpus);
+
+    for (long x = 0; x < corpus->count; x++) {
+        free(corpus->planes[x]);
+        corpus->planes[x] = NULL;
+    }
+
+    free(corpus->inPair);
+    corpus->inPair = NULL;
+}
+
+static void printJsonString(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c < 0x20)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+    putchar('"');
+}
+
+/* Print all clusters of two or more images as a JSON array of arrays of paths. */
+static long printClusters(struct corpus *corpus, uint32_t *parent) {
+    long *head = malloc((corpus->count ? corpus->count : 1) * sizeof(long));
+    long *next = malloc((corpus->count ? corpus->count : 1) * sizeof(long));
+    long clusters = 0;
+
+    if (head == NULL || next == NULL) {
+        error("out of memory");
+        free(head);
+        free(next);
+        return -1;
+    }
+
+    // Link the members of every cluster in list order
+    for (long x = 0; x < corpus->count; x++)
+        head[x] = -1;
+
+    for (long x = corpus->count - 1; x >= 0; x--) {
+        uint32_t root = findRoot(parent, x);
+
+        next[x] = head[root];
+        head[root] = x;
+    }
+
+    printf("[");
+    for (long x = 0; x < corpus->count; x++) {
+        uint32_t root = findRoot(parent, x);
+
+        if (head[root] != x || next[x] == -1)
+            continue;
+
+        printf(clusters++ ? ",\n  [" : "\n  [");
+        for (long member = x; member != -1; member = next[member]) {
+            if (member != x)
+                printf(", ");
+            printJsonString(corpus->paths[member]);
+        }
+        printf("]");
+    }
+    printf(clusters ? "\n]\n" : "]\n");
+
+    free(head);
+    free(next);
+
+    return clusters;
+}
+
+void usage(void) {
+    printf("usage: %s [options] list.txt\n\n", progname);
+    printf("Reads image paths, one per line, from a file or - for stdin.\n\n");
+    printf("options:\n\n");
+    printf("  -V, --version                output program version\n");
+    printf("  -h, --help                   output program help\n");
+    printf("  -s, --size [arg]             set image hash size [16]\n");
+    printf("  -r, --radius [arg]           maximum hash distance in bits of a match [10%% of the hash size]\n");
+    printf("  -S, --ssim [arg]             confirm matches with a minimum SSIM of arg, e.g. 0.9\n");
+    printf("  -j, --jobs [arg]             number of parallel jobs [one per CPU]\n");
+    printf("  -c, --cache [arg]            reuse and store hashes of unchanged files in a cache file\n");
+}
+
+int main (int argc, char **argv) {
+    const char *optstring = "Vhs:r:S:j:c:";
+    static const struct option opts[] = {
+        { "version", no_argument, 0, 'V' },
+        { "help", no_argument, 0, 'h' },
+        { "size", required_argument, 0, 's' },
+        { "radius", required_argument, 0, 'r' },
+        { "ssim", required_argument, 0, 'S' },
+        { "jobs", required_argument, 0, 'j' },
+        { "cache", required_argument, 0, 'c' },
+        { 0, 0, 0, 0 }
+    };
+    int opt, longind = 0;
+    struct corpus corpus;
+    char *listBuf;
+    uint32_t *parent;
+    long clusters, matched = 0;
+
+    progname = "jpeg-dedupe";
+
+    while ((opt = getopt_long(argc, argv, optstring, opts, &longind)) != -1) {
+        switch (opt) {
+        case 'V':
+            version();
+            return 0;
+        case 'h':
+            usage();
+            return 0;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'r':
+            radius = atoi(optarg);
+            break;
+        case 'S':
+            minSsim = atof(optarg);
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'c':
+            cacheFile = optarg;
+            break;
+        };
+    }
+
+    if (argc - optind != 1) {
+        usage();
+        return 255;
+    }
+
+    // Bands must not straddle the 64-bit words of a hash
+    if (size < 4 || size * size % DEDUPE_BAND_BITS) {
+        error("hash size must be a multiple of 4!");
+        return 255;
+    }
+
+    if (radius < 0)
+        radius = size * size / 10;
+
+    if (jobs <= 0)
+        jobs = cpuCount();
+
+    memset(&corpus, 0, sizeof corpus);
+    corpus.count = readLines(argv[optind], &listBuf, &corpus.paths);
+    corpus.words = HASH_WORDS(size);
+
+    if (!corpus.count) {
+        error("no images listed in %s", argv[optind]);
+        free(listBuf);
+        return 1;
+    }
+
+    if ((uint64_t) corpus.count > UINT32_MAX) {
+        error("too many images!");
+        return 1;
+    }
+
+    corpus.hashes = malloc(corpus.count * corpus.words * sizeof(uint64_t));
+    corpus.hashed = calloc(corpus.count, 1);
+    corpus.planes = calloc(corpus.count, sizeof(unsigned char *));
+    parent = malloc(corpus.count * sizeof(uint32_t));
+    if (corpus.hashes == NULL || corpus.hashed == NULL || corpus.planes == NULL || parent == NULL) {
+        error("out of memory");
+        return 1;
+    }
+
+    if (cacheFile && openHashCache(cacheFile, size, &cache))
+        return 1;
+
+    runParallel(corpus.count, jobs, hashWork, &corpus);
+
+    if (cacheFile)
+        closeHashCache(&cache);
+
+    corpus.pairCount = findPairs(corpus.hashes, corpus.hashed, corpus.count, size, radius, jobs, &corpus.pairs);
+    if (corpus.pairCount < 0)
+        return 1;
+
+    if (minSsim > 0)
+        confirmPairs(&corpus);
+
+    matched = mergePairs(corpus.pairs, corpus.pairCount, corpus.count, parent);
+
+    clusters = printClusters(&corpus, parent);
+
+    fprintf(stderr, "Compared %ld images, %ld pairs matched, %ld clusters\n", corpus.count, matched, clusters);
+
+    // Cleanup
+    free(corpus.hashes);
+    free(corpus.hashed);
+    free(corpus.planes);
+    free(corpus.pairs);
+    free(corpus.paths);
+    free(listBuf);
+    free(parent);
+
+    return clusters < 0 ? 1 : 0;
+}
@@ -3,32 +3,116 @@
     between pixels in the image. The larger the hash size, the less
     likely you are to get collisions, but the more time it takes to
     calculate.
+
+    With --index, hashes a list of files in parallel into an index file
+    instead, or finds all indexed images similar to the given ones when
+    --query is also passed.
 */
 #include <getopt.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "src/hash.h"
+#include "src/hashcache.h"
+#include "src/index.h"
+#include "src/parallel.h"
 #include "src/util.h"
 
 int size = 16;
 
+// Output format
+enum FORMAT {
+    FORMAT_UNKNOWN,
+    FORMAT_BINARY,
+    FORMAT_HEX
+};
+
+int format = FORMAT_BINARY;
+
+// Index file to create, update or query
+char *indexFile = NULL;
+int query = 0;
+
+// Maximum distance in bits for query matches, -1 means 10% of the hash
+int radius = -1;
+
+// Sidecar file caching hashes of unchanged files
+char *cacheFile = NULL;
+struct hashCache cache;
+
+// Number of parallel hashing jobs, 0 means one per CPU
+int jobs = 0;
+
+static enum FORMAT parseFormat(const char *s) {
+    if (!strcmp("binary", s))
+        return FORMAT_BINARY;
+    if (!strcmp("hex", s))
+        return FORMAT_HEX;
+    return FORMAT_UNKNOWN;
+}
+
+// Print all indexed images within the radius of an image
+static int queryImage(const struct hashIndex *index, const char *filename, int showName) {
+    uint64_t *hash, *matches;
+    long found;
+
+    if (cachedJpegHash(cacheFile ? &cache : NULL, filename, &hash, index->hashSize)) {
+        error("error hashing image: %s", filename);
+        return 1;
+    }
+
+    found = queryIndex(index, hash, radius, &matches);
+    if (found < 0) {
+        error("out of memory querying the index for: %s", filename);
+        free(hash);
+        return 1;
+    }
+
+    if (showName)
+        printf("%s:\n", filename);
+
+    for (long x = 0; x < found; x++) {
+        printf("%u %s\n", hammingDist(hash, indexHash(index, matches[x]), index->words), indexPath(index, matches[x]));
+    }
+
+    free(matches);
+    free(hash);
+
+    return 0;
+}
+
 void usage(void) {
-    printf("usage: %s [options] image.jpg\n\n", progname);
+    printf("usage: %s [options] image.jpg\n", progname);
+    printf("       %s [options] --index index.db list.txt\n", progname);
+    printf("       %s [options] --index index.db --query image.jpg...\n\n", progname);
     printf("options:\n\n");
     printf("  -V, --version                output program version\n");
     printf("  -h, --help                   output program help\n");
     printf("  -s, --size [arg]             set fast comparison image hash size\n");
+    printf("  -f, --format [arg]           set output format to one of 'binary', 'hex' [binary]\n");
+    printf("  -i, --index [arg]            hash the files listed in a file (or - for stdin) into an index\n");
+    printf("  -q, --query                  print indexed images similar to the given images\n");
+    printf("  -r, --radius [arg]           maximum query distance in bits [10%% of the hash size]\n");
+    printf("  -j, --jobs [arg]             number of parallel hashing jobs [one per CPU]\n");
+    printf("  -c, --cache [arg]            reuse and store hashes of unchanged files in a cache file\n");
 }
 
 int main (int argc, char **argv) {
-    unsigned char *hash;
+    uint64_t *hash;
 
-    const char *optstring = "Vhs:";
+    const char *optstring = "Vhs:f:i:qr:j:c:";
     static const struct option opts[] = {
         { "version", no_argument, 0, 'V' },
         { "help", no_argument, 0, 'h' },
         { "size", required_argument, 0, 's' },
+        { "format", required_argument, 0, 'f' },
+        { "index", required_argument, 0, 'i' },
+        { "query", no_argument, 0, 'q' },
+        { "radius", required_argument, 0, 'r' },
+        { "jobs", required_argument, 0, 'j' },
+        { "cache", required_argument, 0, 'c' },
         { 0, 0, 0, 0 }
     };
     int opt, longind = 0;
@@ -46,23 +130,116 @@ int main (int argc, char **argv) {
         case 's':
             size = atoi(optarg);
             break;
+        case 'f':
+            format = parseFormat(optarg);
+            break;
+        case 'i':
+            indexFile = optarg;
+            break;
+        case 'q':
+            query = 1;
+            break;
+        case 'r':
+            radius = atoi(optarg);
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'c':
+            cacheFile = optarg;
+            break;
         };
     }
 
+    if (indexFile && query) {
+        struct hashIndex index;
+        int ret = 0;
+
+        if (argc - optind < 1) {
+            usage();
+            return 255;
+        }
+
+        if (openIndex(indexFile, &index))
+            return 1;
+
+        if (radius < 0)
+            radius = index.hashSize * index.hashSize / 10;
+
+        if (cacheFile && openHashCache(cacheFile, index.hashSize, &cache)) {
+            closeIndex(&index);
+            return 1;
+        }
+
+        for (int x = optind; x < argc; x++) {
+            ret |= queryImage(&index, argv[x], argc - optind > 1);
+        }
+
+        if (cacheFile)
+            closeHashCache(&cache);
+        closeIndex(&index);
+
+        return ret;
+    }
+
+    if (indexFile) {
+        char *listBuf, **paths;
+        long count;
+        int ret;
+
+        if (argc - optind != 1) {
+            usage();
+            return 255;
+        }
+
+        count = readLines(argv[optind], &listBuf, &paths);
+        if (!count) {
+            error("no images listed in %s", argv[optind]);
+            free(listBuf);
+            return 1;
+        }
+
+        ret = updateIndex(indexFile, paths, count, size, jobs > 0 ? jobs : cpuCount());
+
+        free(paths);
+        free(listBuf);
+
+        return ret;
+    }
+
     if (argc - optind != 1) {
         usage();
         return 255;
     }
 
+    if (format == FORMAT_UNKNOWN) {
+        error("invalid format!");
+        usage();
+        return 255;
+    }
+
+    if (cacheFile && openHashCache(cacheFile, size, &cache))
+        return 1;
+
     // Generate the image hash
-    if (jpegHash(argv[optind], &hash, size)) {
+    if (cachedJpegHash(cacheFile ? &cache : NULL, argv[optind], &hash, size)) {
         error("error hashing image!");
         return 1;
     }
 
-    // Print out the hash a string of 1s and 0s
-    for (int x = 0; x < size * size; x++) {
-        printf("%c", hash[x] ? '1' : '0');
+    if (cacheFile)
+        closeHashCache(&cache);
+
+    if (format == FORMAT_HEX) {
+        // Print out the packed 64-bit words
+        for (int x = 0; x < HASH_WORDS(size); x++) {
+            printf("%016" PRIx64, hash[x]);
+        }
+    } else {
+        // Print out the hash a string of 1s and 0s
+        for (int x = 0; x < size * size; x++) {
+            printf("%c", hashBit(hash, x) ? '1' : '0');
+        }
     }
     printf("\n");
 
@@ -13,8 +13,11 @@
 #include <string.h>
 
 #include "src/edit.h"
-#include "src/iqa/include/iqa.h"
-#include "src/smallfry.h"
+#include "src/jpegarchive.h"
+#include "src/parallel.h"
+#include "src/resultcache.h"
+#include "src/scans.h"
+#include "src/serve.h"
 #include "src/util.h"
 
 #ifdef _WIN32
@@ -22,87 +25,30 @@
 #include <fcntl.h>
 #endif
 
-const char *COMMENT = "Compressed by jpeg-recompress";
+const char *COMMENT = RECOMPRESS_COMMENT;
 
-// Comparison method
-enum METHOD {
-    UNKNOWN,
-    SSIM,
-    MS_SSIM,
-    SMALLFRY,
-    MPE
-};
-
-int method = SSIM;
+// Recompression options
+struct jpeg_archive_ctx options;
 
-// Number of binary search steps
-int attempts = 6;
-
-// Target quality (SSIM) value
-enum QUALITY_PRESET {
-    LOW,
-    MEDIUM,
-    HIGH,
-    VERYHIGH
+/* Long command line options. */
+enum longopts {
+    OPT_CACHE_OUTPUT = 1000,
+    OPT_METADATA_FROM,
+    OPT_SCANS,
+    OPT_TOLERANCE,
+    OPT_MIN_SAVINGS
 };
 
-float target = 0;
-int preset = MEDIUM;
-
-// Min/max JPEG quality
-int jpegMin = 40;
-int jpegMax = 95;
-
-// Strip metadata from the file?
-int strip = 0;
-
-// Disable progressive mode?
-int noProgressive = 0;
-
-// Defish the image?
-float defishStrength = 0.0;
-float defishZoom = 1.0;
-
-// Input format
-enum filetype inputFiletype = FILETYPE_AUTO;
-
-// Whether to copy files that cannot be compressed
-int copyFiles = 1;
-
-// Whether to favor accuracy over speed
-int accurate = 0;
-
-// Chroma subsampling method
-int subsample = SUBSAMPLE_DEFAULT;
-
-// Quiet mode (less output)
-int quiet = 0;
-
-static enum QUALITY_PRESET parseQuality(const char *s) {
-    if (!strcmp("low", s))
-        return LOW;
-    else if (!strcmp("medium", s))
-        return MEDIUM;
-    else if (!strcmp("high", s))
-        return HIGH;
-    else if (!strcmp("veryhigh", s))
-        return VERYHIGH;
+// File to take the metadata of the output from
+const char *metadataPath = NULL;
 
-    error("unknown quality preset: %s", s);
-    return MEDIUM;
-}
+// Scan scripts to use for progressive output
+const char *scansPath = NULL;
+struct scanScripts scans;
 
-static enum METHOD parseMethod(const char *s) {
-    if (!strcmp("ssim", s))
-        return SSIM;
-    else if (!strcmp("ms-ssim", s))
-        return MS_SSIM;
-    else if (!strcmp("smallfry", s))
-        return SMALLFRY;
-    else if (!strcmp("mpe", s))
-        return MPE;
-    return UNKNOWN;
-}
+// Unix socket to serve requests on, and the number of worker processes
+const char *servePath = NULL;
+int serveJobs = 0;
 
 static enum filetype parseInputFiletype(const char *s) {
     if (!strcmp("auto", s))
@@ -114,85 +60,6 @@ static enum filetype parseInputFiletype(const char *s) {
     return FILETYPE_UNKNOWN;
 }
 
-static void setTargetFromPreset() {
-    switch (method) {
-        case SSIM:
-            switch (preset) {
-                case LOW:
-                    target = 0.999;
-                    break;
-                case MEDIUM:
-                    target = 0.9999;
-                    break;
-                case HIGH:
-                    target = 0.99995;
-                    break;
-                case VERYHIGH:
-                    target = 0.99999;
-                    break;
-            }
-            break;
-        case MS_SSIM:
-            switch (preset) {
-                case LOW:
-                    target = 0.85;
-                    break;
-                case MEDIUM:
-                    target = 0.94;
-                    break;
-                case HIGH:
-                    target = 0.96;
-                    break;
-                case VERYHIGH:
-                    target = 0.98;
-                    break;
-            }
-            break;
-        case SMALLFRY:
-            switch (preset) {
-                case LOW:
-                    target = 100.75;
-                    break;
-                case MEDIUM:
-                    target = 102.25;
-                    break;
-                case HIGH:
-                    target = 103.8;
-                    break;
-                case VERYHIGH:
-                    target = 105.5;
-                    break;
-            }
-            break;
-        case MPE:
-            switch (preset) {
-                case LOW:
-                    target = 1.5;
-                    break;
-                case MEDIUM:
-                    target = 1.0;
-                    break;
-                case HIGH:
-                    target = 0.8;
-                    break;
-                case VERYHIGH:
-                    target = 0.6;
-                    break;
-            }
-            break;
-    }
-}
-
-static int parseSubsampling(const char *s) {
-    if (!strcmp("default", s))
-        return SUBSAMPLE_DEFAULT;
-    else if (!strcmp("disable", s))
-        return SUBSAMPLE_444;
-
-    error("unknown sampling method: %s", s);
-    return SUBSAMPLE_DEFAULT;
-}
-
 // Open a file for writing
 FILE *openOutput(char *name) {
     if (strcmp("-", name) == 0) {
@@ -206,19 +73,101 @@ FILE *openOutput(char *name) {
     }
 }
 
+/*
+    Copy the input through to the output unchanged. Files on disk are
+    copied by the kernel where possible (reflink, copy_file_range or
+    sendfile), so buf is only used for input read from stdin.
+*/
+static int copyOriginal(char *inputPath, char *outputPath, const unsigned char *buf, long bufSize) {
+    FILE *file;
+    int ret = 0;
+
+    // Nothing to do, and opening the output would truncate the input
+    if (isSameFile(inputPath, outputPath))
+        return 0;
+
+    file = openOutput(outputPath);
+    if (file == NULL) {
+        error("could not open output file: %s", outputPath);
+        return 1;
+    }
+
+    if (strcmp("-", inputPath)) {
+        if (copyFileTo(inputPath, file) < 0)
+            ret = 1;
+    } else if (buf == NULL) {
+        // Streamed input that was never kept around
+        error("input was not buffered, unable to copy it");
+        ret = 1;
+    } else {
+        fwrite(buf, bufSize, 1, file);
+    }
+
+    fclose(file);
+
+    return ret;
+}
+
 // Logs an informational message, taking quiet mode into account
 void info(const char *format, ...) {
     va_list argptr;
 
-    if (!quiet) {
+    if (!options.quiet) {
         va_start(argptr, format);
         vfprintf(stderr, format, argptr);
         va_end(argptr);
     }
 }
 
+// Handle an input that already carries our COM marker
+static int alreadyProcessed(char *inputPath, char *outputPath, const unsigned char *buf, long bufSize) {
+    if (options.copyFiles) {
+        info("File already processed by jpeg-recompress!\n");
+        return copyOriginal(inputPath, outputPath, buf, bufSize);
+    }
+
+    error("file already processed by jpeg-recompress!");
+    return 2;
+}
+
+// Convert rows of the original to grayscale as they are read in
+static void grayscaleRows(const unsigned char *rows, int width, int height, int firstRow, int count, void *data) {
+    unsigned char **gray = data;
+
+    if (firstRow == 0)
+        *gray = malloc((size_t) width * height);
+
+    if (*gray != NULL)
+        grayscaleInto(rows, *gray + (size_t) firstRow * width, width, count);
+}
+
+// Read the metadata to write into every output
+static int loadMetadata(const char *path) {
+    unsigned char *meta;
+    unsigned int metaSize;
+    unsigned char *buf;
+    long bufSize;
+
+    bufSize = readFile((char *) path, (void **) &buf);
+    if (!bufSize)
+        return 1;
+
+    if (metadataFromBlob(buf, bufSize, &meta, &metaSize)) {
+        error("no usable metadata in %s", path);
+        free(buf);
+        return 1;
+    }
+
+    free(buf);
+    options.metadata = meta;
+    options.metadataSize = metaSize;
+
+    return 0;
+}
+
 void usage(void) {
-    printf("usage: %s [options] input.jpg output.jpg\n\n", progname);
+    printf("usage: %s [options] input.jpg output.jpg\n", progname);
+    printf("       %s [options] --serve socket\n\n", progname);
     printf("options:\n\n");
     printf("  -V, --version                output program version\n");
     printf("  -h, --help                   output program help\n");
@@ -228,46 +177,91 @@ void usage(void) {
     printf("  -x, --max [arg]              maximum JPEG quality [95]\n");
     printf("  -l, --loops [arg]            set the number of runs to attempt [6]\n");
     printf("  -a, --accurate               favor accuracy over speed\n");
+    printf("  -f, --fine                   search fractional qualities as well, for outputs closer to the target\n");
+    printf("      --tolerance [arg]        stop searching at a quality that meets the target by at most this much [0]\n");
     printf("  -m, --method [arg]           set comparison method to one of 'mpe', 'ssim', 'ms-ssim', 'smallfry' [ssim]\n");
     printf("  -s, --strip                  strip metadata\n");
     printf("  -d, --defish [arg]           set defish strength [0.0]\n");
     printf("  -z, --zoom [arg]             set defish zoom [1.0]\n");
     printf("  -r, --ppm                    parse input as PPM\n");
     printf("  -c, --no-copy                disable copying files that will not be compressed\n");
+    printf("      --min-savings [arg]      copy files that would not get at least this many percent smaller [0]\n");
     printf("  -p, --no-progressive         disable progressive encoding\n");
+    printf("      --scans [arg]            use progressive scan scripts learned by jpeg-archive --learn-scans\n");
     printf("  -S, --subsample [arg]        set subsampling method to one of 'default', 'disable' [default]\n");
     printf("  -T, --input-filetype [arg]   set input file type to one of 'auto', 'jpeg', 'ppm' [auto]\n");
+    printf("  -M, --max-memory [arg]       stream large images in strips to stay within this many MB\n");
+    printf("  -H, --hash                   embed an image hash in the output and print it\n");
+    printf("      --metadata-from [arg]    write metadata from a JPEG, EXIF or XMP file instead of that of the input\n");
+    printf("  -C, --cache [arg]            reuse and store results of identical inputs in a cache directory\n");
+    printf("      --cache-output           store whole outputs in the cache, not just their quality\n");
     printf("  -Q, --quiet                  only print out errors\n");
+    printf("  -D, --serve [arg]            serve requests on this Unix socket, see README\n");
+    printf("  -j, --jobs [arg]             number of server worker processes [CPU count]\n");
 }
 
-int main (int argc, char **argv) {
-    const char *optstring = "Vht:q:n:x:l:am:sd:z:rcpS:T:Q";
-    static const struct option opts[] = {
-        { "version", no_argument, 0, 'V' },
-        { "help", no_argument, 0, 'h' },
-        { "target", required_argument, 0, 't' },
-        { "quality", required_argument, 0, 'q' },
-        { "min", required_argument, 0, 'n' },
-        { "max", required_argument, 0, 'x' },
-        { "loops", required_argument, 0, 'l' },
-        { "accurate", no_argument, 0, 'a' },
-        { "method", required_argument, 0, 'm' },
-        { "strip", no_argument, 0, 's' },
-        { "defish", required_argument, 0, 'd' },
-        { "zoom", required_argument, 0, 'z' },
-        { "ppm", no_argument, 0, 'r' },
-        { "no-copy", no_argument, 0, 'c' },
-        { "no-progressive", no_argument, 0, 'p' },
-        { "subsample", required_argument, 0, 'S' },
-        { "input-filetype", required_argument, 0, 'T' },
-        { "quiet", no_argument, 0, 'Q' },
-        { 0, 0, 0, 0 }
-    };
+static const char *optstring = "Vht:q:n:x:l:afm:sd:z:rcpS:T:M:HC:QD:j:";
+static const struct option longOptions[] = {
+    { "version", no_argument, 0, 'V' },
+    { "help", no_argument, 0, 'h' },
+    { "target", required_argument, 0, 't' },
+    { "quality", required_argument, 0, 'q' },
+    { "min", required_argument, 0, 'n' },
+    { "max", required_argument, 0, 'x' },
+    { "loops", required_argument, 0, 'l' },
+    { "accurate", no_argument, 0, 'a' },
+    { "fine", no_argument, 0, 'f' },
+    { "tolerance", required_argument, 0, OPT_TOLERANCE },
+    { "method", required_argument, 0, 'm' },
+    { "strip", no_argument, 0, 's' },
+    { "defish", required_argument, 0, 'd' },
+    { "zoom", required_argument, 0, 'z' },
+    { "ppm", no_argument, 0, 'r' },
+    { "no-copy", no_argument, 0, 'c' },
+    { "min-savings", required_argument, 0, OPT_MIN_SAVINGS },
+    { "no-progressive", no_argument, 0, 'p' },
+    { "scans", required_argument, 0, OPT_SCANS },
+    { "subsample", required_argument, 0, 'S' },
+    { "input-filetype", required_argument, 0, 'T' },
+    { "max-memory", required_argument, 0, 'M' },
+    { "hash", no_argument, 0, 'H' },
+    { "cache", required_argument, 0, 'C' },
+    { "cache-output", no_argument, 0, OPT_CACHE_OUTPUT },
+    { "metadata-from", required_argument, 0, OPT_METADATA_FROM },
+    { "quiet", no_argument, 0, 'Q' },
+    { "serve", required_argument, 0, 'D' },
+    { "jobs", required_argument, 0, 'j' },
+    { 0, 0, 0, 0 }
+};
+
+// Long name of an option, every option has one
+static const char *optionName(int opt) {
+    for (int x = 0; longOptions[x].name != NULL; x++) {
+        if (longOptions[x].val == opt)
+            return longOptions[x].name;
+    }
+
+    return "?";
+}
+
+/*
+    Parse command line options into the globals. Options that only make
+    sense for the whole program are refused in server requests. Returns
+    -1 to carry on, or the status to exit with.
+*/
+static int parseOptions(int argc, char **argv, int request) {
     int opt, longind = 0;
 
-    progname = "jpeg-recompress";
+    while ((opt = getopt_long(argc, argv, optstring, longOptions, &longind)) != -1) {
+        // getopt has already said what is wrong with the option
+        if (request && opt == '?')
+            return 1;
+
+        if (request && (strchr("VhCDj", opt) || opt == OPT_CACHE_OUTPUT || opt == OPT_METADATA_FROM || opt == OPT_SCANS)) {
+            error("option not allowed in a request: --%s", optionName(opt));
+            return 1;
+        }
 
-    while ((opt = getopt_long(argc, argv, optstring, opts, &longind)) != -1) {
         switch (opt) {
         case 'V':
             version();
@@ -276,333 +270,438 @@ int main (int argc, char **argv) {
             usage();
             return 0;
         case 't':
-            target = atof(optarg);
+            options.target = atof(optarg);
             break;
         case 'q':
-            preset = parseQuality(optarg);
+            options.preset = jpeg_archive_parse_preset(optarg);
             break;
         case 'n':
-            jpegMin = atoi(optarg);
+            options.jpegMin = atoi(optarg);
             break;
         case 'x':
-            jpegMax = atoi(optarg);
+            options.jpegMax = atoi(optarg);
             break;
         case 'l':
-            attempts = atoi(optarg);
+            options.attempts = atoi(optarg);
             break;
         case 'a':
-            accurate = 1;
+            options.accurate = 1;
+            break;
+        case 'f':
+            options.fineQuality = 1;
+            break;
+        case OPT_TOLERANCE:
+            options.tolerance = atof(optarg);
+            break;
+        case OPT_MIN_SAVINGS:
+            options.minSavings = atof(optarg);
             break;
         case 'm':
-            method = parseMethod(optarg);
+            options.method = jpeg_archive_parse_method(optarg);
             break;
         case 's':
-            strip = 1;
+            options.strip = 1;
             break;
         case 'd':
-            defishStrength = atof(optarg);
+            options.defishStrength = atof(optarg);
             break;
         case 'z':
-            defishZoom = atof(optarg);
+            options.defishZoom = atof(optarg);
             break;
         case 'r':
-            inputFiletype = FILETYPE_PPM;
+            options.inputFiletype = FILETYPE_PPM;
             break;
         case 'c':
-            copyFiles = 0;
+            options.copyFiles = 0;
             break;
         case 'p':
-            noProgressive = 1;
+            options.noProgressive = 1;
             break;
         case 'S':
-            subsample = parseSubsampling(optarg);
+            options.subsample = jpeg_archive_parse_subsample(optarg);
             break;
         case 'T':
-            if (inputFiletype != FILETYPE_AUTO) {
+            if (options.inputFiletype != FILETYPE_AUTO) {
                 error("multiple file types specified for the input file");
                 return 1;
             }
-            inputFiletype = parseInputFiletype(optarg);
+            options.inputFiletype = parseInputFiletype(optarg);
+            break;
+        case 'M':
+            options.maxMemory = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'H':
+            options.embedHash = 1;
+            break;
+        case 'C':
+            options.cacheDir = optarg;
+            break;
+        case OPT_CACHE_OUTPUT:
+            options.cacheOutput = 1;
+            break;
+        case OPT_METADATA_FROM:
+            metadataPath = optarg;
+            break;
+        case OPT_SCANS:
+            scansPath = optarg;
             break;
         case 'Q':
-            quiet = 1;
+            options.quiet = 1;
+            break;
+        case 'D':
+            servePath = optarg;
+            break;
+        case 'j':
+            serveJobs = atoi(optarg);
             break;
         };
     }
 
-    if (argc - optind != 2) {
-        usage();
-        return 255;
-    }
+    return -1;
+}
 
-    if (method == UNKNOWN) {
+// Validate the options, returning 0 if they are valid or the status to exit with
+static int checkOptions(void) {
+    if (options.method == JPEG_ARCHIVE_UNKNOWN) {
         error("invalid method!");
-        usage();
         return 255;
     }
 
-    // No target passed, use preset!
-    if (!target) {
-        setTargetFromPreset();
+    if (options.jpegMin > options.jpegMax) {
+        error("maximum JPEG quality must not be smaller than minimum JPEG quality!");
+        return 1;
     }
 
+    return 0;
+}
+
+#ifndef _WIN32
+
+/*
+    Server requests and responses are frames starting with big-endian
+    32-bit fields:
+
+        request     options size, image size, options, image
+        response    status, stats size, image size, stats, image
+
+    The options are command line options separated by whitespace,
+    applied on top of those the server was started with. The stats are
+    key=value pairs separated by spaces.
+*/
+#define REQUEST_HEADER_SIZE 8
+#define RESPONSE_HEADER_SIZE 12
+#define MAX_REQUEST_OPTIONS 4096
+#define MAX_REQUEST_IMAGE (256UL * 1024 * 1024)
+
+enum responseStatus {
+    // The image was recompressed
+    RESPONSE_OK,
+    // The image is the input unchanged, see the reason in the stats
+    RESPONSE_ORIGINAL,
+    RESPONSE_BAD_REQUEST,
+    RESPONSE_FAILED
+};
+
+// The options the server was started with, which every request starts from
+static struct jpeg_archive_ctx serverOptions;
+
+// Apply the options of a request, returning 0 if they are valid
+static int applyRequestOptions(char *text) {
+    char *argv[MAX_REQUEST_OPTIONS / 2 + 2];
+    int argc = 0;
+
+    options = serverOptions;
+
+    argv[argc++] = (char *) progname;
+    for (char *arg = strtok(text, " \t\r\n"); arg != NULL; arg = strtok(NULL, " \t\r\n"))
+        argv[argc++] = arg;
+    argv[argc] = NULL;
+
+    // Start parsing from scratch, as every request is a new command line
+#ifdef __GLIBC__
+    optind = 0;
+#else
+    optind = 1;
+    optreset = 1;
+#endif
+
+    if (parseOptions(argc, argv, 1) != -1)
+        return 1;
+
+    if (optind != argc) {
+        error("unexpected argument in a request: %s", argv[optind]);
+        return 1;
+    }
+
+    return checkOptions();
+}
+
+static int sendResponse(int fd, enum responseStatus status, const char *stats, const struct slice *image, int count) {
+    unsigned char header[RESPONSE_HEADER_SIZE];
+    struct slice slices[JPEG_ARCHIVE_SLICES + 2];
+    unsigned long imageSize = 0;
+
+    for (int x = 0; x < count; x++) {
+        imageSize += image[x].size;
+        slices[x + 2] = image[x];
+    }
+
+    putUint32(header, status);
+    putUint32(header + 4, strlen(stats));
+    putUint32(header + 8, imageSize);
+
+    slices[0] = (struct slice) { header, sizeof header };
+    slices[1] = (struct slice) { stats, strlen(stats) };
+
+    return writeSlicesFd(fd, slices, count + 2);
+}
+
+/*
+    Handle one request, returning 0 to read the next one from the same
+    connection. Requests are handled strictly one after the other, so a
+    client that keeps sending without reading is held back by the socket
+    buffers.
+*/
+static int serveRequest(int fd) {
+    unsigned char header[REQUEST_HEADER_SIZE];
+    struct jpeg_archive_image image;
+    struct jpeg_archive_stats stats;
+    struct slice slices[JPEG_ARCHIVE_SLICES];
+    char statsText[128 + sizeof stats.hash];
+    enum jpeg_archive_status status;
+    char *text;
     unsigned char *buf;
-    long bufSize = 0;
-    unsigned char *original;
-    long originalSize = 0;
-    unsigned char *originalGray = NULL;
-    long originalGraySize = 0;
-    unsigned char *compressed = NULL;
-    unsigned long compressedSize = 0;
-    unsigned char *compressedGray;
-    long compressedGraySize = 0;
-    unsigned char *tmpImage;
-    int width, height;
-    unsigned char *metaBuf;
-    unsigned int metaSize = 0;
-    FILE *file;
-    char *inputPath = argv[optind];
-    char *outputPath = argv[optind + 1];
+    int ret;
 
-    /* Read the input into a buffer. */
-    bufSize = readFile(inputPath, (void **) &buf);
+    ret = readFull(fd, header, sizeof header);
+    if (ret)
+        return 1;
 
-    /* Detect input file type. */
-    if (inputFiletype == FILETYPE_AUTO)
-        inputFiletype = detectFiletypeFromBuffer(buf, bufSize);
+    uint32_t optionsSize = getUint32(header);
+    uint32_t imageSize = getUint32(header + 4);
 
-    /*
-     * Read original image and decode. We need the raw buffer contents and its
-     * size to obtain meta data and the original file size later.
-     */
-    originalSize = decodeFileFromBuffer(buf, bufSize, &original, inputFiletype, &width, &height, JCS_RGB);
-    if (!originalSize) {
-        error("invalid input file: %s", inputPath);
+    if (optionsSize > MAX_REQUEST_OPTIONS || !imageSize || imageSize > MAX_REQUEST_IMAGE) {
+        error("invalid request frame, closing connection");
+        sendResponse(fd, RESPONSE_BAD_REQUEST, "reason=frame", NULL, 0);
         return 1;
     }
 
-    if (defishStrength) {
-        info("Defishing...\n");
-        tmpImage = malloc(width * height * 3);
-        defish(original, tmpImage, width, height, 3, defishStrength, defishZoom);
-        free(original);
-        original = tmpImage;
+    text = malloc(optionsSize + 1);
+    buf = malloc(imageSize);
+    if (text == NULL || buf == NULL || readFull(fd, text, optionsSize) || readFull(fd, buf, imageSize)) {
+        free(text);
+        free(buf);
+        return 1;
     }
+    text[optionsSize] = '\0';
 
-    // Convert RGB input into Y
-    originalGraySize = grayscale(original, &originalGray, width, height);
-
-    if (inputFiletype == FILETYPE_JPEG) {
-        // Read metadata (EXIF / IPTC / XMP tags)
-        if (getMetadata(buf, bufSize, &metaBuf, &metaSize, COMMENT)) {
-            if (copyFiles) {
-                info("File already processed by jpeg-recompress!\n");
-                file = openOutput(outputPath);
-                if (file == NULL) {
-                    error("could not open output file: %s", outputPath);
-                    return 1;
-                }
-
-                fwrite(buf, bufSize, 1, file);
-                fclose(file);
-
-                free(buf);
-
-                return 0;
-            } else {
-                error("file already processed by jpeg-recompress!");
-                free(buf);
-                return 2;
-            }
-        }
+    if (applyRequestOptions(text)) {
+        ret = sendResponse(fd, RESPONSE_BAD_REQUEST, "reason=options", NULL, 0);
+        free(text);
+        free(buf);
+        return ret;
     }
 
-    if (strip) {
-        // Pretend we have no metadata
-        metaSize = 0;
+    status = jpeg_archive_recompress(&options, "request", buf, imageSize, NULL, NULL, 0, 0, &image, &stats);
+
+    if (status == JPEG_ARCHIVE_OK) {
+        snprintf(statsText, sizeof statsText, "quality=%g %s=%f size=%lu original=%lu%s%s",
+            stats.quality, jpeg_archive_method_name(options.method), stats.metric, stats.size,
+            stats.originalSize, stats.hash[0] ? " hash=" : "", stats.hash);
+        jpeg_archive_slices(&image, &stats, slices);
+        ret = sendResponse(fd, RESPONSE_OK, statsText, slices, JPEG_ARCHIVE_SLICES);
+    } else if (status == JPEG_ARCHIVE_LARGER || (status == JPEG_ARCHIVE_PROCESSED && options.copyFiles)) {
+        snprintf(statsText, sizeof statsText, "reason=%s size=%lu original=%lu",
+            (status == JPEG_ARCHIVE_LARGER) ? "larger" : "processed", stats.originalSize, stats.originalSize);
+        slices[0] = (struct slice) { buf, imageSize };
+        ret = sendResponse(fd, RESPONSE_ORIGINAL, statsText, slices, 1);
     } else {
-        info("Metadata size is %ukb\n", metaSize / 1024);
+        ret = sendResponse(fd, RESPONSE_FAILED, (status == JPEG_ARCHIVE_PROCESSED) ? "reason=processed" : "reason=image", NULL, 0);
     }
 
-    if (!originalSize || !originalGraySize) { return 1; }
+    jpeg_archive_free_image(&image);
+    free(text);
+    free(buf);
 
-    if (jpegMin > jpegMax) {
-        error("maximum JPEG quality must not be smaller than minimum JPEG quality!");
-        return 1;
-    }
+    return ret;
+}
 
-    // Do a binary search to find the optimal encoding quality for the
-    // given target SSIM value.
-    int min = jpegMin, max = jpegMax;
-    for (int attempt = attempts - 1; attempt >= 0; --attempt) {
-        float metric;
-        int quality = min + (max - min) / 2;
+static void serveConnection(int fd) {
+    while (!serveRequest(fd));
+}
 
-        /* Terminate early once bisection interval is a singleton. */
-        if (min == max)
-            attempt = 0;
+/*
+    Run a tiny image through the encoder and decoder, so the first real
+    request does not pay for faulting in code and setting up the heap.
+*/
+static void warmUp(void) {
+    unsigned char pixels[16 * 16 * 3];
+    unsigned char *jpeg = NULL, *gray = NULL;
+    unsigned long size;
+    int width, height;
 
-        int progressive = attempt ? 0 : !noProgressive;
-        int optimize = accurate ? 1 : (attempt ? 0 : 1);
+    memset(pixels, 128, sizeof pixels);
+    size = encodeJpeg(&jpeg, pixels, 16, 16, JCS_RGB, 80, !options.noProgressive, 1, options.subsample, NULL);
+    if (size)
+        decodeJpeg(jpeg, size, &gray, &width, &height, JCS_GRAYSCALE);
 
-        // Recompress to a new quality level, without optimizations (for speed)
-        compressedSize = encodeJpeg(&compressed, original, width, height, JCS_RGB, quality, progressive, optimize, subsample);
+    free(jpeg);
+    free(gray);
+}
 
-        // Load compressed luma for quality comparison
-        compressedGraySize = decodeJpeg(compressed, compressedSize, &compressedGray, &width, &height, JCS_GRAYSCALE);
+static int runServer(void) {
+    serverOptions = options;
+    if (checkOptions())
+        return 1;
 
-        if (!compressedGraySize) {
-          error("unable to decode file that was just encoded!");
-          return 1;
-        }
+    if (serveJobs < 1)
+        serveJobs = cpuCount();
 
-        if (!attempt) {
-            info("Final optimized ");
-        }
+    info("Serving on %s with %i workers\n", servePath, serveJobs);
 
-        // Measure quality difference
-        switch (method) {
-            case MS_SSIM:
-                metric = iqa_ms_ssim(originalGray, compressedGray, width, height, width, 0);
-                info("ms-ssim");
-                break;
-            case SMALLFRY:
-                metric = smallfry_metric(originalGray, compressedGray, width, height);
-                info("smallfry");
-                break;
-            case MPE:
-                metric = meanPixelError(originalGray, compressedGray, width, height, 1);
-                info("mpe");
-                break;
-            case SSIM: default:
-                metric = iqa_ssim(originalGray, compressedGray, width, height, width, 0, 0);
-                info("ssim");
-                break;
-        }
+    return serve(servePath, serveJobs, warmUp, serveConnection);
+}
 
-        if (attempt) {
-            info(" at q=%i (%i - %i): %f\n", quality, min, max, metric);
-        } else {
-            info(" at q=%i: %f\n", quality, metric);
-        }
+#else
 
-        if (metric < target) {
-            if (compressedSize >= bufSize) {
-                free(compressed);
-                free(compressedGray);
-
-                if (copyFiles) {
-                    info("Output file would be larger than input!\n");
-                    file = openOutput(outputPath);
-                    if (file == NULL) {
-                        error("could not open output file: %s", outputPath);
-                        return 1;
-                    }
-
-                    fwrite(buf, bufSize, 1, file);
-                    fclose(file);
-
-                    free(buf);
-
-                    return 0;
-                } else {
-                    error("output file would be larger than input!");
-                    free(buf);
-                    return 1;
-                }
-            }
+static int runServer(void) {
+    return serve(servePath, 1, NULL, NULL);
+}
 
-            switch (method) {
-                case SSIM: case MS_SSIM: case SMALLFRY:
-                    // Too distorted, increase quality
-                    min = MIN(quality + 1, max);
-                    break;
-                case MPE:
-                    // Higher than required, decrease quality
-                    max = MAX(quality - 1, min);
-                    break;
-            }
-        } else {
-            switch (method) {
-                case SSIM: case MS_SSIM: case SMALLFRY:
-                    // Higher than required, decrease quality
-                    max = MAX(quality - 1, min);
-                    break;
-                case MPE:
-                    // Too distorted, increase quality
-                    min = MIN(quality + 1, max);
-                    break;
-            }
-        }
+#endif
 
-        // If we aren't done yet, then free the image data
-        if (attempt) {
-            free(compressed);
-            free(compressedGray);
-        }
-    }
+int main (int argc, char **argv) {
+    int ret;
 
-    free(buf);
+    progname = "jpeg-recompress";
+    jpeg_archive_init(&options);
 
-    // Calculate and show savings, if any
-    int percent = (compressedSize + metaSize) * 100 / bufSize;
-    unsigned long saved = (bufSize > compressedSize) ? bufSize - compressedSize - metaSize : 0;
-    info("New size is %i%% of original (saved %lu kb)\n", percent, saved / 1024);
+    ret = parseOptions(argc, argv, 0);
+    if (ret != -1)
+        return ret;
 
-    if (compressedSize >= bufSize) {
-        error("output file is larger than input, aborting!");
-        return 1;
+    if (argc - optind != (servePath != NULL ? 0 : 2)) {
+        usage();
+        return 255;
     }
 
-    // Open output file for writing
-    file = openOutput(outputPath);
-    if (file == NULL) {
-        error("could not open output file");
+    if (options.cacheDir && openResultCache(options.cacheDir))
         return 1;
-    }
 
-    /* Check that the metadata starts with a SOI marker. */
-    if (!checkJpegMagic(compressed, compressedSize)) {
-        error("missing SOI marker, aborting!");
+    if (metadataPath != NULL && loadMetadata(metadataPath))
         return 1;
+
+    if (scansPath != NULL) {
+        if (loadScanScripts(scansPath, &scans))
+            return 1;
+        options.scans = &scans;
     }
 
-    /* Make sure APP0 is recorded immediately after the SOI marker. */
-    if (compressed[2] != 0xff || compressed[3] != 0xe0) {
-        error("missing APP0 marker, aborting!");
-        return 1;
+    if (servePath != NULL)
+        return runServer();
+
+    ret = checkOptions();
+    if (ret) {
+        if (ret == 255)
+            usage();
+        return ret;
     }
 
-    /* Write SOI marker and APP0 metadata to the output file. */
-    int app0_len = (compressed[4] << 8) + compressed[5];
-    fwrite(compressed, 4 + app0_len, 1, file);
+    unsigned char *buf = NULL;
+    long bufSize = 0;
+    unsigned char *original = NULL;
+    unsigned char *originalGray = NULL;
+    int width = 0, height = 0;
+    struct jpeg_archive_image image;
+    struct jpeg_archive_stats stats;
+    struct slice slices[JPEG_ARCHIVE_SLICES];
+    FILE *file;
+    char *inputPath = argv[optind];
+    char *outputPath = argv[optind + 1];
+
+    /* Detect the type of files on disk from their first bytes. */
+    if (options.inputFiletype == FILETYPE_AUTO && strcmp("-", inputPath))
+        options.inputFiletype = detectFiletype(inputPath);
 
     /*
-     * Write comment (COM metadata) so we know not to reprocess this file in
-     * the future if it gets passed in again.
+     * Look for our own COM marker before reading in the whole file. Only the
+     * headers up to SOS are scanned, so files that were already processed
+     * are copied through without any pixel work.
      */
-    fputc(0xff, file);
-    fputc(0xfe, file);
-    fputc(0x00, file);
-    fputc(strlen(COMMENT) + 2, file);
-    fwrite(COMMENT, strlen(COMMENT), 1, file);
-
-    /* Write additional metadata markers. */
-    if (inputFiletype == FILETYPE_JPEG && !strip) {
-        fwrite(metaBuf, metaSize, 1, file);
+    if (options.inputFiletype != FILETYPE_PPM && strcmp("-", inputPath)) {
+        file = fopen(inputPath, "rb");
+        if (file != NULL) {
+            int processed = findJpegComment(file, COMMENT);
+            fclose(file);
+
+            if (processed)
+                return alreadyProcessed(inputPath, outputPath, NULL, 0);
+        }
     }
 
-    /* Write image data. */
-    fwrite(compressed + 4 + app0_len, compressedSize - 4 - app0_len, 1, file);
-    fclose(file);
+    if (options.inputFiletype == FILETYPE_PPM && !options.maxMemory && !options.cacheDir) {
+        /*
+         * Read PPM input (e.g. piped from dcraw) straight into the original
+         * image, converting each chunk of rows to grayscale as it arrives.
+         * Defishing needs the whole image first, so it converts afterwards.
+         * Cached results are keyed by the input bytes, so those need them.
+         */
+        if (!readPpm(inputPath, &original, &width, &height, &bufSize, options.defishStrength ? NULL : grayscaleRows, &originalGray)) {
+            error("invalid input file: %s", inputPath);
+            return 1;
+        }
+    } else {
+        /* Read the input into a buffer. */
+        bufSize = readFile(inputPath, (void **) &buf);
+    }
 
-    if (inputFiletype == FILETYPE_JPEG && !strip) {
-        free(metaBuf);
+    switch (jpeg_archive_recompress(&options, inputPath, buf, bufSize, original, originalGray, width, height, &image, &stats)) {
+        case JPEG_ARCHIVE_OK:
+            break;
+        case JPEG_ARCHIVE_LARGER:
+            ret = copyOriginal(inputPath, outputPath, buf, bufSize);
+            jpeg_archive_free_image(&image);
+            free(buf);
+            return ret;
+        case JPEG_ARCHIVE_PROCESSED:
+            ret = alreadyProcessed(inputPath, outputPath, buf, bufSize);
+            jpeg_archive_free_image(&image);
+            free(buf);
+            return ret;
+        default:
+            jpeg_archive_free_image(&image);
+            free(buf);
+            return 1;
     }
 
-    free(compressed);
-    free(original);
-    free(originalGray);
+    free(buf);
+
+    if (stats.hash[0]) {
+        // Standard output may be carrying the image itself
+        if (strcmp("-", outputPath))
+            printf("%s\n", stats.hash);
+        else
+            info("Hash is %s\n", stats.hash);
+    }
 
-    return 0;
+    // Open output file for writing
+    file = openOutput(outputPath);
+    if (file == NULL) {
+        error("could not open output file");
+        jpeg_archive_free_image(&image);
+        return 1;
+    }
+
+    jpeg_archive_slices(&image, &stats, slices);
+
+    ret = 0;
+    if (writeSlices(file, slices, JPEG_ARCHIVE_SLICES)) {
+        error("could not write output file: %s", outputPath);
+        ret = 1;
+    }
+    fclose(file);
+
+    jpeg_archive_free_image(&image);
+
+    return ret;
 }
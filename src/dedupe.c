@@ -0,0 +1,199 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "dedupe.h"
+#include "hash.h"
+#include "parallel.h"
+#include "util.h"
+
+// In larger buckets each image is only compared to the next ones
+#define MAX_BUCKET 64
+
+/* An image in one band's table, sorted by the band value. */
+struct bandEntry {
+    uint16_t key;
+    uint32_t image;
+};
+
+/* State shared by the band workers. */
+struct bandState {
+    const uint64_t *hashes;
+    const char *hashed;
+    long count;
+    int words;
+    int radius;
+    struct dedupePair *pairs;
+    long pairCount;
+    long pairSize;
+    // Set if a pair could not be added
+    int failed;
+    pthread_mutex_t lock;
+};
+
+static uint16_t bandValue(const uint64_t *hash, int band) {
+    int bit = band * DEDUPE_BAND_BITS;
+
+    // Bands never straddle words since 64 is a multiple of DEDUPE_BAND_BITS
+    return (hash[bit / 64] >> (bit % 64)) & 0xffff;
+}
+
+static int compareBandEntries(const void *a, const void *b) {
+    const struct bandEntry *entry1 = a, *entry2 = b;
+
+    if (entry1->key != entry2->key)
+        return entry1->key < entry2->key ? -1 : 1;
+
+    return entry1->image < entry2->image ? -1 : (entry1->image > entry2->image);
+}
+
+static int comparePairs(const void *a, const void *b) {
+    const struct dedupePair *pair1 = a, *pair2 = b;
+
+    if (pair1->a != pair2->a)
+        return pair1->a < pair2->a ? -1 : 1;
+
+    return pair1->b < pair2->b ? -1 : (pair1->b > pair2->b);
+}
+
+/* Compare the images that share a value in one band. */
+static void bandWork(long band, void *data) {
+    struct bandState *state = data;
+    struct bandEntry *table = malloc((state->count ? state->count : 1) * sizeof(struct bandEntry));
+    struct dedupePair *pairs = NULL;
+    long count = 0, pairCount = 0, pairSize = 0;
+
+    if (table == NULL) {
+        error("out of memory");
+        state->failed = 1;
+        return;
+    }
+
+    for (long x = 0; x < state->count; x++) {
+        if (!state->hashed[x])
+            continue;
+
+        table[count].key = bandValue(state->hashes + x * state->words, band);
+        table[count].image = x;
+        count++;
+    }
+
+    qsort(table, count, sizeof *table, compareBandEntries);
+
+    for (long start = 0, end; start < count; start = end) {
+        for (end = start + 1; end < count && table[end].key == table[start].key; end++);
+
+        for (long x = start; x < end; x++) {
+            const uint64_t *hash = state->hashes + table[x].image * state->words;
+
+            for (long y = x + 1; y < end && y <= x + MAX_BUCKET; y++) {
+                if (hammingDist(hash, state->hashes + table[y].image * state->words, state->words) > (unsigned int) state->radius)
+                    continue;
+
+                if (pairCount == pairSize) {
+                    struct dedupePair *grown;
+
+                    pairSize = pairSize ? pairSize * 2 : 256;
+                    grown = realloc(pairs, pairSize * sizeof(struct dedupePair));
+                    if (grown == NULL) {
+                        error("out of memory");
+                        state->failed = 1;
+                        free(pairs);
+                        free(table);
+                        return;
+                    }
+                    pairs = grown;
+                }
+
+                pairs[pairCount].a = table[x].image;
+                pairs[pairCount].b = table[y].image;
+                pairs[pairCount].confirmed = 1;
+                pairCount++;
+            }
+        }
+    }
+
+    free(table);
+
+    pthread_mutex_lock(&state->lock);
+    if (state->pairCount + pairCount > state->pairSize) {
+        long newSize = MAX(state->pairSize * 2, state->pairCount + pairCount);
+        struct dedupePair *grown = realloc(state->pairs, newSize * sizeof(struct dedupePair));
+
+        if (grown == NULL) {
+            error("out of memory");
+            state->failed = 1;
+            pairCount = 0;
+        } else {
+            state->pairs = grown;
+            state->pairSize = newSize;
+        }
+    }
+    memcpy(state->pairs + state->pairCount, pairs, pairCount * sizeof(struct dedupePair));
+    state->pairCount += pairCount;
+    pthread_mutex_unlock(&state->lock);
+
+    free(pairs);
+}
+
+long findPairs(const uint64_t *hashes, const char *hashed, long count, int hashSize, int radius, int jobs, struct dedupePair **pairs) {
+    struct bandState state;
+    long unique = 0;
+
+    memset(&state, 0, sizeof state);
+    state.hashes = hashes;
+    state.hashed = hashed;
+    state.count = count;
+    state.words = HASH_WORDS(hashSize);
+    state.radius = radius;
+    pthread_mutex_init(&state.lock, NULL);
+
+    runParallel(hashSize * hashSize / DEDUPE_BAND_BITS, jobs, bandWork, &state);
+
+    pthread_mutex_destroy(&state.lock);
+
+    // Missing pairs would split clusters without a trace
+    if (state.failed) {
+        free(state.pairs);
+        *pairs = NULL;
+        return -1;
+    }
+
+    // The same pair can turn up in several bands
+    qsort(state.pairs, state.pairCount, sizeof(struct dedupePair), comparePairs);
+
+    for (long x = 0; x < state.pairCount; x++) {
+        if (!unique || comparePairs(&state.pairs[x], &state.pairs[unique - 1]))
+            state.pairs[unique++] = state.pairs[x];
+    }
+
+    *pairs = state.pairs;
+
+    return unique;
+}
+
+uint32_t findRoot(uint32_t *parent, uint32_t x) {
+    while (parent[x] != x) {
+        // Path halving keeps the trees flat
+        parent[x] = parent[parent[x]];
+        x = parent[x];
+    }
+
+    return x;
+}
+
+long mergePairs(const struct dedupePair *pairs, long pairCount, long count, uint32_t *parent) {
+    long matched = 0;
+
+    for (long x = 0; x < count; x++)
+        parent[x] = x;
+
+    for (long x = 0; x < pairCount; x++) {
+        if (!pairs[x].confirmed)
+            continue;
+
+        parent[findRoot(parent, pairs[x].a)] = findRoot(parent, pairs[x].b);
+        matched++;
+    }
+
+    return matched;
+}
@@ -0,0 +1,44 @@
+/*
+    Grouping of similar image hashes
+*/
+#ifndef DEDUPE_H
+#define DEDUPE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+    Hashes are split into 16-bit bands. Two hashes within a distance r
+    of each other share at least one band as long as r is less than the
+    number of bands, so only hashes with an identical band are compared
+    (locality-sensitive hashing) and the work grows with the number of
+    likely matches instead of the number of possible pairs.
+*/
+#define DEDUPE_BAND_BITS 16
+
+/* A pair of images whose hashes are within the radius. */
+struct dedupePair {
+    uint32_t a;
+    uint32_t b;
+    int confirmed;
+};
+
+/*
+    Find all pairs of hashes within radius bits of each other that share
+    a band, comparing the bands with the given number of threads. Hashes
+    are packed with HASH_WORDS(hashSize) words each, and those whose
+    hashed flag is 0 are skipped. Sets pairs to a malloc'd array sorted
+    by image numbers, each pair once with a < b and confirmed set, and
+    returns the number of pairs, or -1 on error.
+*/
+long findPairs(const uint64_t *hashes, const char *hashed, long count, int hashSize, int radius, int jobs, struct dedupePair **pairs);
+
+/*
+    Merge the images of all confirmed pairs into clusters with union-find.
+    Sets parent to a forest over count images, whose roots findRoot gives,
+    and returns the number of merged pairs.
+*/
+long mergePairs(const struct dedupePair *pairs, long pairCount, long count, uint32_t *parent);
+uint32_t findRoot(uint32_t *parent, uint32_t x);
+
+#endif
@@ -0,0 +1,66 @@
+#include <string.h>
+
+#include "digest.h"
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static const uint64_t c1 = 0x87c37b91114253d5ULL;
+static const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+static uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+
+    return k;
+}
+
+void digestBuffer(const void *buf, size_t size, uint8_t digest[DIGEST_SIZE]) {
+    const unsigned char *data = buf;
+    const unsigned char *tail;
+    size_t blocks = size / 16;
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+    uint64_t k1, k2;
+
+    for (size_t x = 0; x < blocks; x++) {
+        // Unaligned reads, assuming a little-endian CPU
+        memcpy(&k1, data + x * 16, 8);
+        memcpy(&k2, data + x * 16 + 8, 8);
+
+        k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = ROTL64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = ROTL64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    tail = data + blocks * 16;
+    k1 = 0;
+    k2 = 0;
+
+    // Mixing in zero is a no-op, so short tails need no special case
+    for (size_t x = 0; x < (size & 15); x++) {
+        if (x < 8)
+            k1 ^= (uint64_t) tail[x] << (x * 8);
+        else
+            k2 ^= (uint64_t) tail[x] << ((x - 8) * 8);
+    }
+
+    k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+    k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+
+    h1 ^= size;
+    h2 ^= size;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    memcpy(digest, &h1, 8);
+    memcpy(digest + 8, &h2, 8);
+}
@@ -0,0 +1,19 @@
+/*
+    Content digests of files
+*/
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DIGEST_SIZE 16
+
+/*
+    Compute a 128-bit digest of a buffer (MurmurHash3 x64 128). This is
+    not a cryptographic hash, it only tells whether the contents of a
+    file have changed.
+*/
+void digestBuffer(const void *buf, size_t size, uint8_t digest[DIGEST_SIZE]);
+
+#endif
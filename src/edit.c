@@ -63,19 +63,23 @@ void defish(const unsigned char *input, unsigned char *output, int width, int he
     }
 }
 
-long grayscale(const unsigned char *input, unsigned char **output, int width, int height) {
-    int stride = width * 3;
-
-    *output = malloc(width * height);
+void grayscaleInto(const unsigned char *input, unsigned char *output, int width, int height) {
+    size_t stride = (size_t) width * 3;
 
     for (int y = 0; y < height; y++) {
         for (int x = 0; x < width; x++) {
-            // Y = 0.299R + 0.587G + 0.114B
-            (*output)[y * width + x] = input[y * stride + x * 3] * 0.299 +
-                                       input[y * stride + x * 3 + 1] * 0.587 +
-                                       input[y * stride + x * 3 + 2] * 0.114 + 0.5;
+            // Y = 0.299R + 0.587G + 0.114B, in the fixed point libjpeg uses
+            output[y * (size_t) width + x] = (input[y * stride + x * 3] * 19595L +
+                                              input[y * stride + x * 3 + 1] * 38470L +
+                                              input[y * stride + x * 3 + 2] * 7471L + 32768) >> 16;
         }
     }
+}
+
+long grayscale(const unsigned char *input, unsigned char **output, int width, int height) {
+    *output = malloc((size_t) width * height);
+
+    grayscaleInto(input, *output, width, height);
 
-    return width * height;
+    return (size_t) width * height;
 }
@@ -29,8 +29,10 @@ void defish(const unsigned char *input, unsigned char *output, int width, int he
 
 /*
     Convert an RGB image to grayscale. Assumes 8-bit color components, 
-    3 color components and a row stride of width * 3.
+    3 color components and a row stride of width * 3. The result is the
+    same Y plane libjpeg would encode.
 */
 long grayscale(const unsigned char *input, unsigned char **output, int width, int height);
+void grayscaleInto(const unsigned char *input, unsigned char *output, int width, int height);
 
 #endif
@@ -1,4 +1,6 @@
+#include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "hash.h"
 #include "util.h"
@@ -17,63 +19,220 @@ void scale(unsigned char *image, int width, int height, unsigned char **newImage
     }
 }
 
-void genHash(unsigned char *image, int width, int height, unsigned char **hash) {
-    *hash = malloc((unsigned long) width * height);
+void genHash(unsigned char *image, int width, int height, uint64_t **hash) {
+    int pixels = width * height;
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            int pos = y * width + x;
+    *hash = calloc((pixels + 63) / 64, sizeof(uint64_t));
 
-            (*hash)[pos] = image[pos] < image[pos + 1];
+    // The last pixel has no neighbor and always gets a zero bit
+    for (int pos = 0; pos < pixels - 1; pos++) {
+        if (image[pos] < image[pos + 1])
+            (*hash)[pos / 64] |= (uint64_t) 1 << (pos % 64);
+    }
+}
+
+void hashImage(unsigned char *image, int width, int height, uint64_t **hash, int size) {
+    unsigned char *scaled;
+
+    scale(image, width, height, &scaled, size, size);
+    genHash(scaled, size, size, hash);
+    free(scaled);
+}
+
+void hashGrayImage(const unsigned char *image, int width, int height, uint64_t **hash, int size) {
+    int denom = previewScale(width, height, MAX(size, hashLevelSizes[HASH_LEVELS - 1]));
+    int planeWidth = (width + denom - 1) / denom;
+    int planeHeight = (height + denom - 1) / denom;
+    unsigned char *plane = malloc((size_t) planeWidth * planeHeight);
+
+    // Average each denom x denom block, like the DC of a scaled decode
+    for (int py = 0; py < planeHeight; py++) {
+        for (int px = 0; px < planeWidth; px++) {
+            int yEnd = MIN((py + 1) * denom, height);
+            int xEnd = MIN((px + 1) * denom, width);
+            unsigned int sum = 0, count = 0;
+
+            for (int y = py * denom; y < yEnd; y++) {
+                for (int x = px * denom; x < xEnd; x++) {
+                    sum += image[(size_t) y * width + x];
+                }
+                count += xEnd - px * denom;
+            }
+
+            plane[py * planeWidth + px] = (sum + count / 2) / count;
         }
     }
+
+    hashImage(plane, planeWidth, planeHeight, hash, size);
+    free(plane);
+}
+
+void formatHash(const uint64_t *hash, int size, char *text) {
+    text += sprintf(text, "%d:", size);
+
+    for (int x = 0; x < HASH_WORDS(size); x++) {
+        text += sprintf(text, "%016" PRIx64, hash[x]);
+    }
 }
 
-int jpegHash(const char *filename, unsigned char **hash, int size) {
+int parseHash(const char *text, uint64_t **hash, int size) {
+    char word[17];
+    char *end;
+    int words = HASH_WORDS(size);
+
+    if (strtol(text, &end, 10) != size || *end != ':')
+        return 1;
+    text = end + 1;
+
+    if (strspn(text, "0123456789abcdef") < (size_t) words * 16)
+        return 1;
+
+    *hash = malloc(words * sizeof(uint64_t));
+    if (*hash == NULL)
+        return 1;
+
+    word[16] = '\0';
+    for (int x = 0; x < words; x++) {
+        memcpy(word, text + x * 16, 16);
+        (*hash)[x] = strtoull(word, NULL, 16);
+    }
+
+    return 0;
+}
+
+int readEmbeddedHash(FILE *file, uint64_t **hash, int size) {
+    char *text = malloc(HASH_TEXT_SIZE(size));
+    int ret = 1;
+
+    if (text == NULL)
+        return 1;
+
+    if (readJpegComment(file, RECOMPRESS_COMMENT HASH_COMMENT, text, HASH_TEXT_SIZE(size)))
+        ret = parseHash(text, hash, size);
+
+    free(text);
+    return ret;
+}
+
+int readEmbeddedHashFromBuffer(const unsigned char *buf, unsigned long bufSize, uint64_t **hash, int size) {
+    char *text = malloc(HASH_TEXT_SIZE(size));
+    int ret = 1;
+
+    if (text == NULL)
+        return 1;
+
+    if (readJpegCommentFromBuffer(buf, bufSize, RECOMPRESS_COMMENT HASH_COMMENT, text, HASH_TEXT_SIZE(size)))
+        ret = parseHash(text, hash, size);
+
+    free(text);
+    return ret;
+}
+
+const int hashLevelSizes[HASH_LEVELS] = { 8, 16, 32 };
+
+void hashPyramid(unsigned char *image, int width, int height, uint64_t *hashes[HASH_LEVELS]) {
+    for (int level = 0; level < HASH_LEVELS; level++) {
+        hashImage(image, width, height, &hashes[level], hashLevelSizes[level]);
+    }
+}
+
+void freeHashPyramid(uint64_t *hashes[HASH_LEVELS]) {
+    for (int level = 0; level < HASH_LEVELS; level++) {
+        free(hashes[level]);
+        hashes[level] = NULL;
+    }
+}
+
+unsigned int hashDiff(const uint64_t *hash1, const uint64_t *hash2, int size) {
+    return hammingDist(hash1, hash2, HASH_WORDS(size)) * 100 / (size * size);
+}
+
+int hashBit(const uint64_t *hash, int bit) {
+    return (hash[bit / 64] >> (bit % 64)) & 1;
+}
+
+unsigned long decodeHashPlane(FILE *file, const unsigned char *buf, unsigned long bufSize, int size, unsigned char **image, int *width, int *height) {
+    // Use the same plane for every hash up to the finest pyramid level,
+    // so hashes of different sizes stay comparable across tools
+    int minSize = MAX(size, hashLevelSizes[HASH_LEVELS - 1]);
+
+    return decodeJpegPreview(file, buf, bufSize, minSize, image, width, height);
+}
+
+int jpegHash(const char *filename, uint64_t **hash, int size) {
     unsigned char *image;
     unsigned long imageSize = 0;
-    unsigned char *scaled;
     int width, height;
+    FILE *file;
+
+    if (!strcmp("-", filename)) {
+        unsigned char *buf;
+        long bufSize = readFile("-", (void **) &buf);
+        int ret = jpegHashFromBuffer(buf, bufSize, hash, size);
 
-    imageSize = decodeFile(filename, &image, FILETYPE_JPEG, &width, &height, JCS_GRAYSCALE);
+        free(buf);
+        return ret;
+    }
+
+    file = fopen(filename, "rb");
+    if (!file) {
+        error("unable to open file: %s", filename);
+        return 1;
+    }
+
+    if (!readEmbeddedHash(file, hash, size)) {
+        fclose(file);
+        return 0;
+    }
+    rewind(file);
+
+    imageSize = decodeHashPlane(file, NULL, 0, size, &image, &width, &height);
+    fclose(file);
 
     if (!imageSize)
         return 1;
 
-    scale(image, width, height, &scaled, size, size);
+    hashImage(image, width, height, hash, size);
     free(image);
-    genHash(scaled, size, size, hash);
-    free(scaled);
 
     return 0;
 }
 
-int jpegHashFromBuffer(unsigned char *imageBuf, long bufSize, unsigned char **hash, int size) {
+int jpegHashFromBuffer(unsigned char *imageBuf, long bufSize, uint64_t **hash, int size) {
     unsigned char *image;
     unsigned long imageSize = 0;
-    unsigned char *scaled;
     int width, height;
 
-    imageSize = decodeFileFromBuffer(imageBuf, bufSize, &image, FILETYPE_JPEG, &width, &height, JCS_GRAYSCALE);
+    if (!readEmbeddedHashFromBuffer(imageBuf, bufSize, hash, size))
+        return 0;
+
+    imageSize = decodeHashPlane(NULL, imageBuf, bufSize, size, &image, &width, &height);
 
     if (!imageSize)
         return 1;
 
-    scale(image, width, height, &scaled, size, size);
+    hashImage(image, width, height, hash, size);
     free(image);
-    genHash(scaled, size, size, hash);
-    free(scaled);
 
     return 0;
 }
 
-unsigned int hammingDist(const unsigned char *hash1, const unsigned char *hash2, int hashLength) {
+static unsigned int popcount64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (x * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+unsigned int hammingDist(const uint64_t *hash1, const uint64_t *hash2, int words) {
     unsigned int dist = 0;
 
-    for (unsigned int x = 0; x < hashLength; x++) {
-        if (hash1[x] != hash2[x]) {
-            dist++;
-        }
+    for (int x = 0; x < words; x++) {
+        dist += popcount64(hash1[x] ^ hash2[x]);
     }
 
     return dist;
@@ -4,13 +4,79 @@
 #ifndef HASH_H
 #define HASH_H
 
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+    Hashes are packed one bit per pixel into 64-bit words. This is the
+    number of words needed for a size x size hash.
+*/
+#define HASH_WORDS(size) (((size) * (size) + 63) / 64)
+
 /*
     Generate an image hash given a filename. This is a convenience
     function which reads the file, decodes it to grayscale,
-    scales the image, and generates the hash.
+    scales the image, and generates the hash. Large images are decoded
+    at a reduced DCT scale, see decodeHashPlane. A hash embedded by
+    jpeg-recompress is used instead of decoding when it is present.
+*/
+int jpegHash(const char *filename, uint64_t **hash, int size);
+int jpegHashFromBuffer(unsigned char *imageBuf, long bufSize, uint64_t **hash, int size);
+
+/*
+    Sizes of the levels of a hash pyramid, from coarse to fine, which
+    all come from a single decode. A level does not bound the difference
+    at another: its bits compare pixels a different distance apart, and
+    their order can change while every bit of the other level stays.
+*/
+#define HASH_LEVELS 3
+extern const int hashLevelSizes[HASH_LEVELS];
+
+/*
+    Decode the grayscale plane that hashes of the given size are made
+    from. Large images are decoded at up to 1/8 scale, which for
+    progressive files only needs the first DC scan. Reads from file if
+    it is not NULL, otherwise from buf. Returns 0 on error.
+*/
+unsigned long decodeHashPlane(FILE *file, const unsigned char *buf, unsigned long bufSize, int size, unsigned char **image, int *width, int *height);
+
+/*
+    Generate the hash of a full size grayscale image. The image is first
+    averaged down to the plane decodeHashPlane would decode from a JPEG
+    of it, so the result matches jpegHash of the encoded image closely.
 */
-int jpegHash(const char *filename, unsigned char **hash, int size);
-int jpegHashFromBuffer(unsigned char *imageBuf, long bufSize, unsigned char **hash, int size);
+void hashGrayImage(const unsigned char *image, int width, int height, uint64_t **hash, int size);
+
+/*
+    Hashes can be embedded in the COM marker of jpeg-recompress output,
+    after RECOMPRESS_COMMENT and HASH_COMMENT, as the hash size, a colon
+    and the packed words in hex, e.g. "16:0123456789abcdef...".
+*/
+#define HASH_COMMENT " hash="
+#define HASH_TEXT_SIZE(size) (12 + HASH_WORDS(size) * 16)
+
+/* Format a hash into text holding at least HASH_TEXT_SIZE(size) bytes. */
+void formatHash(const uint64_t *hash, int size, char *text);
+
+/* Parse a formatted hash of the given size. Returns 0 on success. */
+int parseHash(const char *text, uint64_t **hash, int size);
+
+/*
+    Read a hash of the given size embedded in the headers of a JPEG
+    file, without decoding it. Returns 0 if one was found.
+*/
+int readEmbeddedHash(FILE *file, uint64_t **hash, int size);
+int readEmbeddedHashFromBuffer(const unsigned char *buf, unsigned long bufSize, uint64_t **hash, int size);
+
+/* Generate a size x size hash of a decoded grayscale image. */
+void hashImage(unsigned char *image, int width, int height, uint64_t **hash, int size);
+
+/* Generate the hashes of every pyramid level of a decoded grayscale image. */
+void hashPyramid(unsigned char *image, int width, int height, uint64_t *hashes[HASH_LEVELS]);
+void freeHashPyramid(uint64_t *hashes[HASH_LEVELS]);
+
+/* Difference of two hashes of the given size in percent, from 0 to 99. */
+unsigned int hashDiff(const uint64_t *hash1, const uint64_t *hash2, int size);
 
 /*
     Downscale an image with nearest-neighbor interpolation.
@@ -22,12 +88,16 @@ void scale(unsigned char *image, int width, int height, unsigned char **newImage
     Generate an image hash based on gradients.
     http://www.hackerfactor.com/blog/index.php?/archives/529-Kind-of-Like-That.html
 */
-void genHash(unsigned char *image, int width, int height, unsigned char **hash);
+void genHash(unsigned char *image, int width, int height, uint64_t **hash);
+
+/* Get a single bit (0 or 1) of a packed hash. */
+int hashBit(const uint64_t *hash, int bit);
 
 /*
-    Calculate the hamming distance between two hashes.
+    Calculate the hamming distance between two packed hashes of the
+    given number of 64-bit words, using popcount.
     http://en.wikipedia.org/wiki/Hamming_distance
 */
-unsigned int hammingDist(const unsigned char *hash1, const unsigned char *hash2, int hashLength);
+unsigned int hammingDist(const uint64_t *hash1, const uint64_t *hash2, int words);
 
 #endif
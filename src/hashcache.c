@@ -0,0 +1,277 @@
+// Needed for st_mtim, ftruncate etc. under -std=c99
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#include "hash.h"
+#include "hashcache.h"
+#include "util.h"
+
+// Only compact caches with at least this many records
+#define COMPACT_MIN_RECORDS 1024
+
+#ifdef _WIN32
+
+// Inode numbers are not available, so there is nothing to key files by
+int openHashCache(const char *filename, int hashSize, struct hashCache *cache) {
+    error("hash cache is not supported on this platform");
+    return 1;
+}
+
+void closeHashCache(struct hashCache *cache) {
+}
+
+int cachedJpegHash(struct hashCache *cache, const char *filename, uint64_t **hash, int size) {
+    return jpegHash(filename, hash, size);
+}
+
+#else
+
+static int64_t mtimeNs(const struct stat *st) {
+#ifdef __APPLE__
+    return (int64_t) st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+static struct hashCacheKey *recordKey(const struct hashCache *cache, long record) {
+    return (struct hashCacheKey *) (cache->records + record * cache->recordSize);
+}
+
+/* Find the slot of a file, which holds -1 if the file is not cached. */
+static size_t findSlot(const struct hashCache *cache, uint64_t dev, uint64_t ino) {
+    uint64_t h = dev * 0x9e3779b97f4a7c15ULL ^ ino;
+    size_t slot;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    for (slot = h & cache->mask; cache->slots[slot] != -1; slot = (slot + 1) & cache->mask) {
+        struct hashCacheKey *key = recordKey(cache, cache->slots[slot]);
+
+        if (key->dev == dev && key->ino == ino)
+            break;
+    }
+
+    return slot;
+}
+
+/* Index the records by file, returning the number of distinct files. */
+static long buildTable(struct hashCache *cache) {
+    size_t size = 64;
+    long live = 0;
+
+    while (size < (size_t) cache->count * 2)
+        size *= 2;
+
+    cache->slots = malloc(size * sizeof(long));
+    if (cache->slots == NULL)
+        return -1;
+
+    for (size_t x = 0; x < size; x++)
+        cache->slots[x] = -1;
+    cache->mask = size - 1;
+
+    // Later records replace earlier ones for the same file
+    for (long x = 0; x < cache->count; x++) {
+        struct hashCacheKey *key = recordKey(cache, x);
+        size_t slot = findSlot(cache, key->dev, key->ino);
+
+        if (cache->slots[slot] == -1)
+            live++;
+        cache->slots[slot] = x;
+    }
+
+    return live;
+}
+
+static void initHeader(struct hashCacheHeader *header, int hashSize) {
+    memset(header, 0, sizeof *header);
+    memcpy(header->magic, HASHCACHE_MAGIC, 4);
+    header->version = HASHCACHE_VERSION;
+    header->hashSize = hashSize;
+    header->words = HASH_WORDS(hashSize);
+}
+
+/* Rewrite the cache file with only the newest record of every file. */
+static int compactCache(const char *filename, const struct hashCache *cache) {
+    struct hashCacheHeader header;
+    char *tmpName = malloc(strlen(filename) + 5);
+    FILE *file;
+
+    if (tmpName == NULL)
+        return 1;
+
+    sprintf(tmpName, "%s.tmp", filename);
+    file = fopen(tmpName, "wb");
+    if (!file) {
+        free(tmpName);
+        return 1;
+    }
+
+    initHeader(&header, cache->hashSize);
+    fwrite(&header, sizeof header, 1, file);
+
+    for (size_t slot = 0; slot <= cache->mask; slot++) {
+        if (cache->slots[slot] != -1)
+            fwrite(recordKey(cache, cache->slots[slot]), cache->recordSize, 1, file);
+    }
+
+    int failed = ferror(file);
+
+    failed |= fclose(file);
+    if (failed || rename(tmpName, filename)) {
+        remove(tmpName);
+        free(tmpName);
+        return 1;
+    }
+
+    free(tmpName);
+    return 0;
+}
+
+int openHashCache(const char *filename, int hashSize, struct hashCache *cache) {
+    struct hashCacheHeader header;
+    struct stat st;
+    long size = 0;
+    long live;
+    int stale = 0;
+
+    memset(cache, 0, sizeof *cache);
+    cache->hashSize = hashSize;
+    cache->words = HASH_WORDS(hashSize);
+    cache->recordSize = sizeof(struct hashCacheKey) + cache->words * sizeof(uint64_t);
+    cache->fd = -1;
+
+    // A missing or empty cache file is simply a cold cache
+    if (!stat(filename, &st) && st.st_size > 0) {
+        size = readFile((char *) filename, &cache->data);
+        if (!size) {
+            error("could not read hash cache file: %s", filename);
+            return 1;
+        }
+
+        memcpy(&header, cache->data, MIN((size_t) size, sizeof header));
+        if ((size_t) size < sizeof header || memcmp(header.magic, HASHCACHE_MAGIC, 4)) {
+            error("invalid hash cache file: %s", filename);
+            closeHashCache(cache);
+            return 1;
+        }
+    }
+
+    // Hashes from another version are simply dropped
+    if (size && header.version != HASHCACHE_VERSION) {
+        free(cache->data);
+        cache->data = NULL;
+        stale = 1;
+        size = 0;
+    }
+
+    if (size) {
+        if (header.hashSize != (uint32_t) hashSize) {
+            error("hash cache %s holds hashes of size %u, not %d", filename, header.hashSize, hashSize);
+            closeHashCache(cache);
+            return 1;
+        }
+
+        // Ignore a record cut short by an interrupted write
+        cache->records = (unsigned char *) cache->data + sizeof header;
+        cache->count = (size - sizeof header) / cache->recordSize;
+    }
+
+    live = buildTable(cache);
+    if (live < 0) {
+        error("out of memory");
+        closeHashCache(cache);
+        return 1;
+    }
+
+    if (cache->count >= COMPACT_MIN_RECORDS && live * 2 < cache->count) {
+        if (compactCache(filename, cache))
+            error("could not compact hash cache file: %s", filename);
+        else
+            size = sizeof header + live * cache->recordSize;
+    }
+
+    cache->fd = open(filename, O_WRONLY | O_APPEND | O_CREAT | (stale ? O_TRUNC : 0), 0666);
+    if (cache->fd < 0) {
+        error("could not open hash cache file: %s", filename);
+        closeHashCache(cache);
+        return 1;
+    }
+
+    if (!size) {
+        initHeader(&header, hashSize);
+        if (write(cache->fd, &header, sizeof header) != sizeof header) {
+            error("could not write hash cache file: %s", filename);
+            closeHashCache(cache);
+            return 1;
+        }
+    } else if ((size - sizeof header) % cache->recordSize) {
+        if (ftruncate(cache->fd, sizeof header + cache->count * cache->recordSize))
+            error("could not truncate hash cache file: %s", filename);
+    }
+
+    return 0;
+}
+
+void closeHashCache(struct hashCache *cache) {
+    if (cache->fd >= 0)
+        close(cache->fd);
+    free(cache->data);
+    free(cache->slots);
+    memset(cache, 0, sizeof *cache);
+    cache->fd = -1;
+}
+
+int cachedJpegHash(struct hashCache *cache, const char *filename, uint64_t **hash, int size) {
+    struct hashCacheKey key;
+    struct stat st;
+    unsigned char *record;
+
+    if (cache == NULL || cache->hashSize != size || !strcmp(filename, "-") || stat(filename, &st))
+        return jpegHash(filename, hash, size);
+
+    memset(&key, 0, sizeof key);
+    key.dev = st.st_dev;
+    key.ino = st.st_ino;
+    key.size = st.st_size;
+    key.mtime = mtimeNs(&st);
+
+    // The table is only read after opening, so lookups need no locking
+    long found = cache->slots[findSlot(cache, key.dev, key.ino)];
+    if (found != -1 && !memcmp(recordKey(cache, found), &key, sizeof key)) {
+        *hash = malloc(cache->words * sizeof(uint64_t));
+        if (*hash == NULL)
+            return 1;
+
+        memcpy(*hash, (unsigned char *) recordKey(cache, found) + sizeof key, cache->words * sizeof(uint64_t));
+        return 0;
+    }
+
+    if (jpegHash(filename, hash, size))
+        return 1;
+
+    // A single append is atomic, so concurrent writers do not interleave
+    record = malloc(cache->recordSize);
+    if (record != NULL) {
+        memcpy(record, &key, sizeof key);
+        memcpy(record + sizeof key, *hash, cache->words * sizeof(uint64_t));
+        if (write(cache->fd, record, cache->recordSize) != (ssize_t) cache->recordSize)
+            error("could not write to hash cache");
+        free(record);
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,63 @@
+/*
+    Sidecar cache of image hashes
+*/
+#ifndef HASHCACHE_H
+#define HASHCACHE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+    A cache file is a header followed by an append-only log of records,
+    each holding the identity of a file when it was hashed and its
+    packed hash. A record is only used while the device, inode, size
+    and modification time (in nanoseconds) of the file still match, so
+    an unchanged file costs a stat call instead of a full decode. When
+    a file changes, a new record is appended and the newest one wins.
+    Superseded records are dropped once they outnumber the live ones.
+*/
+#define HASHCACHE_MAGIC "JAHC"
+#define HASHCACHE_VERSION 2
+
+struct hashCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t hashSize;
+    uint32_t words;
+};
+
+struct hashCacheKey {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;
+};
+
+struct hashCache {
+    int hashSize;
+    int words;
+    int fd;
+    size_t recordSize;
+    void *data;
+    unsigned char *records;
+    long count;
+    long *slots;
+    size_t mask;
+};
+
+/*
+    Open or create a cache file for hashes of the given size. Returns 0
+    on success.
+*/
+int openHashCache(const char *filename, int hashSize, struct hashCache *cache);
+void closeHashCache(struct hashCache *cache);
+
+/*
+    Get the hash of a JPEG file like jpegHash, but from the cache when
+    the file has not changed since it was last hashed. Otherwise the
+    file is decoded and the result appended to the cache. The cache may
+    be NULL, and may be shared by several threads. Returns 0 on success.
+*/
+int cachedJpegHash(struct hashCache *cache, const char *filename, uint64_t **hash, int size);
+
+#endif
@@ -0,0 +1,604 @@
+// Needed for mmap, fstat etc. under -std=c99
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+#include "hash.h"
+#include "index.h"
+#include "parallel.h"
+#include "util.h"
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t) 7)
+
+/* Files to hash while updating an index. */
+struct hashJob {
+    const char **paths;
+    uint64_t *hashes;
+    int *ok;
+    int hashSize;
+    int words;
+};
+
+/* Simple open addressing table to look up paths. */
+struct pathTable {
+    long *slots;
+    const char **names;
+    size_t mask;
+};
+
+/* State while probing the chunk tables around a query. */
+struct probeState {
+    const struct indexChunk *table;
+    uint64_t count;
+    int chunkBits;
+    uint32_t *candidates;
+    long candidateCount;
+    long candidateSize;
+    // Set if a candidate could not be added
+    int failed;
+};
+
+static int indexChunks(int hashSize) {
+    return (hashSize * hashSize + INDEX_CHUNK_BITS - 1) / INDEX_CHUNK_BITS;
+}
+
+static uint16_t chunkValue(const uint64_t *hash, int chunk) {
+    int bit = chunk * INDEX_CHUNK_BITS;
+
+    return (hash[bit / 64] >> (bit % 64)) & 0xffff;
+}
+
+/* Point the index sections into its data, returns 0 if valid. */
+static int setLayout(struct hashIndex *index) {
+    const unsigned char *data = index->data;
+    const struct indexHeader *header = index->data;
+    uint64_t pos, size;
+
+    if (index->dataSize < sizeof *header || memcmp(header->magic, INDEX_MAGIC, 4) ||
+            header->version != INDEX_VERSION || header->hashSize < 1 || header->hashSize > 256 ||
+            header->words != HASH_WORDS(header->hashSize) || header->count > index->dataSize) {
+        return 1;
+    }
+
+    index->hashSize = header->hashSize;
+    index->words = header->words;
+    index->chunks = indexChunks(header->hashSize);
+    index->count = header->count;
+
+    pos = sizeof *header;
+    index->entries = (const struct indexEntry *) (data + pos);
+    pos += index->count * sizeof(struct indexEntry);
+    index->hashes = (const uint64_t *) (data + pos);
+    pos += index->count * index->words * sizeof(uint64_t);
+    index->paths = (const char *) (data + pos);
+    pos += ALIGN8(header->pathsSize);
+    index->chunkTables = (const struct indexChunk *) (data + pos);
+    size = pos + index->count * index->chunks * sizeof(struct indexChunk);
+
+    if (size != index->dataSize || (index->count && index->paths[header->pathsSize - 1]))
+        return 1;
+
+    for (uint64_t x = 0; x < index->count; x++) {
+        if (index->entries[x].pathOffset >= header->pathsSize)
+            return 1;
+    }
+
+    return 0;
+}
+
+int openIndex(const char *filename, struct hashIndex *index) {
+    memset(index, 0, sizeof *index);
+
+#ifdef _WIN32
+    long size = readFile((char *) filename, &index->data);
+
+    if (!size)
+        return 1;
+
+    index->dataSize = size;
+#else
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        error("unable to open index: %s", filename);
+        return 1;
+    }
+
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(struct indexHeader)) {
+        error("invalid index file: %s", filename);
+        close(fd);
+        return 1;
+    }
+
+    // Map the index, pages are only read in as queries touch them
+    index->data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (index->data == MAP_FAILED) {
+        error("unable to map index: %s", filename);
+        index->data = NULL;
+        return 1;
+    }
+
+    index->dataSize = st.st_size;
+    index->mapped = 1;
+#endif
+
+    const struct indexHeader *header = index->data;
+
+    if (index->dataSize >= sizeof *header && !memcmp(header->magic, INDEX_MAGIC, 4) && header->version != INDEX_VERSION) {
+        error("index was built with an incompatible hash version, remove it to rebuild: %s", filename);
+        closeIndex(index);
+        return 1;
+    }
+
+    if (setLayout(index)) {
+        error("invalid index file: %s", filename);
+        closeIndex(index);
+        return 1;
+    }
+
+    return 0;
+}
+
+void closeIndex(struct hashIndex *index) {
+#ifndef _WIN32
+    if (index->mapped) {
+        munmap(index->data, index->dataSize);
+    } else
+#endif
+    {
+        free(index->data);
+    }
+
+    memset(index, 0, sizeof *index);
+}
+
+const char *indexPath(const struct hashIndex *index, uint64_t entry) {
+    return index->paths + index->entries[entry].pathOffset;
+}
+
+const uint64_t *indexHash(const struct hashIndex *index, uint64_t entry) {
+    return index->hashes + entry * index->words;
+}
+
+/* FNV-1a */
+static uint64_t hashString(const char *s) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while (*s) {
+        hash ^= (unsigned char) *s++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static int initPathTable(struct pathTable *table, long capacity) {
+    size_t size = 16;
+
+    while (size < (size_t) capacity * 2)
+        size *= 2;
+
+    table->slots = malloc(size * sizeof(long));
+    table->names = malloc(size * sizeof(char *));
+    table->mask = size - 1;
+
+    if (!table->slots || !table->names) {
+        free(table->slots);
+        free(table->names);
+        return 1;
+    }
+
+    memset(table->slots, 0xff, size * sizeof(long));
+
+    return 0;
+}
+
+static void freePathTable(struct pathTable *table) {
+    free(table->slots);
+    free(table->names);
+}
+
+/*
+    Look up a path, inserting it with the given value if it is missing
+    and value is not negative. Returns the stored value or -1.
+*/
+static long findPath(struct pathTable *table, const char *name, long value) {
+    size_t slot = hashString(name) & table->mask;
+
+    while (table->slots[slot] >= 0) {
+        if (!strcmp(table->names[slot], name))
+            return table->slots[slot];
+        slot = (slot + 1) & table->mask;
+    }
+
+    if (value >= 0) {
+        table->slots[slot] = value;
+        table->names[slot] = name;
+    }
+
+    return -1;
+}
+
+static void hashWork(long item, void *data) {
+    struct hashJob *job = data;
+    uint64_t *hash;
+
+    if (jpegHash(job->paths[item], &hash, job->hashSize)) {
+        error("error hashing image: %s", job->paths[item]);
+        job->ok[item] = 0;
+        return;
+    }
+
+    memcpy(job->hashes + item * job->words, hash, job->words * sizeof(uint64_t));
+    free(hash);
+    job->ok[item] = 1;
+}
+
+static int compareChunks(const void *a, const void *b) {
+    const struct indexChunk *chunk1 = a, *chunk2 = b;
+
+    if (chunk1->key != chunk2->key)
+        return chunk1->key < chunk2->key ? -1 : 1;
+
+    return chunk1->entry < chunk2->entry ? -1 : (chunk1->entry > chunk2->entry);
+}
+
+/* Write out an index from its entries, hashes and path strings. */
+static int writeIndex(const char *filename, int hashSize, const struct indexEntry *entries, const uint64_t *hashes, uint64_t count, const char *paths, uint64_t pathsSize) {
+    struct indexHeader header;
+    int words = HASH_WORDS(hashSize);
+    int chunks = indexChunks(hashSize);
+    uint64_t zero = 0;
+    struct indexChunk *table = malloc((count ? count : 1) * sizeof(struct indexChunk));
+    FILE *file = fopen(filename, "wb");
+
+    if (!file || !table) {
+        error("could not open index file for writing: %s", filename);
+        if (file)
+            fclose(file);
+        free(table);
+        return 1;
+    }
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, INDEX_MAGIC, 4);
+    header.version = INDEX_VERSION;
+    header.hashSize = hashSize;
+    header.words = words;
+    header.count = count;
+    header.pathsSize = pathsSize;
+
+    fwrite(&header, sizeof header, 1, file);
+    fwrite(entries, sizeof(struct indexEntry), count, file);
+    fwrite(hashes, sizeof(uint64_t) * words, count, file);
+    fwrite(paths, 1, pathsSize, file);
+    fwrite(&zero, 1, ALIGN8(pathsSize) - pathsSize, file);
+
+    // One table per chunk, sorted so queries can binary search it
+    for (int chunk = 0; chunk < chunks; chunk++) {
+        for (uint64_t x = 0; x < count; x++) {
+            table[x].key = chunkValue(hashes + x * words, chunk);
+            table[x].unused = 0;
+            table[x].entry = x;
+        }
+
+        qsort(table, count, sizeof *table, compareChunks);
+        fwrite(table, sizeof *table, count, file);
+    }
+
+    free(table);
+
+    if (ferror(file)) {
+        error("could not write index file: %s", filename);
+        fclose(file);
+        return 1;
+    }
+
+    return fclose(file) ? 1 : 0;
+}
+
+int updateIndex(const char *filename, char **paths, long count, int hashSize, int jobs) {
+    struct hashIndex old;
+    struct pathTable oldPaths, seen;
+    struct hashJob job;
+    struct stat st;
+    int haveOld = 0, words = HASH_WORDS(hashSize), ret = 1;
+    long total = 0, toHash = 0, reused = 0;
+    const char **names = NULL;
+    struct indexEntry *entries = NULL;
+    uint64_t *hashes = NULL;
+    long *pending = NULL;
+    char *pathData = NULL;
+    uint64_t pathsSize = 0;
+    char *tmpName = NULL;
+
+    memset(&job, 0, sizeof job);
+    memset(&oldPaths, 0, sizeof oldPaths);
+    memset(&seen, 0, sizeof seen);
+
+    // Load the existing index, if any, so unchanged files are not rehashed
+    if (!stat(filename, &st)) {
+        if (openIndex(filename, &old))
+            return 1;
+
+        if (old.hashSize != hashSize) {
+            error("index uses a hash size of %d, not %d", old.hashSize, hashSize);
+            closeIndex(&old);
+            return 1;
+        }
+
+        haveOld = 1;
+    }
+
+    long capacity = count + (haveOld ? old.count : 0);
+
+    names = malloc((capacity ? capacity : 1) * sizeof(char *));
+    entries = malloc((capacity ? capacity : 1) * sizeof(struct indexEntry));
+    hashes = malloc((capacity ? capacity : 1) * words * sizeof(uint64_t));
+    pending = malloc((capacity ? capacity : 1) * sizeof(long));
+    job.paths = malloc((capacity ? capacity : 1) * sizeof(char *));
+    job.hashes = malloc((capacity ? capacity : 1) * words * sizeof(uint64_t));
+    job.ok = malloc((capacity ? capacity : 1) * sizeof(int));
+
+    if (!names || !entries || !hashes || !pending || !job.paths || !job.hashes || !job.ok ||
+            initPathTable(&seen, capacity) || (haveOld && initPathTable(&oldPaths, old.count))) {
+        error("unable to allocate memory for the index!");
+        goto cleanup;
+    }
+
+    if (haveOld) {
+        for (uint64_t x = 0; x < old.count; x++) {
+            findPath(&oldPaths, indexPath(&old, x), x);
+        }
+    }
+
+    // Listed files first, then entries of the old index that still exist
+    for (long x = 0; x < capacity; x++) {
+        const char *name = (x < count) ? paths[x] : indexPath(&old, x - count);
+        long oldEntry;
+
+        if (findPath(&seen, name, x) >= 0)
+            continue;
+
+        if (stat(name, &st) || !S_ISREG(st.st_mode)) {
+            if (x < count)
+                error("unable to open file: %s", name);
+            continue;
+        }
+
+        names[total] = name;
+        entries[total].fileSize = st.st_size;
+        entries[total].mtime = st.st_mtime;
+
+        oldEntry = haveOld ? findPath(&oldPaths, name, -1) : -1;
+        if (oldEntry >= 0 && old.entries[oldEntry].fileSize == entries[total].fileSize &&
+                old.entries[oldEntry].mtime == entries[total].mtime) {
+            memcpy(hashes + total * words, indexHash(&old, oldEntry), words * sizeof(uint64_t));
+            reused++;
+        } else {
+            job.paths[toHash] = name;
+            pending[toHash++] = total;
+        }
+
+        total++;
+    }
+
+    // Hash new and changed files in parallel
+    job.hashSize = hashSize;
+    job.words = words;
+    runParallel(toHash, jobs, hashWork, &job);
+
+    // Drop files that failed to hash and lay out the path strings
+    long kept = 0;
+    long next = 0;
+
+    for (long x = 0; x < total; x++) {
+        if (next < toHash && pending[next] == x) {
+            if (!job.ok[next]) {
+                next++;
+                continue;
+            }
+            memcpy(hashes + x * words, job.hashes + next * words, words * sizeof(uint64_t));
+            next++;
+        }
+
+        names[kept] = names[x];
+        entries[kept] = entries[x];
+        memmove(hashes + kept * words, hashes + x * words, words * sizeof(uint64_t));
+        entries[kept].pathOffset = pathsSize;
+        pathsSize += strlen(names[x]) + 1;
+        kept++;
+    }
+
+    pathData = malloc(pathsSize ? pathsSize : 1);
+    tmpName = malloc(strlen(filename) + 5);
+    if (!pathData || !tmpName) {
+        error("unable to allocate memory for the index!");
+        goto cleanup;
+    }
+
+    for (long x = 0; x < kept; x++) {
+        strcpy(pathData + entries[x].pathOffset, names[x]);
+    }
+
+    // Replace the old index atomically
+    sprintf(tmpName, "%s.tmp", filename);
+    if (writeIndex(tmpName, hashSize, entries, hashes, kept, pathData, pathsSize)) {
+        remove(tmpName);
+        goto cleanup;
+    }
+
+    if (haveOld) {
+        closeIndex(&old);
+        haveOld = 0;
+    }
+
+    if (rename(tmpName, filename)) {
+        error("could not replace index file: %s", filename);
+        remove(tmpName);
+        goto cleanup;
+    }
+
+    fprintf(stderr, "Indexed %ld files (%ld hashed, %ld unchanged)\n", kept, kept - reused, reused);
+    ret = 0;
+
+cleanup:
+    if (haveOld) {
+        freePathTable(&oldPaths);
+        closeIndex(&old);
+    }
+    freePathTable(&seen);
+    free(names);
+    free(entries);
+    free(hashes);
+    free(pending);
+    free((void *) job.paths);
+    free(job.hashes);
+    free(job.ok);
+    free(pathData);
+    free(tmpName);
+
+    return ret;
+}
+
+static void addCandidate(struct probeState *state, uint32_t entry) {
+    if (state->candidateCount == state->candidateSize) {
+        long size = state->candidateSize ? state->candidateSize * 2 : 64;
+        uint32_t *reallocated = realloc(state->candidates, size * sizeof(uint32_t));
+
+        if (!reallocated) {
+            state->failed = 1;
+            return;
+        }
+
+        state->candidates = reallocated;
+        state->candidateSize = size;
+    }
+
+    state->candidates[state->candidateCount++] = entry;
+}
+
+/* Add all entries with exactly this chunk value. */
+static void lookupChunk(struct probeState *state, uint16_t key) {
+    uint64_t low = 0, high = state->count;
+
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+
+        if (state->table[mid].key < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    for (; low < state->count && state->table[low].key == key; low++) {
+        addCandidate(state, state->table[low].entry);
+    }
+}
+
+/* Look up every chunk value within flips bits of key. */
+static void probeChunk(struct probeState *state, uint16_t key, int from, int flips) {
+    lookupChunk(state, key);
+
+    if (!flips)
+        return;
+
+    for (int bit = from; bit < state->chunkBits; bit++) {
+        probeChunk(state, key ^ (1 << bit), bit + 1, flips - 1);
+    }
+}
+
+static int compareEntries(const void *a, const void *b) {
+    uint32_t entry1 = *(const uint32_t *) a, entry2 = *(const uint32_t *) b;
+
+    return entry1 < entry2 ? -1 : (entry1 > entry2);
+}
+
+long queryIndex(const struct hashIndex *index, const uint64_t *hash, int radius, uint64_t **matches) {
+    struct probeState state;
+    int bits = index->hashSize * index->hashSize;
+    int flips = radius / index->chunks;
+    double probes = 0, combinations = 1;
+    long found = 0;
+
+    memset(&state, 0, sizeof state);
+
+    // Number of chunk values to look up, per chunk
+    for (int x = 0; x <= flips && x <= INDEX_CHUNK_BITS; x++) {
+        probes += combinations;
+        combinations = combinations * (INDEX_CHUNK_BITS - x) / (x + 1);
+    }
+
+    *matches = malloc(sizeof(uint64_t) * 64);
+    long matchSize = 64;
+
+    if (*matches == NULL)
+        return -1;
+
+    if (probes * index->chunks * 32 >= index->count) {
+        // The radius is too large for lookups to beat a straight scan
+        for (uint64_t x = 0; x < index->count; x++) {
+            addCandidate(&state, x);
+        }
+    } else {
+        for (int chunk = 0; chunk < index->chunks; chunk++) {
+            state.table = index->chunkTables + chunk * index->count;
+            state.count = index->count;
+            state.chunkBits = MIN(INDEX_CHUNK_BITS, bits - chunk * INDEX_CHUNK_BITS);
+            probeChunk(&state, chunkValue(hash, chunk), 0, flips);
+        }
+
+        qsort(state.candidates, state.candidateCount, sizeof(uint32_t), compareEntries);
+    }
+
+    // Missing candidates would look like a complete result
+    if (state.failed) {
+        free(state.candidates);
+        free(*matches);
+        *matches = NULL;
+        return -1;
+    }
+
+    // Check the full distance of every distinct candidate
+    for (long x = 0; x < state.candidateCount; x++) {
+        uint32_t entry = state.candidates[x];
+
+        if (x && entry == state.candidates[x - 1])
+            continue;
+
+        if (hammingDist(hash, indexHash(index, entry), index->words) > (unsigned int) radius)
+            continue;
+
+        if (found == matchSize) {
+            uint64_t *reallocated = realloc(*matches, sizeof(uint64_t) * matchSize * 2);
+
+            if (!reallocated) {
+                free(state.candidates);
+                free(*matches);
+                *matches = NULL;
+                return -1;
+            }
+
+            *matches = reallocated;
+            matchSize *= 2;
+        }
+
+        (*matches)[found++] = entry;
+    }
+
+    free(state.candidates);
+
+    return found;
+}
@@ -0,0 +1,92 @@
+/*
+    Persistent image hash index
+*/
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+    On-disk layout, in native byte order and with every section 8-byte
+    aligned so the whole file can be memory-mapped and used in place:
+
+        header
+        entries     count x struct indexEntry
+        hashes      count x words x uint64_t
+        paths       NUL-terminated strings, padded to 8 bytes
+        chunks      chunks x count x struct indexChunk, each sorted by key
+
+    Every hash is split into 16-bit chunks. If two hashes are within a
+    distance r, at least one of their m chunks differs by no more than
+    r / m bits, so a query only looks up those nearby chunk values with
+    a binary search instead of scanning every entry (multi-index hashing).
+*/
+#define INDEX_MAGIC "JAHI"
+#define INDEX_VERSION 2
+#define INDEX_CHUNK_BITS 16
+
+struct indexHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t hashSize;
+    uint32_t words;
+    uint64_t count;
+    uint64_t pathsSize;
+};
+
+struct indexEntry {
+    uint64_t fileSize;
+    int64_t mtime;
+    uint64_t pathOffset;
+};
+
+struct indexChunk {
+    uint16_t key;
+    uint16_t unused;
+    uint32_t entry;
+};
+
+struct hashIndex {
+    int hashSize;
+    int words;
+    int chunks;
+    uint64_t count;
+    const struct indexEntry *entries;
+    const uint64_t *hashes;
+    const char *paths;
+    const struct indexChunk *chunkTables;
+    void *data;
+    size_t dataSize;
+    int mapped;
+};
+
+/*
+    Open an index file for querying. The file is memory-mapped where
+    possible. Returns 0 on success.
+*/
+int openIndex(const char *filename, struct hashIndex *index);
+void closeIndex(struct hashIndex *index);
+
+/* Get the path, hash and file size of an entry. */
+const char *indexPath(const struct hashIndex *index, uint64_t entry);
+const uint64_t *indexHash(const struct hashIndex *index, uint64_t entry);
+
+/*
+    Create or update an index from a list of image paths, hashing them
+    with the given number of worker threads. Entries of an existing
+    index are kept as long as their file still exists, and their hash
+    is reused when the file size and modification time are unchanged.
+    The new index is written to a temporary file and renamed into place.
+    Returns 0 on success.
+*/
+int updateIndex(const char *filename, char **paths, long count, int hashSize, int jobs);
+
+/*
+    Find all entries within radius bits of the given hash. Returns the
+    number of matches and sets matches to a malloc'd array of entry
+    numbers, or returns -1 on error.
+*/
+long queryIndex(const struct hashIndex *index, const uint64_t *hash, int radius, uint64_t **matches);
+
+#endif
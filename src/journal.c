@@ -0,0 +1,303 @@
+// Needed for ftruncate under -std=c99
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#include "journal.h"
+#include "util.h"
+
+// Only compact journals with at least this many records
+#define COMPACT_MIN_RECORDS 1024
+
+#define ALIGN8(x) (((x) + 7) & ~(size_t) 7)
+
+#ifdef _WIN32
+
+int openJournal(const char *filename, const uint8_t options[DIGEST_SIZE], struct journal *journal) {
+    error("journal is not supported on this platform");
+    return 1;
+}
+
+void closeJournal(struct journal *journal) {
+}
+
+const struct journalRecord *findJournal(const struct journal *journal, const char *path) {
+    return NULL;
+}
+
+int appendJournal(struct journal *journal, const char *path, struct journalRecord *record) {
+    return 1;
+}
+
+#else
+
+static size_t recordSize(size_t pathLength) {
+    return sizeof(struct journalRecord) + ALIGN8(pathLength);
+}
+
+static const struct journalRecord *getRecord(const struct journal *journal, long record) {
+    return (const struct journalRecord *) ((unsigned char *) journal->data + journal->records[record]);
+}
+
+static const char *recordPath(const struct journalRecord *record) {
+    return (const char *) (record + 1);
+}
+
+/* FNV-1a */
+static uint64_t hashPath(const char *path, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t x = 0; x < length; x++) {
+        hash ^= (unsigned char) path[x];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/* Find the slot of a path, which holds -1 if the path is not journaled. */
+static size_t findSlot(const struct journal *journal, const char *path, size_t length) {
+    size_t slot;
+
+    for (slot = hashPath(path, length) & journal->mask; journal->slots[slot] != -1; slot = (slot + 1) & journal->mask) {
+        const struct journalRecord *record = getRecord(journal, journal->slots[slot]);
+
+        if (record->pathLength == length && !memcmp(recordPath(record), path, length))
+            break;
+    }
+
+    return slot;
+}
+
+/* Index the records by path, returning the number of distinct paths. */
+static long buildTable(struct journal *journal) {
+    size_t size = 64;
+    long live = 0;
+
+    while (size < (size_t) journal->count * 2)
+        size *= 2;
+
+    journal->slots = malloc(size * sizeof(long));
+    if (journal->slots == NULL)
+        return -1;
+
+    for (size_t x = 0; x < size; x++)
+        journal->slots[x] = -1;
+    journal->mask = size - 1;
+
+    // Later records replace earlier ones for the same path
+    for (long x = 0; x < journal->count; x++) {
+        const struct journalRecord *record = getRecord(journal, x);
+        size_t slot = findSlot(journal, recordPath(record), record->pathLength);
+
+        if (journal->slots[slot] == -1)
+            live++;
+        journal->slots[slot] = x;
+    }
+
+    return live;
+}
+
+/* Find the complete records in the data, returning the size they take up. */
+static long scanRecords(struct journal *journal, long size) {
+    size_t pos = sizeof(struct journalHeader);
+    long capacity = 0;
+
+    while (pos + sizeof(struct journalRecord) <= (size_t) size) {
+        const struct journalRecord *record = (const struct journalRecord *) ((unsigned char *) journal->data + pos);
+        size_t length = recordSize(record->pathLength);
+
+        // Ignore a record cut short by an interrupted write
+        if (pos + length > (size_t) size)
+            break;
+
+        if (journal->count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            size_t *records = realloc(journal->records, capacity * sizeof(size_t));
+            if (records == NULL)
+                return -1;
+            journal->records = records;
+        }
+
+        journal->records[journal->count++] = pos;
+        pos += length;
+    }
+
+    return pos;
+}
+
+static void initHeader(struct journalHeader *header, const uint8_t options[DIGEST_SIZE]) {
+    memset(header, 0, sizeof *header);
+    memcpy(header->magic, JOURNAL_MAGIC, 4);
+    header->version = JOURNAL_VERSION;
+    memcpy(header->options, options, DIGEST_SIZE);
+}
+
+/* Rewrite the journal file with only the newest record of every path. */
+static int compactJournal(const char *filename, const struct journal *journal, const struct journalHeader *header, long *size) {
+    char *tmpName = malloc(strlen(filename) + 5);
+    FILE *file;
+
+    if (tmpName == NULL)
+        return 1;
+
+    sprintf(tmpName, "%s.tmp", filename);
+    file = fopen(tmpName, "wb");
+    if (!file) {
+        free(tmpName);
+        return 1;
+    }
+
+    fwrite(header, sizeof *header, 1, file);
+    *size = sizeof *header;
+
+    for (size_t slot = 0; slot <= journal->mask; slot++) {
+        if (journal->slots[slot] != -1) {
+            const struct journalRecord *record = getRecord(journal, journal->slots[slot]);
+
+            fwrite(record, recordSize(record->pathLength), 1, file);
+            *size += recordSize(record->pathLength);
+        }
+    }
+
+    int failed = ferror(file);
+
+    failed |= fclose(file);
+    if (failed || rename(tmpName, filename)) {
+        remove(tmpName);
+        free(tmpName);
+        return 1;
+    }
+
+    free(tmpName);
+    return 0;
+}
+
+int openJournal(const char *filename, const uint8_t options[DIGEST_SIZE], struct journal *journal) {
+    struct journalHeader header;
+    struct stat st;
+    long size = 0;
+    long used = 0;
+    long live;
+
+    memset(journal, 0, sizeof *journal);
+    journal->fd = -1;
+    initHeader(&header, options);
+
+    // A missing or empty journal simply means nothing was done yet
+    if (!stat(filename, &st) && st.st_size > 0) {
+        size = readFile((char *) filename, &journal->data);
+        if (!size) {
+            error("could not read journal file: %s", filename);
+            return 1;
+        }
+
+        if ((size_t) size < sizeof header || memcmp(journal->data, JOURNAL_MAGIC, 4)) {
+            error("invalid journal file: %s", filename);
+            closeJournal(journal);
+            return 1;
+        }
+    }
+
+    // Results of another version or with other options are dropped
+    if (size && memcmp(journal->data, &header, sizeof header)) {
+        free(journal->data);
+        journal->data = NULL;
+        journal->restarted = 1;
+        size = 0;
+    }
+
+    if (size) {
+        used = scanRecords(journal, size);
+        if (used < 0) {
+            error("out of memory");
+            closeJournal(journal);
+            return 1;
+        }
+    }
+
+    live = buildTable(journal);
+    if (live < 0) {
+        error("out of memory");
+        closeJournal(journal);
+        return 1;
+    }
+
+    if (journal->count >= COMPACT_MIN_RECORDS && live * 2 < journal->count) {
+        if (compactJournal(filename, journal, &header, &used))
+            error("could not compact journal file: %s", filename);
+        else
+            size = used;
+    }
+
+    journal->fd = open(filename, O_WRONLY | O_APPEND | O_CREAT | (journal->restarted ? O_TRUNC : 0), 0666);
+    if (journal->fd < 0) {
+        error("could not open journal file: %s", filename);
+        closeJournal(journal);
+        return 1;
+    }
+
+    if (!size) {
+        if (write(journal->fd, &header, sizeof header) != sizeof header) {
+            error("could not write journal file: %s", filename);
+            closeJournal(journal);
+            return 1;
+        }
+    } else if (used < size) {
+        if (ftruncate(journal->fd, used))
+            error("could not truncate journal file: %s", filename);
+    }
+
+    return 0;
+}
+
+void closeJournal(struct journal *journal) {
+    if (journal->fd >= 0)
+        close(journal->fd);
+    free(journal->data);
+    free(journal->records);
+    free(journal->slots);
+    memset(journal, 0, sizeof *journal);
+    journal->fd = -1;
+}
+
+const struct journalRecord *findJournal(const struct journal *journal, const char *path) {
+    // The table is only read after opening, so lookups need no locking
+    long found = journal->slots[findSlot(journal, path, strlen(path))];
+
+    return (found != -1) ? getRecord(journal, found) : NULL;
+}
+
+int appendJournal(struct journal *journal, const char *path, struct journalRecord *record) {
+    size_t length = strlen(path);
+    size_t size = recordSize(length);
+    unsigned char *buf;
+    int ret = 0;
+
+    if (length > UINT16_MAX)
+        return 1;
+
+    record->pathLength = length;
+
+    // A single append is atomic, so concurrent writers do not interleave
+    buf = calloc(1, size);
+    if (buf == NULL)
+        return 1;
+
+    memcpy(buf, record, sizeof *record);
+    memcpy(buf + sizeof *record, path, length);
+    if (write(journal->fd, buf, size) != (ssize_t) size)
+        ret = 1;
+
+    free(buf);
+    return ret;
+}
+
+#endif
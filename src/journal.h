@@ -0,0 +1,82 @@
+/*
+    Journal of processed files
+*/
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "digest.h"
+
+/*
+    A journal file is a header followed by an append-only log of
+    records, one written as every file is finished. A record holds the
+    path of the file relative to the folder being processed, its size,
+    modification time (in nanoseconds) and digest when it was read, and
+    the outcome. The header holds a digest of the options in effect, and
+    a journal written with other options is started over. When a file is
+    processed again, a new record is appended and the newest one wins.
+    Superseded records are dropped once they outnumber the live ones.
+*/
+#define JOURNAL_MAGIC "JAJL"
+#define JOURNAL_VERSION 2
+
+enum journalStatus {
+    JOURNAL_COMPRESSED = 1,
+    // The original was kept
+    JOURNAL_COPIED,
+    JOURNAL_FAILED
+};
+
+struct journalHeader {
+    char magic[4];
+    uint32_t version;
+    uint8_t options[DIGEST_SIZE];
+};
+
+/*
+    Followed by pathLength bytes of the path, without a terminating NUL
+    and padded with zeros to a multiple of 8 bytes.
+*/
+struct journalRecord {
+    uint64_t size;
+    int64_t mtime;
+    uint8_t digest[DIGEST_SIZE];
+    uint64_t outputSize;
+    float quality;
+    uint16_t status;
+    uint16_t pathLength;
+};
+
+struct journal {
+    int fd;
+    void *data;
+    // Offsets of all complete records in data
+    size_t *records;
+    long count;
+    long *slots;
+    size_t mask;
+    // Whether an existing journal was dropped, because the options changed
+    int restarted;
+};
+
+/*
+    Open or create a journal file for a run with the given options.
+    Returns 0 on success.
+*/
+int openJournal(const char *filename, const uint8_t options[DIGEST_SIZE], struct journal *journal);
+void closeJournal(struct journal *journal);
+
+/* Find the newest record of a path, or return NULL if there is none. */
+const struct journalRecord *findJournal(const struct journal *journal, const char *path);
+
+/*
+    Append a record for a path, filling in its pathLength. Records are
+    written with a single append, so any number of threads may add to a
+    journal at the same time. Lookups only see records that were there
+    when the journal was opened. Returns 0 on success.
+*/
+int appendJournal(struct journal *journal, const char *path, struct journalRecord *record);
+
+#endif
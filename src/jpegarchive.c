@@ -0,0 +1,845 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "edit.h"
+#include "iqa/include/iqa.h"
+#include "jpegarchive.h"
+#include "resultcache.h"
+#include "scans.h"
+#include "smallfry.h"
+
+static const char *COMMENT = RECOMPRESS_COMMENT;
+
+// Rough memory use per pixel: SSIM float planes plus grayscale images,
+// and the coefficient buffers libjpeg keeps for multi-pass coding
+#define METRIC_BYTES_PER_PIXEL 34
+#define CODER_BYTES_PER_PIXEL 6
+
+// The final optimized encode is rarely more than this much smaller
+// than a fast encode at the same quality
+#define PROBE_OPTIMIZE_GAIN 0.15
+
+void jpeg_archive_init(struct jpeg_archive_ctx *ctx) {
+    memset(ctx, 0, sizeof *ctx);
+    ctx->method = JPEG_ARCHIVE_SSIM;
+    ctx->attempts = 6;
+    ctx->preset = JPEG_ARCHIVE_MEDIUM;
+    ctx->jpegMin = 40;
+    ctx->jpegMax = 95;
+    ctx->defishZoom = 1.0;
+    ctx->inputFiletype = FILETYPE_AUTO;
+    ctx->copyFiles = 1;
+    ctx->subsample = SUBSAMPLE_DEFAULT;
+}
+
+float jpeg_archive_target(const struct jpeg_archive_ctx *ctx) {
+    static const float presets[][4] = {
+        [JPEG_ARCHIVE_SSIM] = { 0.999, 0.9999, 0.99995, 0.99999 },
+        [JPEG_ARCHIVE_MS_SSIM] = { 0.85, 0.94, 0.96, 0.98 },
+        [JPEG_ARCHIVE_SMALLFRY] = { 100.75, 102.25, 103.8, 105.5 },
+        [JPEG_ARCHIVE_MPE] = { 1.5, 1.0, 0.8, 0.6 }
+    };
+
+    if (ctx->target || ctx->method == JPEG_ARCHIVE_UNKNOWN)
+        return ctx->target;
+
+    return presets[ctx->method][ctx->preset];
+}
+
+void jpeg_archive_options_digest(const struct jpeg_archive_ctx *ctx, uint8_t digest[DIGEST_SIZE]) {
+    uint8_t parts[2 * DIGEST_SIZE];
+    char text[256];
+
+    snprintf(text, sizeof text, "%d %f %d %d %d %d %d %d %d %d %f %f %llu %d %f %f %d", ctx->method, jpeg_archive_target(ctx),
+        ctx->jpegMin, ctx->jpegMax, ctx->attempts, ctx->accurate, ctx->strip, ctx->noProgressive, ctx->subsample,
+        ctx->embedHash, ctx->defishStrength, ctx->defishZoom, ctx->maxMemory, ctx->fineQuality, ctx->tolerance,
+        ctx->minSavings, ctx->copyFiles);
+    digestBuffer(text, strlen(text), digest);
+
+    // Replaced metadata ends up in the output as well
+    if (ctx->metadata != NULL && !ctx->strip) {
+        memcpy(parts, digest, DIGEST_SIZE);
+        digestBuffer(ctx->metadata, ctx->metadataSize, parts + DIGEST_SIZE);
+        digestBuffer(parts, sizeof parts, digest);
+    }
+
+    if (ctx->scans != NULL) {
+        memcpy(parts, digest, DIGEST_SIZE);
+        digestBuffer(ctx->scans->text, ctx->scans->textSize, parts + DIGEST_SIZE);
+        digestBuffer(parts, sizeof parts, digest);
+    }
+}
+
+const char *jpeg_archive_method_name(enum jpeg_archive_method method) {
+    switch (method) {
+        case JPEG_ARCHIVE_MS_SSIM:
+            return "ms-ssim";
+        case JPEG_ARCHIVE_SMALLFRY:
+            return "smallfry";
+        case JPEG_ARCHIVE_MPE:
+            return "mpe";
+        case JPEG_ARCHIVE_SSIM: default:
+            return "ssim";
+    }
+}
+
+enum jpeg_archive_preset jpeg_archive_parse_preset(const char *name) {
+    if (!strcmp("low", name))
+        return JPEG_ARCHIVE_LOW;
+    else if (!strcmp("medium", name))
+        return JPEG_ARCHIVE_MEDIUM;
+    else if (!strcmp("high", name))
+        return JPEG_ARCHIVE_HIGH;
+    else if (!strcmp("veryhigh", name))
+        return JPEG_ARCHIVE_VERYHIGH;
+
+    error("unknown quality preset: %s", name);
+    return JPEG_ARCHIVE_MEDIUM;
+}
+
+enum jpeg_archive_method jpeg_archive_parse_method(const char *name) {
+    if (!strcmp("ssim", name))
+        return JPEG_ARCHIVE_SSIM;
+    else if (!strcmp("ms-ssim", name))
+        return JPEG_ARCHIVE_MS_SSIM;
+    else if (!strcmp("smallfry", name))
+        return JPEG_ARCHIVE_SMALLFRY;
+    else if (!strcmp("mpe", name))
+        return JPEG_ARCHIVE_MPE;
+    return JPEG_ARCHIVE_UNKNOWN;
+}
+
+int jpeg_archive_parse_subsample(const char *name) {
+    if (!strcmp("default", name))
+        return SUBSAMPLE_DEFAULT;
+    else if (!strcmp("disable", name))
+        return SUBSAMPLE_444;
+
+    error("unknown sampling method: %s", name);
+    return SUBSAMPLE_DEFAULT;
+}
+
+// Logs an informational message, taking quiet mode into account
+static void info(const struct jpeg_archive_ctx *ctx, const char *format, ...) {
+    va_list argptr;
+
+    if (!ctx->quiet) {
+        va_start(argptr, format);
+        vfprintf(stderr, format, argptr);
+        va_end(argptr);
+    }
+}
+
+/*
+    Downscaling factor SSIM uses for an image of the given size. Strips
+    of a larger image must use the factor of the whole image.
+*/
+static int ssimScale(int width, int height) {
+    return MAX(1, (int) (MIN(width, height) / 256.0f + 0.5f));
+}
+
+// Smallest strip the metric can work with
+static int minStripRows(enum jpeg_archive_method method, int width, int height) {
+    return (method == JPEG_ARCHIVE_MS_SSIM) ? 176 : 16 * ssimScale(width, height);
+}
+
+/*
+    Measure quality difference between two grayscale images. A non-zero
+    scale overrides the SSIM downscaling factor.
+*/
+static float compareGray(enum jpeg_archive_method method, unsigned char *original, unsigned char *compressed, int width, int height, int scale) {
+    struct iqa_ssim_args args = { 1.0f, 1.0f, 1.0f, 255, 0.01f, 0.03f, scale };
+
+    switch (method) {
+        case JPEG_ARCHIVE_MS_SSIM:
+            return iqa_ms_ssim(original, compressed, width, height, width, 0);
+        case JPEG_ARCHIVE_SMALLFRY:
+            return smallfry_metric(original, compressed, width, height);
+        case JPEG_ARCHIVE_MPE:
+            return meanPixelError(original, compressed, width, height, 1);
+        case JPEG_ARCHIVE_SSIM: default:
+            return iqa_ssim(original, compressed, width, height, width, 0, scale ? &args : NULL);
+    }
+}
+
+/*
+    Return how many rows to process at once to stay within the memory
+    budget, or 0 if the whole image can be processed in memory.
+*/
+static int stripRowsForBudget(const struct jpeg_archive_ctx *ctx, long bufSize, int width, int height) {
+    unsigned long long pixels = (unsigned long long) width * height;
+    unsigned long long fixed = 2ULL * bufSize + pixels * CODER_BYTES_PER_PIXEL;
+    unsigned long long perRow = (unsigned long long) width * (METRIC_BYTES_PER_PIXEL + 3);
+    int minRows = minStripRows(ctx->method, width, height);
+    unsigned long long rows;
+
+    if (!ctx->maxMemory || fixed + pixels * (METRIC_BYTES_PER_PIXEL + 3) <= ctx->maxMemory)
+        return 0;
+
+    rows = (ctx->maxMemory > fixed) ? (ctx->maxMemory - fixed) / perRow : 0;
+
+    // Whole MCU rows and SSIM downscaling blocks, enough for its window
+    rows -= rows % (16 * ssimScale(width, height));
+    if (rows < (unsigned long long) minRows) {
+        info(ctx, "Memory budget too small, using %i row strips\n", minRows);
+        rows = minRows;
+    }
+
+    return MIN(rows, (unsigned long long) height);
+}
+
+/*
+    Measure quality strip by strip, decoding the original and the new
+    image in lockstep so neither is ever fully in memory. The metric of
+    each strip is weighted by its number of rows. The last strip takes
+    any leftover rows so it is never too short for the metric.
+*/
+static float compareStrips(enum jpeg_archive_method method, const unsigned char *buf, long bufSize, enum filetype type, unsigned char *compressed, unsigned long compressedSize, int stripRows) {
+    int width, height, compressedWidth, compressedHeight;
+    int isPpm = type == FILETYPE_PPM;
+    struct rowReader *originalRows, *compressedRows;
+    unsigned char *originalStrip = NULL, *originalGray, *compressedGray;
+    double total = 0;
+    int ok = 1;
+
+    originalRows = openRowReader(buf, bufSize, type, isPpm ? JCS_RGB : JCS_GRAYSCALE, &width, &height);
+    if (originalRows == NULL)
+        return -1;
+
+    compressedRows = openRowReader(compressed, compressedSize, FILETYPE_JPEG, JCS_GRAYSCALE, &compressedWidth, &compressedHeight);
+    if (compressedRows == NULL) {
+        closeRowReader(originalRows);
+        return -1;
+    }
+
+    int maxRows = stripRows + minStripRows(method, width, height);
+    int scale = ssimScale(width, height);
+
+    originalGray = malloc((size_t) width * maxRows);
+    compressedGray = malloc((size_t) width * maxRows);
+    if (isPpm)
+        originalStrip = malloc((size_t) width * maxRows * 3);
+
+    for (int row = 0; ok && row < height;) {
+        int rows = (height - row < maxRows) ? height - row : stripRows;
+
+        if (isPpm) {
+            ok = readRows(originalRows, originalStrip, rows) == rows;
+            grayscaleInto(originalStrip, originalGray, width, rows);
+        } else {
+            ok = readRows(originalRows, originalGray, rows) == rows;
+        }
+
+        ok = ok && readRows(compressedRows, compressedGray, rows) == rows;
+
+        if (ok)
+            total += (double) compareGray(method, originalGray, compressedGray, width, rows, scale) * rows;
+
+        row += rows;
+    }
+
+    closeRowReader(originalRows);
+    closeRowReader(compressedRows);
+    free(originalStrip);
+    free(originalGray);
+    free(compressedGray);
+
+    return ok ? total / height : -1;
+}
+
+/*
+    Decode the whole input to RGB, counting the libjpeg warnings of this
+    image rather than in any shared counter.
+*/
+static int decodeOriginal(const unsigned char *buf, long bufSize, enum filetype type, unsigned char **image, int *width, int *height, unsigned long *warnings) {
+    struct rowReader *reader = openRowReader(buf, bufSize, type, JCS_RGB, width, height);
+    int ok;
+
+    *image = NULL;
+    if (reader == NULL)
+        return 1;
+
+    *image = malloc((size_t) *width * *height * 3);
+    ok = *image != NULL && readRows(reader, *image, *height) == *height;
+    *warnings = rowReaderWarnings(reader);
+    closeRowReader(reader);
+
+    if (!ok) {
+        free(*image);
+        *image = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Show how the output compares to the input
+static void showSavings(const struct jpeg_archive_ctx *ctx, unsigned long compressedSize, unsigned int metaSize, unsigned long bufSize) {
+    int percent = (compressedSize + metaSize) * 100 / bufSize;
+    unsigned long saved = (bufSize > compressedSize) ? bufSize - compressedSize - metaSize : 0;
+
+    info(ctx, "New size is %i%% of original (saved %lu kb)\n", percent, saved / 1024);
+}
+
+// Whether an output saves at least the minimum percentage of the input
+static int enoughSavings(const struct jpeg_archive_ctx *ctx, unsigned long compressedSize, unsigned int metaSize, unsigned long bufSize) {
+    return (compressedSize + metaSize) * 100.0 <= bufSize * (100.0 - ctx->minSavings);
+}
+
+// Size of the output, including our markers
+static unsigned long outputSize(struct jpeg_archive_image *image, const struct jpeg_archive_stats *stats) {
+    struct slice slices[JPEG_ARCHIVE_SLICES];
+    unsigned long size = 0;
+
+    jpeg_archive_slices(image, stats, slices);
+    for (int x = 0; x < JPEG_ARCHIVE_SLICES; x++)
+        size += slices[x].size;
+
+    return size;
+}
+
+// An optimized probe of the search, in case its quality comes up again
+struct probe {
+    int quality;
+    int progressive;
+    float metric;
+    unsigned char *compressed;
+    unsigned long compressedSize;
+};
+
+static struct probe *findProbe(struct probe *probes, int count, int quality) {
+    for (int x = 0; x < count; x++) {
+        if (probes[x].quality == quality && probes[x].compressed != NULL)
+            return &probes[x];
+    }
+
+    return NULL;
+}
+
+// Steps per whole quality in a fine search
+#define FINE_STEPS 100
+
+// Which ends of the range of a fine search were probed
+#define PROBED_MIN 1
+#define PROBED_MAX 2
+
+/*
+    Next quality (in steps) to try in a fine search. Once both ends of
+    the range were probed, the target is interpolated between their
+    metrics, which gets much closer than halving the range as the
+    metric is nearly linear in the quality over a short range. Probes
+    other than the final one stay a quarter of the range away from
+    either end, so the range still shrinks with every probe. The final
+    one never uses an end known to miss the target, and takes the top
+    of the range if every probe so far missed it.
+*/
+static int fineStep(int min, int max, int probed, float minMetric, float maxMetric, float target, int final) {
+    int quality = min + (max - min) / 2;
+    int margin = final ? 1 : (max - min) / 4;
+
+    if (max - min <= 1)
+        return (probed & PROBED_MIN) ? max : min;
+
+    if (probed == (PROBED_MIN | PROBED_MAX) && minMetric != maxMetric)
+        quality = min + (int) ((max - min) * (target - minMetric) / (maxMetric - minMetric) + 0.5f);
+    else if (final && probed == PROBED_MIN)
+        return max;
+
+    return MAX(min + margin, MIN(quality, max - margin));
+}
+
+enum jpeg_archive_status jpeg_archive_recompress(const struct jpeg_archive_ctx *ctx, const char *name, const unsigned char *buf, unsigned long bufSize, unsigned char *original, unsigned char *originalGray, int width, int height, struct jpeg_archive_image *image, struct jpeg_archive_stats *stats) {
+    enum jpeg_archive_status status = JPEG_ARCHIVE_FAILED;
+    enum jpeg_archive_method method = ctx->method;
+    enum filetype type = ctx->inputFiletype;
+    float target = jpeg_archive_target(ctx);
+    unsigned char *compressed = NULL;
+    unsigned long compressedSize = 0;
+    unsigned char *compressedGray = NULL;
+    // The original as Y, Cb and Cr planes, converted once for all encodes
+    struct yccImage ycc;
+    struct rowReader *reader;
+    int stripRows = 0;
+    unsigned char *tmpImage;
+    // Qualities are searched in whole steps, which are hundredths in a fine search
+    int steps = ctx->fineQuality ? FINE_STEPS : 1;
+    int min = ctx->jpegMin * steps, max = ctx->jpegMax * steps;
+    float minMetric = 0, maxMetric = 0;
+    int probed = 0;
+    // Quality to check with a fast encode that the search can save enough, or 0
+    int probeQuality = 0;
+    // Optimized probes of the search, one per attempt at most
+    struct probe *probes = NULL;
+    int probeCount = 0;
+    uint8_t key[DIGEST_SIZE];
+    struct cachedResult cached;
+    int store = 0;
+
+    memset(image, 0, sizeof *image);
+    memset(stats, 0, sizeof *stats);
+    memset(&ycc, 0, sizeof ycc);
+    stats->originalSize = bufSize;
+
+    if (method == JPEG_ARCHIVE_UNKNOWN || ctx->jpegMin > ctx->jpegMax) {
+        error("invalid options for %s", name);
+        goto cleanup;
+    }
+
+    /*
+     * Identical input with the same options gives the same output, so a
+     * cached result either is the output or at least saves the search.
+     */
+    if (ctx->cacheDir && original == NULL) {
+        resultKey(buf, bufSize, ctx, key);
+        store = loadResult(ctx->cacheDir, key, &cached, image);
+
+        if (!store && cached.status == JPEG_ARCHIVE_LARGER) {
+            if (ctx->copyFiles) {
+                info(ctx, "Output file would be larger than input!\n");
+                return JPEG_ARCHIVE_LARGER;
+            }
+            error("output file would be larger than input!");
+            return JPEG_ARCHIVE_FAILED;
+        }
+
+        if (!store) {
+            info(ctx, "Cached %s at q=%g: %f\n", jpeg_archive_method_name(method), cached.quality, cached.metric);
+            stats->quality = cached.quality;
+            stats->metric = cached.metric;
+            min = max = (int) (cached.quality * steps + 0.5f);
+
+            if (cached.compressedSize) {
+                strcpy(stats->hash, cached.hash);
+                showSavings(ctx, image->compressedSize, image->metaSize, bufSize);
+                stats->size = outputSize(image, stats);
+                return JPEG_ARCHIVE_OK;
+            }
+        }
+    }
+
+    if (original == NULL) {
+        /* Detect input file type. */
+        if (type == FILETYPE_AUTO)
+            type = detectFiletypeFromBuffer((unsigned char *) buf, bufSize);
+
+        if (type == FILETYPE_JPEG) {
+            // Read metadata (EXIF / IPTC / XMP tags). This also catches already
+            // processed input read from stdin, still before decoding it.
+            if (getMetadata(buf, bufSize, &image->metaBuf, &image->metaSize, COMMENT))
+                return JPEG_ARCHIVE_PROCESSED;
+        }
+    } else {
+        type = FILETYPE_PPM;
+    }
+
+    /*
+     * Input saved at a higher quality than we may pick, or with finer
+     * chroma than we write, always shrinks. Other JPEGs get one fast
+     * encode at the lowest quality we may pick first. Whatever the
+     * target and method, the search cannot do much better than that.
+     */
+    if (ctx->minSavings > 0 && ctx->copyFiles && type == FILETYPE_JPEG) {
+        int subsampled;
+        int inputQuality = estimateJpegQuality(buf, bufSize, &subsampled);
+
+        if (inputQuality) {
+            info(ctx, "Input quality is about %i\n", inputQuality);
+            if (inputQuality <= ctx->jpegMax && (subsampled || ctx->subsample == SUBSAMPLE_444))
+                probeQuality = ctx->jpegMin;
+        }
+    }
+
+    if (ctx->metadata != NULL && !ctx->strip) {
+        free(image->metaBuf);
+        image->metaBuf = malloc(ctx->metadataSize);
+        if (image->metaBuf == NULL) {
+            error("out of memory");
+            goto cleanup;
+        }
+        memcpy(image->metaBuf, ctx->metadata, ctx->metadataSize);
+        image->metaSize = ctx->metadataSize;
+    }
+
+    /*
+     * Find out whether the image fits the memory budget. If it does not, it
+     * is recompressed and compared in strips straight from the input buffer
+     * rather than being decoded into memory.
+     */
+    if (ctx->maxMemory && original == NULL) {
+        reader = openRowReader(buf, bufSize, type, JCS_RGB, &width, &height);
+        if (reader == NULL) {
+            error("invalid input file: %s", name);
+            goto cleanup;
+        }
+        closeRowReader(reader);
+
+        stripRows = stripRowsForBudget(ctx, bufSize, width, height);
+        if (stripRows && ctx->defishStrength) {
+            info(ctx, "Defishing needs the whole image, ignoring memory budget\n");
+            stripRows = 0;
+        }
+    }
+
+    if (stripRows) {
+        info(ctx, "Streaming in %i row strips\n", stripRows);
+    } else {
+        /*
+         * Read original image and decode. We need the raw buffer contents and its
+         * size to obtain meta data and the original file size later.
+         */
+        if (original == NULL && decodeOriginal(buf, bufSize, type, &original, &width, &height, &stats->warnings)) {
+            error("invalid input file: %s", name);
+            goto cleanup;
+        }
+
+        if (stats->warnings) {
+            info(ctx, "Input file is damaged (%lu libjpeg warnings)\n", stats->warnings);
+        }
+
+        if (ctx->defishStrength) {
+            info(ctx, "Defishing...\n");
+            tmpImage = malloc((size_t) width * height * 3);
+            defish(original, tmpImage, width, height, 3, ctx->defishStrength, ctx->defishZoom);
+            free(original);
+            original = tmpImage;
+            free(originalGray);
+            originalGray = NULL;
+        }
+
+        // Convert RGB input into Y, unless that was done while reading
+        if (originalGray == NULL && !grayscale(original, &originalGray, width, height))
+            goto cleanup;
+
+        // The planes stand in for the RGB pixels from here on
+        if (convertYcc(original, originalGray, width, height, ctx->subsample, &ycc)) {
+            error("out of memory");
+            goto cleanup;
+        }
+        free(original);
+        original = NULL;
+    }
+
+    if (ctx->strip) {
+        // Pretend we have no metadata
+        image->metaSize = 0;
+    } else {
+        info(ctx, "Metadata size is %ukb\n", image->metaSize / 1024);
+    }
+
+    if (probeQuality) {
+        if (stripRows) {
+            reader = openRowReader(buf, bufSize, type, JCS_RGB, &width, &height);
+            compressedSize = reader ? encodeJpegFromReader(&compressed, reader, probeQuality, 0, 0, ctx->subsample, NULL) : 0;
+            if (reader)
+                closeRowReader(reader);
+        } else {
+            compressedSize = encodeJpegFromYcc(&compressed, &ycc, probeQuality, 0, 0, NULL);
+        }
+        free(compressed);
+        compressed = NULL;
+
+        if (compressedSize && !enoughSavings(ctx, compressedSize * (1 - PROBE_OPTIMIZE_GAIN), image->metaSize, bufSize)) {
+            info(ctx, "Saving less than %g%% at q=%i, keeping the original\n", ctx->minSavings, probeQuality);
+            status = JPEG_ARCHIVE_LARGER;
+            goto cleanup;
+        }
+    }
+
+    probes = malloc((ctx->attempts > 0 ? ctx->attempts : 1) * sizeof *probes);
+    if (probes == NULL) {
+        error("out of memory");
+        goto cleanup;
+    }
+
+    // Do a binary search to find the optimal encoding quality for the
+    // given target SSIM value.
+    for (int attempt = ctx->attempts - 1; attempt >= 0; --attempt) {
+        float metric;
+        int quality = min + (max - min) / 2;
+
+        /* Terminate early once bisection interval is a singleton. */
+        if (min == max)
+            attempt = 0;
+
+        if (ctx->fineQuality) {
+            if (max - min <= 1)
+                attempt = 0;
+            quality = fineStep(min, max, probed, minMetric, maxMetric, target, !attempt);
+        }
+
+        int progressive = attempt ? 0 : !ctx->noProgressive;
+        int optimize = ctx->accurate ? 1 : (attempt ? 0 : 1);
+
+        struct probe *probe = optimize ? findProbe(probes, probeCount, quality) : NULL;
+        const struct scanScript *scans = (progressive && ctx->scans) ? findScanScript(ctx->scans, 3, ctx->subsample, width, height) : NULL;
+
+        if (probe != NULL && probe->progressive == progressive) {
+            // Encoded with the same settings before, so these are the same bytes
+            info(ctx, "Reusing the encode at q=%g\n", (float) quality / steps);
+            compressed = probe->compressed;
+            compressedSize = probe->compressedSize;
+            metric = probe->metric;
+            probe->compressed = NULL;
+        } else if (probe != NULL) {
+            // Only the entropy coding differs, which leaves pixels and metric alone
+            info(ctx, "Recoding the encode at q=%g\n", (float) quality / steps);
+            compressedSize = recodeJpeg(&compressed, probe->compressed, probe->compressedSize, progressive, scans);
+            metric = probe->metric;
+
+            if (!compressedSize) {
+                error("unable to encode file: %s", name);
+                goto cleanup;
+            }
+        } else {
+            // Recompress to a new quality level, without optimizations (for speed)
+            if (stripRows) {
+                reader = openRowReader(buf, bufSize, type, JCS_RGB, &width, &height);
+                compressedSize = reader ? encodeJpegFromReader(&compressed, reader, (float) quality / steps, progressive, optimize, ctx->subsample, scans) : 0;
+                if (reader)
+                    closeRowReader(reader);
+            } else {
+                compressedSize = encodeJpegFromYcc(&compressed, &ycc, (float) quality / steps, progressive, optimize, scans);
+            }
+
+            if (!compressedSize) {
+                error("unable to encode file: %s", name);
+                goto cleanup;
+            }
+
+            if (stripRows) {
+                // Compare against the original one strip at a time
+                metric = compareStrips(method, buf, bufSize, type, compressed, compressedSize, stripRows);
+
+                if (metric < 0) {
+                    error("unable to compare file that was just encoded!");
+                    goto cleanup;
+                }
+            } else {
+                // Load compressed luma for quality comparison
+                if (!decodeJpeg(compressed, compressedSize, &compressedGray, &width, &height, JCS_GRAYSCALE)) {
+                  error("unable to decode file that was just encoded!");
+                  goto cleanup;
+                }
+
+                // Measure quality difference
+                metric = compareGray(method, originalGray, compressedGray, width, height, 0);
+            }
+        }
+
+        stats->quality = (float) quality / steps;
+        stats->metric = metric;
+
+        if (!attempt) {
+            info(ctx, "Final optimized ");
+        }
+
+        info(ctx, "%s", jpeg_archive_method_name(method));
+
+        if (attempt) {
+            info(ctx, " at q=%g (%g - %g): %f\n", stats->quality, (float) min / steps, (float) max / steps, metric);
+        } else {
+            info(ctx, " at q=%g: %f\n", stats->quality, metric);
+        }
+
+        if (metric < target) {
+            if (compressedSize >= bufSize) {
+                if (ctx->copyFiles) {
+                    info(ctx, "Output file would be larger than input!\n");
+                    status = JPEG_ARCHIVE_LARGER;
+                } else {
+                    error("output file would be larger than input!");
+                }
+                goto cleanup;
+            }
+        }
+
+        if (ctx->fineQuality) {
+            // Keep the probe as the end of the range it falls on
+            if ((method == JPEG_ARCHIVE_MPE) == (metric < target)) {
+                max = quality;
+                maxMetric = metric;
+                probed |= PROBED_MAX;
+            } else {
+                min = quality;
+                minMetric = metric;
+                probed |= PROBED_MIN;
+            }
+        } else if (metric < target) {
+            switch (method) {
+                case JPEG_ARCHIVE_MPE:
+                    // Higher than required, decrease quality
+                    max = MAX(quality - 1, min);
+                    break;
+                default:
+                    // Too distorted, increase quality
+                    min = MIN(quality + 1, max);
+                    break;
+            }
+        } else {
+            switch (method) {
+                case JPEG_ARCHIVE_MPE:
+                    // Too distorted, increase quality
+                    min = MIN(quality + 1, max);
+                    break;
+                default:
+                    // Higher than required, decrease quality
+                    max = MAX(quality - 1, min);
+                    break;
+            }
+        }
+
+        // Close enough to the target, so finish at this quality
+        if (attempt > 1 && (method == JPEG_ARCHIVE_MPE) == (metric < target) &&
+                (method == JPEG_ARCHIVE_MPE ? target - metric : metric - target) <= ctx->tolerance) {
+            info(ctx, "Within tolerance, skipping %i probes\n", attempt - 1);
+            min = max = quality;
+        }
+
+        // If we aren't done yet, then free the image data, except for
+        // probes the final encode may reuse
+        if (attempt) {
+            if (optimize) {
+                probes[probeCount++] = (struct probe) { quality, progressive, metric, compressed, compressedSize };
+            } else {
+                free(compressed);
+            }
+            free(compressedGray);
+            compressed = NULL;
+            compressedGray = NULL;
+        }
+    }
+
+    // Hash the original, which saves later dedupe runs decoding the output
+    if (ctx->embedHash) {
+        uint64_t *hash = NULL;
+
+        if (originalGray != NULL)
+            hashGrayImage(originalGray, width, height, &hash, JPEG_ARCHIVE_HASH_SIZE);
+        else if (type != FILETYPE_JPEG || jpegHashFromBuffer((unsigned char *) buf, bufSize, &hash, JPEG_ARCHIVE_HASH_SIZE))
+            hash = NULL;
+
+        if (hash != NULL) {
+            formatHash(hash, JPEG_ARCHIVE_HASH_SIZE, stats->hash);
+            free(hash);
+        } else {
+            info(ctx, "Could not hash streamed input, not embedding a hash\n");
+        }
+    }
+
+    // Calculate and show savings, if any
+    showSavings(ctx, compressedSize, image->metaSize, bufSize);
+
+    if (ctx->minSavings > 0 && ctx->copyFiles && !enoughSavings(ctx, compressedSize, image->metaSize, bufSize)) {
+        info(ctx, "Saving less than %g%%, keeping the original\n", ctx->minSavings);
+        status = JPEG_ARCHIVE_LARGER;
+        goto cleanup;
+    }
+
+    if (compressedSize >= bufSize) {
+        error("output file is larger than input, aborting!");
+        goto cleanup;
+    }
+
+    /* Check that the metadata starts with a SOI marker. */
+    if (!checkJpegMagic(compressed, compressedSize)) {
+        error("missing SOI marker, aborting!");
+        goto cleanup;
+    }
+
+    /* Make sure APP0 is recorded immediately after the SOI marker. */
+    if (compressed[2] != 0xff || compressed[3] != 0xe0) {
+        error("missing APP0 marker, aborting!");
+        goto cleanup;
+    }
+
+    image->compressed = compressed;
+    image->compressedSize = compressedSize;
+    compressed = NULL;
+    status = JPEG_ARCHIVE_OK;
+    stats->size = outputSize(image, stats);
+
+cleanup:
+    if (store && (status == JPEG_ARCHIVE_OK || status == JPEG_ARCHIVE_LARGER)) {
+        memset(&cached, 0, sizeof cached);
+        cached.status = status;
+        cached.quality = stats->quality;
+        cached.metric = stats->metric;
+        strcpy(cached.hash, stats->hash);
+
+        if (storeResult(ctx->cacheDir, key, &cached, (status == JPEG_ARCHIVE_OK && ctx->cacheOutput) ? image : NULL))
+            info(ctx, "Could not store result in cache\n");
+    }
+
+    free(compressed);
+    free(compressedGray);
+    free(original);
+    freeYcc(&ycc);
+    free(originalGray);
+    for (int x = 0; x < probeCount; x++)
+        free(probes[x].compressed);
+    free(probes);
+
+    return status;
+}
+
+void jpeg_archive_slices(struct jpeg_archive_image *image, const struct jpeg_archive_stats *stats, struct slice slices[JPEG_ARCHIVE_SLICES]) {
+    const unsigned char *compressed = image->compressed;
+    int app0_len = (compressed[4] << 8) + compressed[5];
+    int hashCommentLen = stats->hash[0] ? strlen(HASH_COMMENT) : 0;
+    int commentLen = strlen(COMMENT) + hashCommentLen + strlen(stats->hash) + 2;
+
+    image->commentMarker[0] = 0xff;
+    image->commentMarker[1] = 0xfe;
+    image->commentMarker[2] = commentLen >> 8;
+    image->commentMarker[3] = commentLen & 0xff;
+
+    slices[0] = (struct slice) { compressed, 4 + app0_len };
+    slices[1] = (struct slice) { image->commentMarker, 4 };
+    slices[2] = (struct slice) { COMMENT, strlen(COMMENT) };
+    slices[3] = (struct slice) { HASH_COMMENT, hashCommentLen };
+    slices[4] = (struct slice) { stats->hash, strlen(stats->hash) };
+    slices[5] = (struct slice) { image->metaBuf, image->metaSize };
+    slices[6] = (struct slice) { compressed + 4 + app0_len, image->compressedSize - 4 - app0_len };
+}
+
+void jpeg_archive_free_image(struct jpeg_archive_image *image) {
+    free(image->compressed);
+    free(image->metaBuf);
+    image->compressed = NULL;
+    image->metaBuf = NULL;
+}
+
+enum jpeg_archive_status recompress_buffer(const struct jpeg_archive_ctx *ctx, const unsigned char *in, unsigned long in_len, unsigned char **out, unsigned long *out_len, struct jpeg_archive_stats *stats) {
+    struct jpeg_archive_stats localStats;
+    struct jpeg_archive_image image;
+    struct slice slices[JPEG_ARCHIVE_SLICES];
+    enum jpeg_archive_status status;
+
+    if (stats == NULL)
+        stats = &localStats;
+
+    *out = NULL;
+    *out_len = 0;
+
+    status = jpeg_archive_recompress(ctx, "buffer", in, in_len, NULL, NULL, 0, 0, &image, stats);
+    if (status == JPEG_ARCHIVE_OK) {
+        *out = malloc(stats->size);
+        if (*out == NULL) {
+            error("out of memory");
+            status = JPEG_ARCHIVE_FAILED;
+        } else {
+            jpeg_archive_slices(&image, stats, slices);
+            for (int x = 0; x < JPEG_ARCHIVE_SLICES; x++) {
+                if (slices[x].size)
+                    memcpy(*out + *out_len, slices[x].data, slices[x].size);
+                *out_len += slices[x].size;
+            }
+        }
+    }
+
+    jpeg_archive_free_image(&image);
+
+    return status;
+}
@@ -0,0 +1,176 @@
+/*
+    Recompression library (libjpegarchive)
+
+    Everything jpeg-recompress does to a single image, without any
+    global state: all options live in a context that is only read, so
+    one context may be shared by any number of threads.
+*/
+#ifndef JPEGARCHIVE_H
+#define JPEGARCHIVE_H
+
+#include "digest.h"
+#include "hash.h"
+#include "util.h"
+
+// Comparison method
+enum jpeg_archive_method {
+    JPEG_ARCHIVE_UNKNOWN,
+    JPEG_ARCHIVE_SSIM,
+    JPEG_ARCHIVE_MS_SSIM,
+    JPEG_ARCHIVE_SMALLFRY,
+    JPEG_ARCHIVE_MPE
+};
+
+// Target quality presets, see jpeg_archive_target
+enum jpeg_archive_preset {
+    JPEG_ARCHIVE_LOW,
+    JPEG_ARCHIVE_MEDIUM,
+    JPEG_ARCHIVE_HIGH,
+    JPEG_ARCHIVE_VERYHIGH
+};
+
+enum jpeg_archive_status {
+    // The image was recompressed
+    JPEG_ARCHIVE_OK,
+    // The output would not be smaller, or not by the minimum savings,
+    // so the original should be kept
+    JPEG_ARCHIVE_LARGER,
+    // The input already carries our COM marker
+    JPEG_ARCHIVE_PROCESSED,
+    JPEG_ARCHIVE_FAILED
+};
+
+struct scanScripts;
+
+// Size of the hash that is embedded in the output
+#define JPEG_ARCHIVE_HASH_SIZE 16
+
+struct jpeg_archive_ctx {
+    enum jpeg_archive_method method;
+    // Number of binary search steps
+    int attempts;
+    // Target quality value, or 0 to use the preset
+    float target;
+    enum jpeg_archive_preset preset;
+    // Min/max JPEG quality
+    int jpegMin;
+    int jpegMax;
+    // Strip metadata?
+    int strip;
+    int noProgressive;
+    // Defish strength, 0 to not defish
+    float defishStrength;
+    float defishZoom;
+    enum filetype inputFiletype;
+    // Whether copying the original is an acceptable outcome
+    int copyFiles;
+    // Keep the original unless the output saves at least this many
+    // percent, 0 to keep it only if the output would be larger
+    float minSavings;
+    // Favor accuracy over speed?
+    int accurate;
+    // Search fractional qualities as well, see encodeJpeg
+    int fineQuality;
+    // Finish the search early at a quality that meets the target by at
+    // most this much, or 0 to use all attempts
+    float tolerance;
+    int subsample;
+    // Only print out errors?
+    int quiet;
+    // Embed a hash of the image in our COM marker?
+    int embedHash;
+    // Memory budget in bytes, 0 means unlimited
+    unsigned long long maxMemory;
+    // Directory to look results up in and store them, or NULL
+    const char *cacheDir;
+    // Store whole outputs in the cache rather than just the quality?
+    int cacheOutput;
+    // Metadata markers to write instead of those of the input, or NULL
+    const unsigned char *metadata;
+    unsigned int metadataSize;
+    // Scan scripts for progressive output, see scans.h, or NULL to try
+    // several scripts for every image
+    const struct scanScripts *scans;
+};
+
+struct jpeg_archive_stats {
+    // Final JPEG quality and the metric measured at it, which is only
+    // fractional for a fine search
+    float quality;
+    float metric;
+    unsigned long originalSize;
+    // Size of the output, or 0 if the image was not recompressed
+    unsigned long size;
+    // libjpeg warnings while decoding the input, e.g. for corrupt data
+    unsigned long warnings;
+    // Embedded hash in text form, or empty
+    char hash[HASH_TEXT_SIZE(JPEG_ARCHIVE_HASH_SIZE)];
+};
+
+/* Fill a context with the defaults of jpeg-recompress. */
+void jpeg_archive_init(struct jpeg_archive_ctx *ctx);
+
+/* Target value of a context, which is taken from its preset if not set. */
+float jpeg_archive_target(const struct jpeg_archive_ctx *ctx);
+
+/* Digest of every option that changes the output of a context. */
+void jpeg_archive_options_digest(const struct jpeg_archive_ctx *ctx, uint8_t digest[DIGEST_SIZE]);
+
+/* Short name of a comparison method, e.g. "ssim". */
+const char *jpeg_archive_method_name(enum jpeg_archive_method method);
+
+/*
+    Parse the option values the command line tools accept. Unknown
+    presets and subsampling methods fall back to the default with an
+    error message, unknown methods return JPEG_ARCHIVE_UNKNOWN.
+*/
+enum jpeg_archive_preset jpeg_archive_parse_preset(const char *name);
+enum jpeg_archive_method jpeg_archive_parse_method(const char *name);
+int jpeg_archive_parse_subsample(const char *name);
+
+/*
+    Recompress a JPEG or PPM image held in memory. On success the output
+    is returned in a malloc'd buffer. For any other outcome out is NULL,
+    and stats (which may be NULL) still say how far the search got.
+*/
+enum jpeg_archive_status recompress_buffer(const struct jpeg_archive_ctx *ctx, const unsigned char *in, unsigned long in_len, unsigned char **out, unsigned long *out_len, struct jpeg_archive_stats *stats);
+
+/*
+    Lower level interface, for callers that stream PPM input straight
+    into memory or write the output without assembling it first.
+*/
+
+// Number of slices the output is written in
+#define JPEG_ARCHIVE_SLICES 7
+
+struct jpeg_archive_image {
+    unsigned char *compressed;
+    unsigned long compressedSize;
+    unsigned char *metaBuf;
+    unsigned int metaSize;
+    unsigned char commentMarker[4];
+};
+
+/*
+    Recompress an image that was read into buf or, for PPM input read
+    straight from a file, already decoded into original (and possibly
+    originalGray). Takes ownership of original and originalGray. Either
+    way, bufSize is the size of the input, and name is only used in
+    messages. Results are only cached for input read into buf. The
+    image must be freed with jpeg_archive_free_image, whatever the
+    outcome.
+*/
+enum jpeg_archive_status jpeg_archive_recompress(const struct jpeg_archive_ctx *ctx, const char *name, const unsigned char *buf, unsigned long bufSize, unsigned char *original, unsigned char *originalGray, int width, int height, struct jpeg_archive_image *image, struct jpeg_archive_stats *stats);
+
+/*
+    Split a recompressed image into the slices of the output: SOI marker
+    and APP0, our comment (COM metadata) so we know not to reprocess
+    this file in the future if it gets passed in again, optionally
+    followed by the image hash, additional metadata markers and the
+    image data. The slices point into image.
+*/
+void jpeg_archive_slices(struct jpeg_archive_image *image, const struct jpeg_archive_stats *stats, struct slice slices[JPEG_ARCHIVE_SLICES]);
+
+void jpeg_archive_free_image(struct jpeg_archive_image *image);
+
+#endif
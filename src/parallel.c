@@ -0,0 +1,93 @@
+// Needed for sysconf under -std=c99
+#define _GNU_SOURCE
+
+#include "parallel.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <unistd.h>
+#endif
+
+struct workQueue {
+    pthread_mutex_t lock;
+    long next;
+    long count;
+    workFunction work;
+    void *data;
+};
+
+#ifdef _WIN32
+
+int cpuCount(void) {
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+
+    return info.dwNumberOfProcessors > 0 ? (int) info.dwNumberOfProcessors : 1;
+}
+
+#else
+
+int cpuCount(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return cpus > 0 ? cpus : 1;
+}
+
+#endif
+
+static void *worker(void *arg) {
+    struct workQueue *queue = arg;
+
+    while (1) {
+        long item;
+
+        pthread_mutex_lock(&queue->lock);
+        item = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (item >= queue->count)
+            break;
+
+        queue->work(item, queue->data);
+    }
+
+    return NULL;
+}
+
+void runParallel(long count, int jobs, workFunction work, void *data) {
+    struct workQueue queue = { PTHREAD_MUTEX_INITIALIZER, 0, count, work, data };
+    pthread_t *threads;
+    int started = 0;
+
+    if (jobs > count)
+        jobs = count;
+
+    if (jobs <= 1) {
+        worker(&queue);
+        return;
+    }
+
+    threads = malloc(sizeof(pthread_t) * jobs);
+
+    for (int x = 0; threads && x < jobs; x++) {
+        if (pthread_create(&threads[x], NULL, worker, &queue))
+            break;
+        started++;
+    }
+
+    // Do the work on this thread if no threads could be started
+    if (!started)
+        worker(&queue);
+
+    for (int x = 0; x < started; x++) {
+        pthread_join(threads[x], NULL);
+    }
+
+    free(threads);
+    pthread_mutex_destroy(&queue.lock);
+}
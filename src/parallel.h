@@ -0,0 +1,21 @@
+/*
+    Simple parallel work distribution
+*/
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/* Work function, called once for each item number. */
+typedef void (*workFunction)(long item, void *data);
+
+/* Number of online CPUs, used as the default number of jobs. */
+int cpuCount(void);
+
+/*
+    Call work for every item from 0 to count - 1 using the given number
+    of threads. Threads grab the next unprocessed item as soon as they
+    are done with the previous one, so slow items do not hold up the
+    rest. Returns once all items are done.
+*/
+void runParallel(long count, int jobs, workFunction work, void *data);
+
+#endif
@@ -0,0 +1,168 @@
+// Needed for mkstemp under -std=c99
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#include "resultcache.h"
+#include "util.h"
+
+void resultKey(const unsigned char *buf, unsigned long bufSize, const struct jpeg_archive_ctx *ctx, uint8_t key[DIGEST_SIZE]) {
+    uint8_t parts[2 * DIGEST_SIZE];
+
+    digestBuffer(buf, bufSize, parts);
+    jpeg_archive_options_digest(ctx, parts + DIGEST_SIZE);
+    digestBuffer(parts, sizeof parts, key);
+}
+
+#ifdef _WIN32
+
+int openResultCache(const char *dir) {
+    error("result cache is not supported on this platform");
+    return 1;
+}
+
+int loadResult(const char *dir, const uint8_t key[DIGEST_SIZE], struct cachedResult *result, struct jpeg_archive_image *image) {
+    return 1;
+}
+
+int storeResult(const char *dir, const uint8_t key[DIGEST_SIZE], struct cachedResult *result, const struct jpeg_archive_image *image) {
+    return 1;
+}
+
+#else
+
+int openResultCache(const char *dir) {
+    if (mkdir(dir, 0777) && errno != EEXIST) {
+        error("could not create cache directory: %s", dir);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Path of an entry, its subdirectory is the path up to the last slash. */
+static char *entryPath(const char *dir, const uint8_t key[DIGEST_SIZE]) {
+    char *path = malloc(strlen(dir) + 2 * DIGEST_SIZE + 3);
+    char *p;
+
+    if (path == NULL)
+        return NULL;
+
+    p = path + sprintf(path, "%s/%02x/", dir, key[0]);
+    for (int x = 0; x < DIGEST_SIZE; x++)
+        p += sprintf(p, "%02x", key[x]);
+
+    return path;
+}
+
+int loadResult(const char *dir, const uint8_t key[DIGEST_SIZE], struct cachedResult *result, struct jpeg_archive_image *image) {
+    char *path = entryPath(dir, key);
+    struct stat st;
+    FILE *file;
+    int ret = 1;
+
+    if (path == NULL)
+        return 1;
+
+    file = fopen(path, "rb");
+    free(path);
+    if (file == NULL)
+        return 1;
+
+    if (fstat(fileno(file), &st) || fread(result, sizeof *result, 1, file) != 1 ||
+            memcmp(result->magic, RESULTCACHE_MAGIC, 4) || result->version != RESULTCACHE_VERSION ||
+            (uint64_t) st.st_size != sizeof *result + result->metaSize + result->compressedSize) {
+        fclose(file);
+        return 1;
+    }
+
+    result->hash[sizeof result->hash - 1] = '\0';
+
+    if (!result->compressedSize) {
+        fclose(file);
+        return 0;
+    }
+
+    image->metaSize = result->metaSize;
+    image->metaBuf = malloc(result->metaSize ? result->metaSize : 1);
+    image->compressedSize = result->compressedSize;
+    image->compressed = malloc(result->compressedSize);
+
+    if (image->metaBuf != NULL && image->compressed != NULL &&
+            fread(image->metaBuf, 1, result->metaSize, file) == result->metaSize &&
+            fread(image->compressed, 1, result->compressedSize, file) == result->compressedSize) {
+        ret = 0;
+    } else {
+        jpeg_archive_free_image(image);
+        image->metaSize = 0;
+        image->compressedSize = 0;
+    }
+
+    fclose(file);
+    return ret;
+}
+
+int storeResult(const char *dir, const uint8_t key[DIGEST_SIZE], struct cachedResult *result, const struct jpeg_archive_image *image) {
+    char *path = entryPath(dir, key);
+    char *tmpName;
+    struct slice slices[3];
+    int fd;
+    int ret;
+
+    if (path == NULL)
+        return 1;
+
+    tmpName = malloc(strlen(path) + 8);
+    if (tmpName == NULL) {
+        free(path);
+        return 1;
+    }
+
+    memcpy(result->magic, RESULTCACHE_MAGIC, 4);
+    result->version = RESULTCACHE_VERSION;
+    result->metaSize = image ? image->metaSize : 0;
+    result->compressedSize = image ? image->compressedSize : 0;
+
+    // Create the subdirectory on first use
+    *strrchr(path, '/') = '\0';
+    if (mkdir(path, 0777) && errno != EEXIST) {
+        free(path);
+        free(tmpName);
+        return 1;
+    }
+    path[strlen(path)] = '/';
+
+    sprintf(tmpName, "%s.XXXXXX", path);
+    fd = mkstemp(tmpName);
+    if (fd < 0) {
+        free(path);
+        free(tmpName);
+        return 1;
+    }
+
+    slices[0] = (struct slice) { result, sizeof *result };
+    slices[1] = (struct slice) { image ? image->metaBuf : NULL, result->metaSize };
+    slices[2] = (struct slice) { image ? image->compressed : NULL, result->compressedSize };
+
+    ret = writeSlicesFd(fd, slices, 3);
+    ret |= close(fd);
+    if (ret || rename(tmpName, path)) {
+        remove(tmpName);
+        ret = 1;
+    }
+
+    free(path);
+    free(tmpName);
+    return ret;
+}
+
+#endif
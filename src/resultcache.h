@@ -0,0 +1,54 @@
+/*
+    Content-addressed cache of recompression results
+*/
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <stdint.h>
+
+#include "digest.h"
+#include "jpegarchive.h"
+
+/*
+    A cache is a directory holding one file per result, named after the
+    hex key of the input bytes and the options and spread over 256
+    subdirectories by the first byte of the key. A file holds a header,
+    optionally followed by the metadata and the compressed image the
+    output is made of. Files are written to a temporary name and renamed
+    into place, so any number of processes may share a cache, and a file
+    whose size does not match its header is ignored.
+*/
+#define RESULTCACHE_MAGIC "JARC"
+#define RESULTCACHE_VERSION 2
+
+struct cachedResult {
+    char magic[4];
+    uint32_t version;
+    int32_t status;
+    float quality;
+    float metric;
+    uint32_t metaSize;
+    // 0 if only the quality was stored
+    uint64_t compressedSize;
+    char hash[HASH_TEXT_SIZE(JPEG_ARCHIVE_HASH_SIZE)];
+};
+
+/* Create a cache directory if it does not exist yet. Returns 0 on success. */
+int openResultCache(const char *dir);
+
+/* Key of the result of recompressing an input with the given options. */
+void resultKey(const unsigned char *buf, unsigned long bufSize, const struct jpeg_archive_ctx *ctx, uint8_t key[DIGEST_SIZE]);
+
+/*
+    Look a result up. If its output was stored, the metadata and the
+    compressed image are read into image. Returns 0 if found.
+*/
+int loadResult(const char *dir, const uint8_t key[DIGEST_SIZE], struct cachedResult *result, struct jpeg_archive_image *image);
+
+/*
+    Store a result, along with its output if image is not NULL. The
+    magic and version are filled in. Returns 0 on success.
+*/
+int storeResult(const char *dir, const uint8_t key[DIGEST_SIZE], struct cachedResult *result, const struct jpeg_archive_image *image);
+
+#endif
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scans.h"
+
+enum sampling {
+    SAMPLING_GRAY,
+    SAMPLING_420,
+    SAMPLING_444
+};
+
+static const char *samplingNames[] = { "gray", "420", "444" };
+
+// Size buckets go by the longer side, rounded up to a power of two
+#define MIN_BUCKET 256
+#define MAX_BUCKET 65536
+
+static int samplingOf(int components, int subsample) {
+    if (components == 1)
+        return SAMPLING_GRAY;
+
+    return (subsample == SUBSAMPLE_444) ? SAMPLING_444 : SAMPLING_420;
+}
+
+static int bucketOf(int width, int height) {
+    int bucket = MIN_BUCKET;
+
+    while (bucket < MAX(width, height) && bucket < MAX_BUCKET)
+        bucket *= 2;
+
+    return bucket;
+}
+
+/* Add votes for a script, merging them with those of the same script. */
+static int addVotes(struct scanScripts *scripts, int sampling, int bucket, const struct scanScript *script, long votes) {
+    struct scanEntry *entries;
+
+    for (long x = 0; x < scripts->count; x++) {
+        struct scanEntry *entry = &scripts->entries[x];
+
+        if (entry->sampling == sampling && entry->bucket == bucket && !memcmp(&entry->script, script, sizeof *script)) {
+            entry->votes += votes;
+            return 0;
+        }
+    }
+
+    entries = realloc(scripts->entries, (scripts->count + 1) * sizeof *entries);
+    if (entries == NULL)
+        return 1;
+
+    scripts->entries = entries;
+    entries[scripts->count].sampling = sampling;
+    entries[scripts->count].bucket = bucket;
+    entries[scripts->count].votes = votes;
+    entries[scripts->count].script = *script;
+    scripts->count++;
+
+    return 0;
+}
+
+/* Whether no other entry for the same images has more votes. */
+static int isWinner(const struct scanScripts *scripts, long index) {
+    const struct scanEntry *entry = &scripts->entries[index];
+
+    for (long x = 0; x < scripts->count; x++) {
+        const struct scanEntry *other = &scripts->entries[x];
+
+        if (x == index || other->sampling != entry->sampling || other->bucket != entry->bucket)
+            continue;
+
+        // Ties go to the script seen first
+        if (other->votes > entry->votes || (other->votes == entry->votes && x < index))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Parse a script in the syntax of cjpeg -scans. Returns 0 on success. */
+static int parseScript(const char *text, int components, struct scanScript *script) {
+    const char *p = text;
+    char *end;
+    int used;
+
+    memset(script, 0, sizeof *script);
+
+    while (1) {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (!*p)
+            break;
+
+        if (script->count == MAX_SCANS)
+            return 1;
+
+        jpeg_scan_info *scan = &script->scans[script->count++];
+
+        while (1) {
+            long component = strtol(p, &end, 10);
+
+            if (end == p || component < 0 || component >= components || scan->comps_in_scan == MAX_COMPS_IN_SCAN)
+                return 1;
+
+            scan->component_index[scan->comps_in_scan++] = component;
+            for (p = end; *p == ' '; p++);
+
+            if (*p != ',')
+                break;
+            p++;
+        }
+
+        if (*p++ != ':')
+            return 1;
+
+        if (sscanf(p, " %d - %d , %d , %d %n", &scan->Ss, &scan->Se, &scan->Ah, &scan->Al, &used) != 4)
+            return 1;
+        p += used;
+
+        if (*p == ';')
+            p++;
+        else if (*p)
+            return 1;
+    }
+
+    return script->count ? 0 : 1;
+}
+
+static void writeScript(FILE *file, const struct scanScript *script) {
+    for (int x = 0; x < script->count; x++) {
+        const jpeg_scan_info *scan = &script->scans[x];
+
+        fputc(' ', file);
+        for (int c = 0; c < scan->comps_in_scan; c++)
+            fprintf(file, c ? ",%d" : "%d", scan->component_index[c]);
+        fprintf(file, ": %d-%d, %d, %d;", scan->Ss, scan->Se, scan->Ah, scan->Al);
+    }
+}
+
+int loadScanScripts(const char *filename, struct scanScripts *scripts) {
+    char *copy;
+    char *line;
+    long lineNumber = 0;
+
+    memset(scripts, 0, sizeof *scripts);
+
+    scripts->textSize = readFile((char *) filename, (void **) &scripts->text);
+    if (!scripts->textSize) {
+        error("could not read scan script file: %s", filename);
+        return 1;
+    }
+
+    // Split a terminated copy, the text itself is kept as it was read
+    copy = malloc(scripts->textSize + 1);
+    if (copy == NULL) {
+        error("out of memory");
+        freeScanScripts(scripts);
+        return 1;
+    }
+    memcpy(copy, scripts->text, scripts->textSize);
+    copy[scripts->textSize] = '\0';
+
+    for (line = copy; line != NULL && *line; ) {
+        char *next = strchr(line, '\n');
+        char name[8];
+        int bucket;
+        long votes;
+        int used;
+        int sampling;
+        struct scanScript script;
+
+        if (next != NULL)
+            *next++ = '\0';
+        lineNumber++;
+
+        if (*line == '#' || strspn(line, " \t\r") == strlen(line)) {
+            line = next;
+            continue;
+        }
+
+        line[strcspn(line, "\r")] = '\0';
+        sampling = 3;
+
+        if (sscanf(line, "%7s %d %ld %n", name, &bucket, &votes, &used) == 3) {
+            for (sampling = 0; sampling < 3; sampling++) {
+                if (!strcmp(name, samplingNames[sampling]))
+                    break;
+            }
+        }
+
+        if (sampling == 3 || parseScript(line + used, sampling == SAMPLING_GRAY ? 1 : 3, &script) ||
+                addVotes(scripts, sampling, bucket, &script, votes)) {
+            error("invalid scan script on line %ld of %s", lineNumber, filename);
+            free(copy);
+            freeScanScripts(scripts);
+            return 1;
+        }
+
+        line = next;
+    }
+
+    free(copy);
+    return 0;
+}
+
+int saveScanScripts(const char *filename, const struct scanScripts *scripts) {
+    char *tmpName = malloc(strlen(filename) + 5);
+    FILE *file;
+    int failed;
+
+    if (tmpName == NULL)
+        return 1;
+
+    sprintf(tmpName, "%s.tmp", filename);
+    file = fopen(tmpName, "w");
+    if (!file) {
+        free(tmpName);
+        return 1;
+    }
+
+    fprintf(file, "# Progressive scan scripts: sampling, longer side up to, samples, script\n");
+    for (long x = 0; x < scripts->count; x++) {
+        const struct scanEntry *entry = &scripts->entries[x];
+
+        if (!isWinner(scripts, x))
+            continue;
+
+        fprintf(file, "%s %d %ld", samplingNames[entry->sampling], entry->bucket, entry->votes);
+        writeScript(file, &entry->script);
+        fputc('\n', file);
+    }
+
+    failed = ferror(file);
+    failed |= fclose(file);
+    if (failed || rename(tmpName, filename)) {
+        remove(tmpName);
+        free(tmpName);
+        return 1;
+    }
+
+    free(tmpName);
+    return 0;
+}
+
+void freeScanScripts(struct scanScripts *scripts) {
+    free(scripts->entries);
+    free(scripts->text);
+    memset(scripts, 0, sizeof *scripts);
+}
+
+const struct scanScript *findScanScript(const struct scanScripts *scripts, int components, int subsample, int width, int height) {
+    int sampling = samplingOf(components, subsample);
+    int bucket = bucketOf(width, height);
+
+    for (long x = 0; x < scripts->count; x++) {
+        const struct scanEntry *entry = &scripts->entries[x];
+
+        if (entry->sampling == sampling && entry->bucket == bucket && isWinner(scripts, x))
+            return &entry->script;
+    }
+
+    return NULL;
+}
+
+int learnScanScript(struct scanScripts *scripts, int subsample, const unsigned char *buf, unsigned long bufSize) {
+    struct scanScript script;
+    int ids[3];
+    int components = 0;
+    int width = 0;
+    int height = 0;
+    unsigned long pos = 2;
+
+    if (!checkJpegMagic(buf, bufSize))
+        return 1;
+
+    memset(&script, 0, sizeof script);
+
+    while (pos + 4 <= bufSize && buf[pos] == 0xff && buf[pos + 1] != 0xd9) {
+        int marker = buf[pos + 1];
+        unsigned int length = (buf[pos + 2] << 8) + buf[pos + 3];
+        const unsigned char *segment = buf + pos + 4;
+
+        if (length < 2 || pos + 2 + length > bufSize)
+            return 1;
+        pos += 2 + length;
+
+        if (marker == 0xc2) {
+            // Start of a progressive frame
+            if (length < 8 || segment[5] > 3 || length < 8 + 3 * (unsigned int) segment[5])
+                return 1;
+
+            height = (segment[1] << 8) + segment[2];
+            width = (segment[3] << 8) + segment[4];
+            components = segment[5];
+            for (int x = 0; x < components; x++)
+                ids[x] = segment[6 + x * 3];
+        } else if (marker == 0xda) {
+            int count = segment[0];
+
+            if (!components || count < 1 || count > MAX_COMPS_IN_SCAN || length < 6 + 2 * (unsigned int) count || script.count == MAX_SCANS)
+                return 1;
+
+            jpeg_scan_info *scan = &script.scans[script.count++];
+
+            scan->comps_in_scan = count;
+            for (int x = 0; x < count; x++) {
+                int c = 0;
+
+                while (c < components && ids[c] != segment[1 + x * 2])
+                    c++;
+                if (c == components)
+                    return 1;
+                scan->component_index[x] = c;
+            }
+            scan->Ss = segment[1 + count * 2];
+            scan->Se = segment[2 + count * 2];
+            scan->Ah = segment[3 + count * 2] >> 4;
+            scan->Al = segment[3 + count * 2] & 0x0f;
+
+            // Skip the entropy coded data, up to a marker other than a restart
+            while (pos + 1 < bufSize && (buf[pos] != 0xff || buf[pos + 1] == 0 || (buf[pos + 1] >= 0xd0 && buf[pos + 1] <= 0xd7)))
+                pos++;
+        }
+    }
+
+    if (!script.count)
+        return 1;
+
+    return addVotes(scripts, samplingOf(components, subsample), bucketOf(width, height), &script, 1);
+}
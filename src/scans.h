@@ -0,0 +1,63 @@
+/*
+    Progressive scan scripts learned from sample images
+*/
+#ifndef SCANS_H
+#define SCANS_H
+
+#include "util.h"
+
+/*
+    Optimizing the scans of progressive output means encoding several
+    candidate scripts for every image. The script that wins depends
+    mostly on the kind of image, so the winners of a sample of images
+    are kept per sampling and size bucket (the longer side rounded up to
+    a power of two, from 256 px) and used as they are for other images.
+
+    A scan script file has one script per line, as the sampling ("gray",
+    "420" or "444"), the bucket, the number of samples that picked the
+    script and the script in the syntax of cjpeg -scans, e.g.
+
+    420 2048 17 0,1,2: 0-0, 0, 1; 0: 1-5, 0, 2; ...
+
+    Lines starting with # are comments.
+*/
+struct scanEntry {
+    int sampling;
+    int bucket;
+    long votes;
+    struct scanScript script;
+};
+
+struct scanScripts {
+    struct scanEntry *entries;
+    long count;
+    // The file as it was read, which the options digest covers
+    char *text;
+    long textSize;
+};
+
+/* Load a scan script file. Returns 0 on success. */
+int loadScanScripts(const char *filename, struct scanScripts *scripts);
+
+/*
+    Write the script most samples picked for each sampling and bucket.
+    Returns 0 on success.
+*/
+int saveScanScripts(const char *filename, const struct scanScripts *scripts);
+
+void freeScanScripts(struct scanScripts *scripts);
+
+/*
+    Find the script for an image with the given number of components
+    and subsampling method, or return NULL if there is none.
+*/
+const struct scanScript *findScanScript(const struct scanScripts *scripts, int components, int subsample, int width, int height);
+
+/*
+    Count the scans of a progressive JPEG, as written by encodeJpeg with
+    the given subsampling method, as a sample. Returns 0 on success, or
+    1 if the JPEG is not progressive or could not be parsed.
+*/
+int learnScanScript(struct scanScripts *scripts, int subsample, const unsigned char *buf, unsigned long bufSize);
+
+#endif
@@ -0,0 +1,197 @@
+// Needed for sigaction and kill under -std=c99
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+    #include <signal.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
+    #include <sys/wait.h>
+#endif
+
+#include "serve.h"
+#include "util.h"
+
+// Connections the kernel queues per worker before refusing new ones
+#define BACKLOG_PER_WORKER 4
+
+int readFull(int fd, void *buf, size_t size) {
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t got = read(fd, (unsigned char *) buf + done, size - done);
+
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return (got == 0 && done == 0) ? 1 : -1;
+
+        done += got;
+    }
+
+    return 0;
+}
+
+int writeFull(int fd, const void *buf, size_t size) {
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t written = write(fd, (const unsigned char *) buf + done, size - done);
+
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+
+        done += written;
+    }
+
+    return 0;
+}
+
+uint32_t getUint32(const unsigned char *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+void putUint32(unsigned char *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+#ifdef _WIN32
+
+int serve(const char *path, int workers, void (*warmUp)(void), connectionHandler handler) {
+    error("serving is not supported on this platform");
+    return 1;
+}
+
+#else
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int sig) {
+    stopping = 1;
+}
+
+static void workerLoop(int listener, void (*warmUp)(void), connectionHandler handler) {
+    // Shutdown is up to the parent, and a client hanging up only fails a write
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (warmUp != NULL)
+        warmUp();
+
+    while (1) {
+        int fd = accept(listener, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            error("could not accept connection");
+            _exit(1);
+        }
+
+        handler(fd);
+        close(fd);
+    }
+}
+
+static pid_t startWorker(int listener, void (*warmUp)(void), connectionHandler handler) {
+    pid_t pid = fork();
+
+    if (pid == 0)
+        workerLoop(listener, warmUp, handler);
+    else if (pid < 0)
+        error("could not start worker");
+
+    return pid;
+}
+
+int serve(const char *path, int workers, void (*warmUp)(void), connectionHandler handler) {
+    struct sockaddr_un addr;
+    struct sigaction action;
+    struct stat st;
+    pid_t *pids;
+    int listener;
+    int ret = 0;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        error("socket path is too long: %s", path);
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // Replace the socket of an earlier run, but never a regular file
+    if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *) &addr, sizeof addr) || listen(listener, workers * BACKLOG_PER_WORKER)) {
+        error("could not listen on socket: %s", path);
+        if (listener >= 0)
+            close(listener);
+        return 1;
+    }
+
+    pids = calloc(workers, sizeof(pid_t));
+    if (pids == NULL) {
+        error("out of memory");
+        close(listener);
+        unlink(path);
+        return 1;
+    }
+
+    // No SA_RESTART, so a signal interrupts wait below
+    memset(&action, 0, sizeof action);
+    action.sa_handler = stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    for (int x = 0; x < workers && !stopping; x++)
+        pids[x] = startWorker(listener, warmUp, handler);
+
+    while (!stopping) {
+        pid_t pid = wait(NULL);
+
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            error("no workers left, shutting down");
+            ret = 1;
+            break;
+        }
+
+        for (int x = 0; x < workers; x++) {
+            if (pids[x] == pid && !stopping) {
+                error("worker %ld exited, restarting it", (long) pid);
+                pids[x] = startWorker(listener, warmUp, handler);
+            }
+        }
+    }
+
+    for (int x = 0; x < workers; x++) {
+        if (pids[x] > 0)
+            kill(pids[x], SIGTERM);
+    }
+    while (wait(NULL) > 0 || errno == EINTR);
+
+    free(pids);
+    close(listener);
+    unlink(path);
+
+    return ret;
+}
+
+#endif
@@ -0,0 +1,36 @@
+/*
+    Pre-forked Unix socket server
+*/
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Handle one accepted connection, which is closed afterwards. */
+typedef void (*connectionHandler)(int fd);
+
+/*
+    Listen on a Unix socket at path and serve connections with a fixed
+    pool of worker processes forked up front. Every worker calls warmUp
+    (which may be NULL) once before accepting, and then handles one
+    connection at a time, so a client only gets as far ahead as the
+    socket buffers allow. Workers that die are restarted. Runs until
+    interrupted or terminated, then removes the socket. Returns 0 on a
+    clean shutdown.
+*/
+int serve(const char *path, int workers, void (*warmUp)(void), connectionHandler handler);
+
+/*
+    Read or write exactly size bytes. Returns 0 on success, 1 if the
+    peer closed the connection before the first byte was read, or -1 on
+    any other error.
+*/
+int readFull(int fd, void *buf, size_t size);
+int writeFull(int fd, const void *buf, size_t size);
+
+/* Big-endian integers, as used in frame headers. */
+uint32_t getUint32(const unsigned char *p);
+void putUint32(unsigned char *p, uint32_t value);
+
+#endif
@@ -1,19 +1,73 @@
+// Needed for fileno, writev, copy_file_range etc. under -std=c99
+#define _GNU_SOURCE
+
 #include "util.h"
 
+#include <errno.h>
+#include <jerror.h>
+#include <limits.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #ifdef _WIN32
     #include <io.h>
     #include <fcntl.h>
+#else
+    #include <fcntl.h>
+    #include <sys/uio.h>
+    #include <unistd.h>
+#endif
+
+#ifdef __linux__
+    #include <linux/fs.h>
+    #include <sys/ioctl.h>
+    #include <sys/sendfile.h>
 #endif
 
 #define INPUT_BUFFER_SIZE 102400
+#define OUTPUT_BUFFER_SIZE 65536
 
 const char *VERSION = "2.2.0";
-const char *progname;
+const char *progname = "jpeg-archive";
+
+/*
+    libjpeg error manager which jumps back to the caller on fatal errors
+    instead of calling exit(), so a corrupt file only fails that file.
+*/
+struct errorManager {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+/*
+    In-memory destination which, unlike jpeg_mem_dest, always keeps the
+    caller's pointer current so the buffer can be freed after an error.
+*/
+struct memoryDestination {
+    struct jpeg_destination_mgr pub;
+    unsigned char **buffer;
+    unsigned long *size;
+    unsigned long allocated;
+};
+
+/*
+    Sequential image reader. JPEG rows are decoded on demand, PPM rows
+    are copied straight out of the input buffer.
+*/
+struct rowReader {
+    enum filetype type;
+    int width;
+    int height;
+    int components;
+    int row;
+    const unsigned char *pixels;
+    struct jpeg_decompress_struct cinfo;
+    struct errorManager jerr;
+};
 
 /* Print program version to stdout. */
 void version(void) {
@@ -33,10 +87,7 @@ void error(const char *format, ...) {
 
 long readFile(char *name, void **buffer) {
     FILE *file;
-    size_t fileLen = 0;
-    size_t bytesRead = 0;
-
-    unsigned char chunk[INPUT_BUFFER_SIZE];
+    long fileLen;
 
     // Open file
     if (strcmp("-", name) == 0) {
@@ -54,10 +105,23 @@ long readFile(char *name, void **buffer) {
         if (!file)
         {
             error("unable to open file: %s", name);
+            *buffer = NULL;
             return 0;
         }
     }
 
+    fileLen = readStream(file, buffer);
+
+    fclose(file);
+    return fileLen;
+}
+
+long readStream(FILE *file, void **buffer) {
+    size_t fileLen = 0;
+    size_t bytesRead = 0;
+
+    unsigned char chunk[INPUT_BUFFER_SIZE];
+
     *buffer = malloc(sizeof chunk);
     while ((bytesRead = fread(chunk, 1, sizeof chunk, file)) > 0) {
         unsigned char *reallocated = realloc(*buffer, fileLen + bytesRead);
@@ -68,78 +132,667 @@ long readFile(char *name, void **buffer) {
         } else {
             error("only able to read %zu bytes!", fileLen);
             free(*buffer);
-            fclose(file);
+            *buffer = NULL;
             return 0;
         }
     }
 
-    fclose(file);
     return fileLen;
 }
 
+long readLines(char *name, char **buf, char ***lines) {
+    long bufSize, count = 0, size = 0;
+    char *line, *end, *reallocated;
+
+    *buf = NULL;
+    *lines = NULL;
+
+    bufSize = readFile(name, (void **) buf);
+    if (!bufSize)
+        return 0;
+
+    // Make room for a terminator after the last line
+    reallocated = realloc(*buf, bufSize + 1);
+    if (reallocated == NULL)
+        return 0;
+    *buf = reallocated;
+
+    for (line = *buf; line < *buf + bufSize; line = end + 1) {
+        end = memchr(line, '\n', *buf + bufSize - line);
+        if (end == NULL)
+            end = *buf + bufSize;
+
+        *end = '\0';
+        if (end > line && end[-1] == '\r')
+            end[-1] = '\0';
+
+        if (!*line)
+            continue;
+
+        if (count == size) {
+            char **grown;
+
+            size = size ? size * 2 : 256;
+            grown = realloc(*lines, size * sizeof(char *));
+            if (grown == NULL)
+                break;
+            *lines = grown;
+        }
+
+        (*lines)[count++] = line;
+    }
+
+    return count;
+}
+
+int isSameFile(const char *name1, const char *name2) {
+    if (!strcmp("-", name1) || !strcmp("-", name2))
+        return 0;
+
+#ifdef _WIN32
+    // No reliable inode numbers, so only catch the obvious case
+    return !strcmp(name1, name2);
+#else
+    struct stat st1, st2;
+
+    if (stat(name1, &st1) || stat(name2, &st2))
+        return 0;
+
+    return st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+#endif
+}
+
+long copyStream(FILE *input, FILE *output) {
+    unsigned char chunk[INPUT_BUFFER_SIZE];
+    size_t bytesRead = 0;
+    long total = 0;
+
+    while ((bytesRead = fread(chunk, 1, sizeof chunk, input)) > 0) {
+        if (fwrite(chunk, 1, bytesRead, output) != bytesRead) {
+            error("only able to write %ld bytes!", total);
+            return -1;
+        }
+        total += bytesRead;
+    }
+
+    return ferror(input) ? -1 : total;
+}
+
+#ifndef _WIN32
+/*
+    Copy from one file descriptor to another, letting the kernel move the
+    data where it can. Returns the number of bytes copied or -1 on error.
+*/
+static long copyFd(int input, int output) {
+    unsigned char chunk[INPUT_BUFFER_SIZE];
+    ssize_t bytesRead, bytesWritten;
+    long total = 0;
+
+#ifdef __linux__
+    struct stat inStat, outStat;
+
+    if (!fstat(input, &inStat) && !fstat(output, &outStat) &&
+            S_ISREG(inStat.st_mode) && S_ISREG(outStat.st_mode)) {
+        off_t remaining = inStat.st_size;
+        ssize_t copied = 0;
+
+#ifdef FICLONE
+        // Reflink (btrfs, XFS): share the extents, nothing gets copied
+        if (inStat.st_dev == outStat.st_dev && !outStat.st_size &&
+                !ioctl(output, FICLONE, input)) {
+            return inStat.st_size;
+        }
+#endif
+
+        // In-kernel copy, server-side on network filesystems
+        while (remaining > 0 && (copied = copy_file_range(input, NULL, output, NULL, remaining, 0)) > 0) {
+            remaining -= copied;
+            total += copied;
+        }
+
+        if (!remaining)
+            return total;
+    }
+
+    // Not supported for these files (EXDEV, ENOSYS, pipes, ...), so fall
+    // back to sendfile which still avoids copying through userspace
+    while ((bytesWritten = sendfile(output, input, NULL, INPUT_BUFFER_SIZE * 16)) > 0)
+        total += bytesWritten;
+
+    if (!bytesWritten)
+        return total;
+#endif
+
+    while ((bytesRead = read(input, chunk, sizeof chunk)) > 0) {
+        unsigned char *pos = chunk;
+
+        while (bytesRead > 0) {
+            bytesWritten = write(output, pos, bytesRead);
+            if (bytesWritten < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            pos += bytesWritten;
+            bytesRead -= bytesWritten;
+            total += bytesWritten;
+        }
+    }
+
+    return bytesRead < 0 ? -1 : total;
+}
+#endif
+
+long copyFileTo(const char *name, FILE *output) {
+    long total;
+
+#ifdef _WIN32
+    FILE *input = fopen(name, "rb");
+
+    if (!input) {
+        error("unable to open file: %s", name);
+        return -1;
+    }
+
+    total = copyStream(input, output);
+    fclose(input);
+#else
+    int input = open(name, O_RDONLY);
+
+    if (input < 0) {
+        error("unable to open file: %s", name);
+        return -1;
+    }
+
+    // Anything already buffered must go out before the copied data
+    fflush(output);
+    total = copyFd(input, fileno(output));
+    close(input);
+#endif
+
+    return total;
+}
+
+int writeSlices(FILE *file, const struct slice *slices, int count) {
+#ifdef _WIN32
+    for (int x = 0; x < count; x++) {
+        if (slices[x].size && fwrite(slices[x].data, slices[x].size, 1, file) != 1)
+            return 1;
+    }
+
+    return 0;
+#else
+    fflush(file);
+
+    return writeSlicesFd(fileno(file), slices, count);
+#endif
+}
+
+#ifndef _WIN32
+int writeSlicesFd(int fd, const struct slice *slices, int count) {
+    struct iovec iov[count];
+    struct iovec *next = iov;
+
+    for (int x = 0; x < count; x++) {
+        iov[x].iov_base = (void *) slices[x].data;
+        iov[x].iov_len = slices[x].size;
+    }
+
+    // Write everything with a single system call, looping only if the
+    // kernel accepted part of the data
+    while (count > 0) {
+        ssize_t written = writev(fd, next, count);
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+
+        while (count > 0 && (size_t) written >= next->iov_len) {
+            written -= next->iov_len;
+            next++;
+            count--;
+        }
+
+        if (count > 0) {
+            next->iov_base = (unsigned char *) next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+int findJpegComment(FILE *file, const char *comment) {
+    return readJpegComment(file, comment, NULL, 0);
+}
+
+int readJpegComment(FILE *file, const char *comment, char *rest, size_t restSize) {
+    unsigned char header[4];
+    size_t commentLen = strlen(comment);
+    char *text;
+    int c, marker, size;
+
+    // Must start with SOI
+    if (fread(header, 1, 2, file) != 2 || !checkJpegMagic(header, 2))
+        return 0;
+
+    text = malloc(commentLen);
+
+    while (1) {
+        // Markers may be padded with any number of 0xff fill bytes
+        if ((c = fgetc(file)) != 0xff)
+            break;
+        while ((c = fgetc(file)) == 0xff);
+        if (c == EOF)
+            break;
+
+        marker = 0xff00 + c;
+
+        if (marker == 0xffda /* SOS */ || marker == 0xffd9 /* EOI */) {
+            // This is the end of the headers, so stop!
+            break;
+        } else if (marker >= 0xffd0 && marker <= 0xffd7 /* RST0+x */) {
+            continue;
+        }
+
+        if (fread(header, 1, 2, file) != 2)
+            break;
+
+        size = (header[0] << 8) + header[1];
+        if (size < 2)
+            break;
+        size -= 2;
+
+        if (marker == 0xfffe /* COM */ && (size_t) size >= commentLen) {
+            if (fread(text, 1, commentLen, file) != commentLen)
+                break;
+            if (!strncmp(comment, text, commentLen)) {
+                // Hand back whatever follows the matched text
+                if (rest != NULL && restSize) {
+                    size_t restLen = MIN((size_t) size - commentLen, restSize - 1);
+
+                    if (fread(rest, 1, restLen, file) != restLen)
+                        restLen = 0;
+                    rest[restLen] = '\0';
+                }
+
+                free(text);
+                return 1;
+            }
+            size -= commentLen;
+        }
+
+        if (fseek(file, size, SEEK_CUR))
+            break;
+    }
+
+    free(text);
+    return 0;
+}
+
+int readJpegCommentFromBuffer(const unsigned char *buf, unsigned long bufSize, const char *comment, char *rest, size_t restSize) {
+    size_t commentLen = strlen(comment);
+    unsigned long pos = 2;
+
+    // Must start with SOI
+    if (!checkJpegMagic(buf, bufSize))
+        return 0;
+
+    while (pos < bufSize && buf[pos] == 0xff) {
+        unsigned long size;
+        int marker;
+
+        // Markers may be padded with any number of 0xff fill bytes
+        while (pos < bufSize && buf[pos] == 0xff)
+            pos++;
+        if (pos >= bufSize)
+            break;
+
+        marker = 0xff00 + buf[pos++];
+
+        if (marker == 0xffda /* SOS */ || marker == 0xffd9 /* EOI */) {
+            // This is the end of the headers, so stop!
+            break;
+        } else if (marker >= 0xffd0 && marker <= 0xffd7 /* RST0+x */) {
+            continue;
+        }
+
+        if (pos + 2 > bufSize)
+            break;
+
+        size = (buf[pos] << 8) + buf[pos + 1];
+        if (size < 2 || pos + size > bufSize)
+            break;
+        size -= 2;
+        pos += 2;
+
+        if (marker == 0xfffe /* COM */ && size >= commentLen && !strncmp(comment, (const char *) buf + pos, commentLen)) {
+            // Hand back whatever follows the matched text
+            if (rest != NULL && restSize) {
+                size_t restLen = MIN(size - commentLen, restSize - 1);
+
+                memcpy(rest, buf + pos + commentLen, restLen);
+                rest[restLen] = '\0';
+            }
+
+            return 1;
+        }
+
+        pos += size;
+    }
+
+    return 0;
+}
+
+static void errorExit(j_common_ptr cinfo) {
+    struct errorManager *err = (struct errorManager *) cinfo->err;
+    char message[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message)(cinfo, message);
+    error("libjpeg: %s", message);
+
+    longjmp(err->jump, 1);
+}
+
+static void emitMessage(j_common_ptr cinfo, int msgLevel) {
+    // Count warnings such as corrupt data, trace messages are ignored
+    if (msgLevel < 0) {
+        cinfo->err->num_warnings++;
+    }
+}
+
+static struct jpeg_error_mgr *errorManager(struct errorManager *err) {
+    jpeg_std_error(&err->pub);
+    err->pub.error_exit = errorExit;
+    err->pub.emit_message = emitMessage;
+
+    return &err->pub;
+}
+
+static void initDestination(j_compress_ptr cinfo) {
+    struct memoryDestination *dest = (struct memoryDestination *) cinfo->dest;
+
+    *dest->buffer = malloc(OUTPUT_BUFFER_SIZE);
+    if (*dest->buffer == NULL)
+        ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+
+    dest->allocated = OUTPUT_BUFFER_SIZE;
+    dest->pub.next_output_byte = *dest->buffer;
+    dest->pub.free_in_buffer = dest->allocated;
+}
+
+static boolean emptyOutputBuffer(j_compress_ptr cinfo) {
+    struct memoryDestination *dest = (struct memoryDestination *) cinfo->dest;
+    unsigned char *reallocated = realloc(*dest->buffer, dest->allocated * 2);
+
+    if (reallocated == NULL)
+        ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 1);
+
+    *dest->buffer = reallocated;
+    dest->pub.next_output_byte = reallocated + dest->allocated;
+    dest->pub.free_in_buffer = dest->allocated;
+    dest->allocated *= 2;
+
+    return TRUE;
+}
+
+static void termDestination(j_compress_ptr cinfo) {
+    struct memoryDestination *dest = (struct memoryDestination *) cinfo->dest;
+
+    *dest->size = dest->allocated - dest->pub.free_in_buffer;
+}
+
+static void memoryDestination(j_compress_ptr cinfo, struct memoryDestination *dest, unsigned char **buffer, unsigned long *size) {
+    *buffer = NULL;
+    *size = 0;
+
+    dest->pub.init_destination = initDestination;
+    dest->pub.empty_output_buffer = emptyOutputBuffer;
+    dest->pub.term_destination = termDestination;
+    dest->buffer = buffer;
+    dest->size = size;
+    dest->allocated = 0;
+
+    cinfo->dest = &dest->pub;
+}
+
 int checkJpegMagic(const unsigned char *buf, unsigned long size) {
     return (size >= 2 && buf[0] == 0xff && buf[1] == 0xd8);
 }
 
 unsigned long decodeJpeg(unsigned char *buf, unsigned long bufSize, unsigned char **image, int *width, int *height, int pixelFormat) {
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    int row_stride;
-    JSAMPARRAY buffer;
+    struct rowReader *reader;
+    size_t imageSize;
 
-    cinfo.err = jpeg_std_error(&jerr);
+    *image = NULL;
 
-    jpeg_create_decompress(&cinfo);
+    reader = openRowReader(buf, bufSize, FILETYPE_JPEG, pixelFormat, width, height);
+    if (reader == NULL)
+        return 0;
 
-    // Set the source
-    jpeg_mem_src(&cinfo, buf, bufSize);
+    // Allocate image pixel buffer
+    imageSize = (size_t) (*width) * reader->components * (*height);
+    *image = malloc(imageSize);
+    if (*image == NULL) {
+        error("unable to allocate %zu bytes for the image!", imageSize);
+        closeRowReader(reader);
+        return 0;
+    }
 
-    // Read header and set custom parameters
-    jpeg_read_header(&cinfo, TRUE);
+    // Read the whole image in one go
+    if (readRows(reader, *image, *height) != *height) {
+        closeRowReader(reader);
+        free(*image);
+        *image = NULL;
+        return 0;
+    }
 
-    cinfo.out_color_space = pixelFormat;
+    closeRowReader(reader);
 
-    // Start decompression
-    jpeg_start_decompress(&cinfo);
+    return imageSize;
+}
 
-    *width = cinfo.output_width;
-    *height = cinfo.output_height;
+static void useScanScript(j_compress_ptr cinfo, const struct scanScript *scans) {
+    cinfo->scan_info = scans->scans;
+    cinfo->num_scans = scans->count;
+    if (jpeg_c_bool_param_supported(cinfo, JBOOLEAN_OPTIMIZE_SCANS)) {
+        jpeg_c_set_bool_param(cinfo, JBOOLEAN_OPTIMIZE_SCANS, FALSE);
+    }
+}
 
-    // Allocate temporary row
-    row_stride = (*width) * cinfo.output_components;
-    buffer = (*cinfo.mem->alloc_sarray)
-        ((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
+/*
+    Set the quantization tables for a fractional quality. The default
+    tables are scaled like jpeg_set_quality does, only the scale factor
+    is kept to a hundredth of a percent instead of a whole percent.
+*/
+static void setFineQuality(j_compress_ptr cinfo, float quality) {
+    unsigned int table[DCTSIZE2];
+    long scale;
+
+    if (quality < 1)
+        quality = 1;
+    if (quality > 100)
+        quality = 100;
+    scale = (long) ((quality < 50 ? 5000 / quality : 200 - quality * 2) * 100 + 0.5f);
+
+    // The default tables are not exported, but a 100% scale leaves them as they are
+    jpeg_set_linear_quality(cinfo, 100, FALSE);
+
+    for (int t = 0; t < NUM_QUANT_TBLS; t++) {
+        if (cinfo->quant_tbl_ptrs[t] == NULL)
+            continue;
+
+        for (int x = 0; x < DCTSIZE2; x++) {
+            long value = (cinfo->quant_tbl_ptrs[t]->quantval[x] * scale + 5000) / 10000;
+            table[x] = value < 1 ? 1 : (value > 255 ? 255 : value);
+        }
+        jpeg_add_quant_table(cinfo, t, table, 100, TRUE);
+    }
+}
 
-    // Allocate image pixel buffer
-    *image = malloc(row_stride * (*height));
+// Fixed point RGB to YCbCr conversion as done by libjpeg (jccolor.c)
+#define YCC_SCALEBITS 16
+#define YCC_FIX(x) ((long) ((x) * (1L << YCC_SCALEBITS) + 0.5))
+#define YCC_CHROMA_OFFSET ((128L << YCC_SCALEBITS) + (1L << (YCC_SCALEBITS - 1)) - 1)
 
-    // Read image row by row
-    int row = 0;
-    while (cinfo.output_scanline < cinfo.output_height) {
-        (void) jpeg_read_scanlines(&cinfo, buffer, 1);
-        memcpy((void *)((*image) + row_stride * row), buffer[0], row_stride);
-        row++;
+static int toCb(const unsigned char *p) {
+    return (-YCC_FIX(0.16874) * p[0] - YCC_FIX(0.33126) * p[1] + YCC_FIX(0.5) * p[2] + YCC_CHROMA_OFFSET) >> YCC_SCALEBITS;
+}
+
+static int toCr(const unsigned char *p) {
+    return (YCC_FIX(0.5) * p[0] - YCC_FIX(0.41869) * p[1] - YCC_FIX(0.08131) * p[2] + YCC_CHROMA_OFFSET) >> YCC_SCALEBITS;
+}
+
+int convertYcc(const unsigned char *rgb, const unsigned char *gray, int width, int height, int subsample, struct yccImage *ycc) {
+    // Pixels per chroma sample in each direction
+    int factor = (subsample == SUBSAMPLE_444) ? 1 : 2;
+    int block = factor * DCTSIZE;
+    size_t stride = (size_t) width * 3;
+    size_t planeSize;
+
+    memset(ycc, 0, sizeof *ycc);
+    ycc->width = width;
+    ycc->height = height;
+    ycc->subsample = subsample;
+    ycc->y = gray;
+
+    // Padded to whole MCUs, so the encoder never reads past the planes
+    ycc->chromaWidth = (width + block - 1) / block * DCTSIZE;
+    ycc->chromaHeight = (height + block - 1) / block * DCTSIZE;
+    planeSize = (size_t) ycc->chromaWidth * ycc->chromaHeight;
+
+    ycc->cb = malloc(planeSize);
+    ycc->cr = malloc(planeSize);
+    if (ycc->cb == NULL || ycc->cr == NULL) {
+        freeYcc(ycc);
+        return 1;
     }
 
-    jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
+    for (int y = 0; y < ycc->chromaHeight; y++) {
+        unsigned char *cb = ycc->cb + (size_t) y * ycc->chromaWidth;
+        unsigned char *cr = ycc->cr + (size_t) y * ycc->chromaWidth;
+        const unsigned char *top = rgb + (size_t) MIN(y * factor, height - 1) * stride;
+        const unsigned char *bottom = rgb + (size_t) MIN(y * factor + factor - 1, height - 1) * stride;
+        int bias = 1;
+
+        // Rows below the image repeat the last one, columns right of it
+        // are sampled from repeats of the last pixel
+        if (y * factor >= height) {
+            memcpy(cb, cb - ycc->chromaWidth, ycc->chromaWidth);
+            memcpy(cr, cr - ycc->chromaWidth, ycc->chromaWidth);
+            continue;
+        }
+
+        for (int x = 0; x < ycc->chromaWidth; x++) {
+            size_t left = (size_t) MIN(x * factor, width - 1) * 3;
+            size_t right = (size_t) MIN(x * factor + factor - 1, width - 1) * 3;
 
-    return row_stride * (*height);
+            if (factor == 1) {
+                cb[x] = toCb(top + left);
+                cr[x] = toCr(top + left);
+                continue;
+            }
+
+            // 2x2 average with the alternating bias of libjpeg (jcsample.c)
+            cb[x] = (toCb(top + left) + toCb(top + right) + toCb(bottom + left) + toCb(bottom + right) + bias) >> 2;
+            cr[x] = (toCr(top + left) + toCr(top + right) + toCr(bottom + left) + toCr(bottom + right) + bias) >> 2;
+            bias ^= 3;
+        }
+    }
+
+    return 0;
 }
 
-unsigned long encodeJpeg(unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, int quality, int progressive, int optimize, int subsample) {
+void freeYcc(struct yccImage *ycc) {
+    free(ycc->cb);
+    free(ycc->cr);
+    ycc->cb = NULL;
+    ycc->cr = NULL;
+}
+
+/*
+    Write a converted image as raw data, one MCU row at a time. Y rows
+    are padded into strip when the width is not a multiple of a block.
+*/
+static void writeYcc(j_compress_ptr cinfo, const struct yccImage *ycc, unsigned char *strip) {
+    int lines = cinfo->max_v_samp_factor * DCTSIZE;
+    int chromaLines = cinfo->comp_info[1].v_samp_factor * DCTSIZE;
+    int yWidth = cinfo->comp_info[0].width_in_blocks * DCTSIZE;
+    JSAMPROW yRows[MAX_SAMP_FACTOR * DCTSIZE];
+    JSAMPROW cbRows[MAX_SAMP_FACTOR * DCTSIZE];
+    JSAMPROW crRows[MAX_SAMP_FACTOR * DCTSIZE];
+    JSAMPARRAY planes[3];
+
+    planes[0] = yRows;
+    planes[1] = cbRows;
+    planes[2] = crRows;
+
+    while (cinfo->next_scanline < cinfo->image_height) {
+        int first = cinfo->next_scanline;
+        int chromaFirst = first / lines * chromaLines;
+
+        for (int r = 0; r < lines; r++) {
+            // Rows below the image repeat the last one
+            const unsigned char *row = ycc->y + (size_t) MIN(first + r, ycc->height - 1) * ycc->width;
+
+            if (yWidth == ycc->width) {
+                yRows[r] = (JSAMPROW) row;
+            } else {
+                yRows[r] = strip + (size_t) r * yWidth;
+                memcpy(yRows[r], row, ycc->width);
+                memset(yRows[r] + ycc->width, row[ycc->width - 1], yWidth - ycc->width);
+            }
+        }
+
+        for (int r = 0; r < chromaLines; r++) {
+            cbRows[r] = ycc->cb + (size_t) (chromaFirst + r) * ycc->chromaWidth;
+            crRows[r] = ycc->cr + (size_t) (chromaFirst + r) * ycc->chromaWidth;
+        }
+
+        jpeg_write_raw_data(cinfo, planes, lines);
+    }
+}
+
+/*
+    Encode pixels either from buf, from a converted image or, when
+    reader is set, from a row reader one scanline at a time.
+*/
+static unsigned long compress(unsigned char **jpeg, const unsigned char *buf, const struct yccImage *ycc, struct rowReader *reader, int width, int height, int pixelFormat, float quality, int progressive, int optimize, int subsample, const struct scanScript *scans) {
     long unsigned int jpegSize = 0;
     struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+    struct errorManager jerr;
+    struct memoryDestination dest;
     JSAMPROW row_pointer[1];
-    int row_stride = width * (pixelFormat == JCS_RGB ? 3 : 1);
+    size_t row_stride = (size_t) width * (pixelFormat == JCS_RGB ? 3 : 1);
+    unsigned char *row = NULL;
+
+    *jpeg = NULL;
+
+    if (reader != NULL || ycc != NULL) {
+        // A scanline, or a strip of padded Y rows
+        row = malloc(reader != NULL ? row_stride : (size_t) (width + DCTSIZE) * MAX_SAMP_FACTOR * DCTSIZE);
+        if (row == NULL)
+            return 0;
+    }
+
+    cinfo.err = errorManager(&jerr);
 
-    cinfo.err = jpeg_std_error(&jerr);
+    if (setjmp(jerr.jump)) {
+        // Something went wrong, release everything and report failure
+        jpeg_destroy_compress(&cinfo);
+        free(*jpeg);
+        *jpeg = NULL;
+        free(row);
+        return 0;
+    }
 
     jpeg_create_compress(&cinfo);
 
     // Set destination
-    jpeg_mem_dest(&cinfo, jpeg, &jpegSize);
+    memoryDestination(&cinfo, &dest, jpeg, &jpegSize);
 
     // Set options
     cinfo.image_width = width;
@@ -185,6 +838,11 @@ unsigned long encodeJpeg(unsigned char **jpeg, unsigned char *buf, int width, in
         jpeg_simple_progression(&cinfo);
     }
 
+    if (optimize && progressive && scans != NULL) {
+        // A known good script, instead of trying several for this image
+        useScanScript(&cinfo, scans);
+    }
+
     if (subsample == SUBSAMPLE_444) {
         cinfo.comp_info[0].h_samp_factor = 1;
         cinfo.comp_info[0].v_samp_factor = 1;
@@ -194,19 +852,109 @@ unsigned long encodeJpeg(unsigned char **jpeg, unsigned char *buf, int width, in
         cinfo.comp_info[2].v_samp_factor = 1;
     }
 
-    jpeg_set_quality(&cinfo, quality, TRUE);
+    if (quality == (int) quality)
+        jpeg_set_quality(&cinfo, quality, TRUE);
+    else
+        setFineQuality(&cinfo, quality);
+
+    // Converted images skip libjpeg's color conversion and downsampling
+    cinfo.raw_data_in = (ycc != NULL);
 
     // Start the compression
     jpeg_start_compress(&cinfo, TRUE);
 
+    if (ycc != NULL)
+        writeYcc(&cinfo, ycc, row);
+
     // Process scanlines one by one
     while (cinfo.next_scanline < cinfo.image_height) {
-        row_pointer[0] = &buf[cinfo.next_scanline * row_stride];
+        if (reader != NULL) {
+            if (readRows(reader, row, 1) != 1) {
+                jpeg_destroy_compress(&cinfo);
+                free(*jpeg);
+                *jpeg = NULL;
+                free(row);
+                return 0;
+            }
+            row_pointer[0] = row;
+        } else {
+            row_pointer[0] = (JSAMPROW) &buf[cinfo.next_scanline * row_stride];
+        }
         (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
     }
 
     jpeg_finish_compress(&cinfo);
     jpeg_destroy_compress(&cinfo);
+    free(row);
+
+    return jpegSize;
+}
+
+unsigned long encodeJpeg(unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, float quality, int progressive, int optimize, int subsample, const struct scanScript *scans) {
+    return compress(jpeg, buf, NULL, NULL, width, height, pixelFormat, quality, progressive, optimize, subsample, scans);
+}
+
+unsigned long encodeJpegFromReader(unsigned char **jpeg, struct rowReader *reader, float quality, int progressive, int optimize, int subsample, const struct scanScript *scans) {
+    return compress(jpeg, NULL, NULL, reader, reader->width, reader->height, reader->components == 3 ? JCS_RGB : JCS_GRAYSCALE, quality, progressive, optimize, subsample, scans);
+}
+
+unsigned long encodeJpegFromYcc(unsigned char **jpeg, const struct yccImage *ycc, float quality, int progressive, int optimize, const struct scanScript *scans) {
+    return compress(jpeg, NULL, ycc, NULL, ycc->width, ycc->height, JCS_RGB, quality, progressive, optimize, ycc->subsample, scans);
+}
+
+unsigned long recodeJpeg(unsigned char **jpeg, const unsigned char *buf, unsigned long bufSize, int progressive, const struct scanScript *scans) {
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_compress_struct cinfo;
+    struct errorManager jerr;
+    struct memoryDestination dest;
+    jvirt_barray_ptr *coefficients;
+    unsigned long jpegSize = 0;
+
+    *jpeg = NULL;
+
+    // Destroying a zeroed struct does nothing, should creating one fail
+    memset(&dinfo, 0, sizeof dinfo);
+    memset(&cinfo, 0, sizeof cinfo);
+    dinfo.err = errorManager(&jerr);
+    cinfo.err = dinfo.err;
+
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_compress(&cinfo);
+        jpeg_destroy_decompress(&dinfo);
+        free(*jpeg);
+        *jpeg = NULL;
+        return 0;
+    }
+
+    jpeg_create_decompress(&dinfo);
+    jpeg_create_compress(&cinfo);
+
+    jpeg_mem_src(&dinfo, (unsigned char *) buf, bufSize);
+    jpeg_read_header(&dinfo, TRUE);
+    coefficients = jpeg_read_coefficients(&dinfo);
+
+    memoryDestination(&cinfo, &dest, jpeg, &jpegSize);
+    jpeg_copy_critical_parameters(&dinfo, &cinfo);
+    cinfo.optimize_coding = TRUE;
+
+    // Same scans as encodeJpeg with optimize set
+    if (!progressive) {
+        cinfo.scan_info = NULL;
+        cinfo.num_scans = 0;
+        if (jpeg_c_bool_param_supported(&cinfo, JBOOLEAN_OPTIMIZE_SCANS)) {
+            jpeg_c_set_bool_param(&cinfo, JBOOLEAN_OPTIMIZE_SCANS, FALSE);
+        }
+    } else if (scans != NULL) {
+        useScanScript(&cinfo, scans);
+    } else if (cinfo.scan_info == NULL) {
+        jpeg_simple_progression(&cinfo);
+    }
+
+    jpeg_write_coefficients(&cinfo, coefficients);
+    jpeg_finish_compress(&cinfo);
+    jpeg_finish_decompress(&dinfo);
+    jpeg_destroy_compress(&cinfo);
+    jpeg_destroy_decompress(&dinfo);
 
     return jpegSize;
 }
@@ -215,7 +963,11 @@ int checkPpmMagic(const unsigned char *buf, unsigned long size) {
     return (size >= 2 && buf[0] == 'P' && buf[1] == '6');
 }
 
-unsigned long decodePpm(unsigned char *buf, unsigned long bufSize, unsigned char **image, int *width, int *height) {
+/*
+    Parse a PPM header and return the offset of the pixel data, or 0 if
+    the header is invalid or does not match the amount of data.
+*/
+static unsigned long readPpmHeader(const unsigned char *buf, unsigned long bufSize, int *width, int *height) {
     unsigned long pos = 0, imageDataSize;
     int depth;
 
@@ -263,28 +1015,361 @@ unsigned long decodePpm(unsigned char *buf, unsigned long bufSize, unsigned char
     while (buf[pos++] != '\n' && pos < bufSize);
 
     // Width * height * red/green/blue
-    imageDataSize = (*width) * (*height) * 3;
+    imageDataSize = (size_t) (*width) * (*height) * 3;
     if (pos + imageDataSize != bufSize) {
         error("incorrect image size: %lu vs. %lu", bufSize, pos + imageDataSize);
         return 0;
     }
 
+    return pos;
+}
+
+unsigned long decodePpm(unsigned char *buf, unsigned long bufSize, unsigned char **image, int *width, int *height) {
+    unsigned long pos = readPpmHeader(buf, bufSize, width, height);
+    size_t imageDataSize = (size_t) (*width) * (*height) * 3;
+
+    if (!pos)
+        return 0;
+
     // Allocate image pixel buffer
     *image = malloc(imageDataSize);
+    if (*image == NULL) {
+        error("unable to allocate %zu bytes for the image!", imageDataSize);
+        return 0;
+    }
 
     // Copy pixel data
     memcpy((void *) *image, (void *) buf + pos, imageDataSize);
 
-    return (*width) * (*height);
+    return (size_t) (*width) * (*height);
+}
+
+/*
+    Read the next number from a PPM header, skipping whitespace and
+    comments, and add the number of bytes read to consumed. Returns -1
+    if there is none.
+*/
+static int readPpmNumber(FILE *file, long *consumed) {
+    int c, value = 0, digits = 0;
+
+    while ((c = fgetc(file)) != EOF) {
+        (*consumed)++;
+        if (c == '#') {
+            while ((c = fgetc(file)) != EOF && c != '\n')
+                (*consumed)++;
+            if (c != EOF)
+                (*consumed)++;
+        } else if (c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+            break;
+        }
+    }
+
+    while (c >= '0' && c <= '9' && value < 1000000) {
+        value = value * 10 + (c - '0');
+        digits++;
+        c = fgetc(file);
+        if (c != EOF)
+            (*consumed)++;
+    }
+
+    // A single whitespace character separates the header from the data
+    return digits ? value : -1;
+}
+
+unsigned long readPpm(const char *name, unsigned char **image, int *width, int *height, long *fileSize, rowCallback callback, void *data) {
+    FILE *file;
+    unsigned char magic[2];
+    size_t stride, rowsPerChunk;
+    int depth;
+
+    *image = NULL;
+
+    if (strcmp("-", name) == 0) {
+        file = stdin;
+
+        #ifdef _WIN32
+            setmode(fileno(stdin), O_BINARY);
+        #endif
+    } else {
+        file = fopen(name, "rb");
+
+        if (!file) {
+            error("unable to open file: %s", name);
+            return 0;
+        }
+    }
+
+#ifdef F_SETPIPE_SZ
+    {
+        struct stat st;
+
+        // A bigger pipe lets the producer (e.g. dcraw) run further ahead
+        // while earlier rows are being processed
+        if (!fstat(fileno(file), &st) && S_ISFIFO(st.st_mode))
+            fcntl(fileno(file), F_SETPIPE_SZ, 1 << 20);
+    }
+#endif
+
+    if (fread(magic, 1, 2, file) != 2 || !checkPpmMagic(magic, 2)) {
+        error("not a valid PPM format image!");
+        fclose(file);
+        return 0;
+    }
+
+    // Count the header as it is read, ftell fails on pipes
+    *fileSize = 2;
+    *width = readPpmNumber(file, fileSize);
+    *height = readPpmNumber(file, fileSize);
+    depth = readPpmNumber(file, fileSize);
+
+    if (*width <= 0 || *height <= 0) {
+        error("not a valid PPM format image!");
+        fclose(file);
+        return 0;
+    }
+
+    if (depth != 255) {
+        error("unsupported bit depth: %d", depth);
+        fclose(file);
+        return 0;
+    }
+
+    // Allocate image pixel buffer, the data is read straight into it
+    stride = (size_t) (*width) * 3;
+    *image = malloc(stride * (*height));
+    if (*image == NULL) {
+        error("unable to allocate %zu bytes for the image!", stride * (*height));
+        fclose(file);
+        return 0;
+    }
+
+    rowsPerChunk = MAX(1, INPUT_BUFFER_SIZE / stride);
+
+    for (int row = 0; row < *height;) {
+        int count = MIN(rowsPerChunk, (size_t) (*height - row));
+        unsigned char *rows = *image + stride * row;
+
+        if (fread(rows, stride, count, file) != (size_t) count) {
+            error("incorrect image size: only %d of %d rows", row, *height);
+            free(*image);
+            *image = NULL;
+            fclose(file);
+            return 0;
+        }
+
+        // Let the caller work on these rows while more data arrives
+        if (callback)
+            callback(rows, *width, *height, row, count, data);
+
+        row += count;
+    }
+
+    *fileSize += stride * (*height);
+    fclose(file);
+
+    return (size_t) (*width) * (*height);
+}
+
+struct rowReader *openRowReader(const unsigned char *buf, unsigned long bufSize, enum filetype type, int pixelFormat, int *width, int *height) {
+    struct rowReader *reader = calloc(1, sizeof *reader);
+    unsigned long pos;
+
+    if (reader == NULL)
+        return NULL;
+
+    reader->type = type;
+
+    switch (type) {
+        case FILETYPE_PPM:
+            if (pixelFormat != JCS_RGB) {
+                error("PPM images can only be read as RGB!");
+                free(reader);
+                return NULL;
+            }
+
+            pos = readPpmHeader(buf, bufSize, &reader->width, &reader->height);
+            if (!pos) {
+                free(reader);
+                return NULL;
+            }
+
+            // Rows are served straight from the input buffer
+            reader->pixels = buf + pos;
+            reader->components = 3;
+            break;
+        case FILETYPE_JPEG:
+            reader->cinfo.err = errorManager(&reader->jerr);
+
+            if (setjmp(reader->jerr.jump)) {
+                jpeg_destroy_decompress(&reader->cinfo);
+                free(reader);
+                return NULL;
+            }
+
+            jpeg_create_decompress(&reader->cinfo);
+
+            // Set the source
+            jpeg_mem_src(&reader->cinfo, (unsigned char *) buf, bufSize);
+
+            // Read header and set custom parameters
+            jpeg_read_header(&reader->cinfo, TRUE);
+
+            reader->cinfo.out_color_space = pixelFormat;
+
+            // Start decompression
+            jpeg_start_decompress(&reader->cinfo);
+
+            reader->width = reader->cinfo.output_width;
+            reader->height = reader->cinfo.output_height;
+            reader->components = reader->cinfo.output_components;
+            break;
+        default:
+            free(reader);
+            return NULL;
+    }
+
+    *width = reader->width;
+    *height = reader->height;
+
+    return reader;
+}
+
+int readRows(struct rowReader *reader, unsigned char *rows, int count) {
+    size_t stride = (size_t) reader->width * reader->components;
+    JSAMPROW rowPointer[1];
+
+    count = MIN(count, reader->height - reader->row);
+
+    switch (reader->type) {
+        case FILETYPE_PPM:
+            memcpy(rows, reader->pixels + stride * reader->row, stride * count);
+            reader->row += count;
+            return count;
+        case FILETYPE_JPEG:
+            if (setjmp(reader->jerr.jump))
+                return -1;
+
+            for (int x = 0; x < count; x++) {
+                rowPointer[0] = rows + stride * x;
+                (void) jpeg_read_scanlines(&reader->cinfo, rowPointer, 1);
+            }
+
+            reader->row += count;
+
+            // Read the trailer so warnings about it are still counted
+            if (reader->row == reader->height)
+                jpeg_finish_decompress(&reader->cinfo);
+
+            return count;
+        default:
+            return -1;
+    }
+}
+
+unsigned long rowReaderWarnings(const struct rowReader *reader) {
+    return (reader->type == FILETYPE_JPEG) ? reader->cinfo.err->num_warnings : 0;
+}
+
+void closeRowReader(struct rowReader *reader) {
+    if (reader->type == FILETYPE_JPEG)
+        jpeg_destroy_decompress(&reader->cinfo);
+
+    free(reader);
+}
+
+int previewScale(unsigned int width, unsigned int height, int minSize) {
+    int denom;
+
+    // Pick the smallest DCT scale that keeps both sides at least minSize
+    for (denom = 8; denom > 1; denom /= 2) {
+        if (width / denom >= (unsigned int) minSize && height / denom >= (unsigned int) minSize)
+            break;
+    }
+
+    return denom;
+}
+
+unsigned long decodeJpegPreview(FILE *file, const unsigned char *buf, unsigned long bufSize, int minSize, unsigned char **image, int *width, int *height) {
+    struct jpeg_decompress_struct cinfo;
+    struct errorManager jerr;
+    JSAMPROW rowPointer[1];
+    int denom, ret;
+
+    *image = NULL;
+    cinfo.err = errorManager(&jerr);
+
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        free(*image);
+        *image = NULL;
+        return 0;
+    }
+
+    jpeg_create_decompress(&cinfo);
+
+    // Read from the file as needed, so unused scans are never read
+    if (file != NULL)
+        jpeg_stdio_src(&cinfo, file);
+    else
+        jpeg_mem_src(&cinfo, (unsigned char *) buf, bufSize);
+
+    jpeg_read_header(&cinfo, TRUE);
+
+    denom = previewScale(cinfo.image_width, cinfo.image_height, minSize);
+
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denom;
+    cinfo.do_block_smoothing = FALSE;
+    cinfo.buffered_image = denom == 8 && cinfo.progressive_mode;
+
+    jpeg_start_decompress(&cinfo);
+
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
+    *image = malloc((size_t) (*width) * (*height));
+    if (*image == NULL)
+        ERREXIT1(&cinfo, JERR_OUT_OF_MEMORY, 0);
+
+    if (cinfo.buffered_image) {
+        // At 1/8 scale every pixel is just a DC coefficient, so stop
+        // once the first scan that carries the luma DC is complete
+        do {
+            ret = jpeg_consume_input(&cinfo);
+        } while (ret != JPEG_SUSPENDED && ret != JPEG_REACHED_EOI &&
+                 !(ret == JPEG_SCAN_COMPLETED && cinfo.coef_bits[0][0] >= 0));
+
+        jpeg_start_output(&cinfo, cinfo.input_scan_number);
+    }
+
+    while (cinfo.output_scanline < cinfo.output_height) {
+        rowPointer[0] = *image + (size_t) cinfo.output_scanline * (*width);
+        (void) jpeg_read_scanlines(&cinfo, rowPointer, 1);
+    }
+
+    // The rest of a progressive file is left unread
+    if (cinfo.buffered_image)
+        jpeg_finish_output(&cinfo);
+    else
+        jpeg_finish_decompress(&cinfo);
+
+    jpeg_destroy_decompress(&cinfo);
+
+    return (size_t) (*width) * (*height);
 }
 
 enum filetype detectFiletype(const char *filename) {
-    unsigned char *buf = NULL;
-    long bufSize = 0;
-    bufSize = readFile((char *)filename, (void **)&buf);
-    enum filetype ret = detectFiletypeFromBuffer(buf, bufSize);
-    free(buf);
-    return ret;
+    unsigned char magic[2];
+    size_t bytesRead = 0;
+    FILE *file = fopen(filename, "rb");
+
+    // Only the magic bytes are needed, not the whole file
+    if (file) {
+        bytesRead = fread(magic, 1, sizeof magic, file);
+        fclose(file);
+    }
+
+    return detectFiletypeFromBuffer(magic, bytesRead);
 }
 
 enum filetype detectFiletypeFromBuffer(unsigned char *buf, long bufSize) {
@@ -324,8 +1409,8 @@ int getMetadata(const unsigned char *buf, unsigned int bufSize, unsigned char **
     unsigned int sizes[20];
     unsigned int count = 0;
 
-    // Read through all the file markers
-    while (pos < bufSize && count < 20) {
+    // Read through all the file markers, stopping at truncated ones
+    while (pos + 4 <= bufSize && count < 20) {
         unsigned int marker = (buf[pos] << 8) + buf[pos + 1];
 
         //printf("Marker %x at %u\n", marker, pos);
@@ -342,6 +1427,10 @@ int getMetadata(const unsigned char *buf, unsigned int bufSize, unsigned char **
             int size = (buf[pos + 2] << 8) + buf[pos + 3];
             //printf("Size is %i (%x)\n", size, size);
 
+            if (pos + 2 + size > bufSize) {
+                break;
+            }
+
             // Save APP0+x and COM markers
             if ((marker >= 0xffe1 && marker <= 0xffef) || marker == 0xfffe) {
                 if (marker == 0xfffe && comment != NULL && !strncmp(comment, (char *) buf + pos + 4, strlen(comment))) {
@@ -371,3 +1460,154 @@ int getMetadata(const unsigned char *buf, unsigned int bufSize, unsigned char **
 
     return 0;
 }
+
+int metadataFromBlob(const unsigned char *buf, unsigned long bufSize, unsigned char **meta, unsigned int *metaSize) {
+    static const char exifHeader[] = "Exif\0";
+    static const char xmpHeader[] = "http://ns.adobe.com/xap/1.0/";
+    const char *header;
+    unsigned long headerSize;
+    unsigned long size;
+
+    *meta = NULL;
+    *metaSize = 0;
+
+    // Markers are used as they are, except for our own comment
+    if (bufSize >= 4 && buf[0] == 0xff) {
+        unsigned int pos = 0, kept = 0;
+
+        if (bufSize > UINT_MAX || getMetadata(buf, bufSize, meta, metaSize, NULL))
+            return 1;
+
+        while (pos < *metaSize) {
+            unsigned int size = 2 + ((*meta)[pos + 2] << 8) + (*meta)[pos + 3];
+
+            if ((*meta)[pos + 1] != 0xfe || size < 4 + strlen(RECOMPRESS_COMMENT) ||
+                    strncmp((char *) *meta + pos + 4, RECOMPRESS_COMMENT, strlen(RECOMPRESS_COMMENT))) {
+                memmove(*meta + kept, *meta + pos, size);
+                kept += size;
+            }
+            pos += size;
+        }
+
+        *metaSize = kept;
+        if (!kept) {
+            free(*meta);
+            *meta = NULL;
+            return 1;
+        }
+
+        return 0;
+    }
+
+    // Anything else goes into an APP1 marker with the header it needs
+    if (bufSize >= 6 && !memcmp(buf, exifHeader, 6)) {
+        header = "";
+        headerSize = 0;
+    } else if (bufSize >= 4 && (!memcmp(buf, "II*\0", 4) || !memcmp(buf, "MM\0*", 4))) {
+        header = exifHeader;
+        headerSize = 6;
+    } else if ((bufSize >= 9 && !memcmp(buf, "<?xpacket", 9)) || (bufSize >= 10 && !memcmp(buf, "<x:xmpmeta", 10))) {
+        header = xmpHeader;
+        headerSize = sizeof xmpHeader;
+    } else {
+        return 1;
+    }
+
+    // The length field covers itself, and a marker holds at most 64 kb
+    size = 2 + headerSize + bufSize;
+    if (size > 0xffff)
+        return 1;
+
+    *meta = malloc(size + 2);
+    if (*meta == NULL)
+        return 1;
+
+    (*meta)[0] = 0xff;
+    (*meta)[1] = 0xe1;
+    (*meta)[2] = size >> 8;
+    (*meta)[3] = size & 0xff;
+    memcpy(*meta + 4, header, headerSize);
+    memcpy(*meta + 4 + headerSize, buf, bufSize);
+    *metaSize = size + 2;
+
+    return 0;
+}
+
+int estimateJpegQuality(const unsigned char *buf, unsigned long bufSize, int *subsampled) {
+    // Luma table of the IJG examples, which jpeg_set_quality scales
+    static const unsigned char standardLuma[DCTSIZE2] = {
+        16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+        14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+        18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+        49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99
+    };
+    unsigned long pos = 2;
+    long standardSum = 0;
+    long lumaSum = 0;
+    int haveFrame = 0;
+    float scale;
+
+    *subsampled = 0;
+
+    if (!checkJpegMagic(buf, bufSize))
+        return 0;
+
+    // Tables and the frame header all come before the first scan
+    while (pos + 4 <= bufSize && buf[pos] == 0xff && buf[pos + 1] != 0xda) {
+        int marker = buf[pos + 1];
+        unsigned long size = (buf[pos + 2] << 8) + buf[pos + 3];
+        const unsigned char *segment = buf + pos + 4;
+        const unsigned char *end = buf + pos + 2 + size;
+
+        if (size < 2 || pos + 2 + size > bufSize)
+            return 0;
+
+        if (marker == 0xdb) {
+            // DQT holds one or more tables, with 8 or 16-bit values
+            while (segment < end) {
+                int precision = *segment >> 4;
+                int table = *segment & 0x0f;
+                unsigned long tableSize = precision ? 2 * DCTSIZE2 : DCTSIZE2;
+
+                if ((unsigned long) (end - segment) < 1 + tableSize)
+                    return 0;
+
+                if (table == 0) {
+                    lumaSum = 0;
+                    for (int x = 0; x < DCTSIZE2; x++)
+                        lumaSum += precision ? (segment[1 + 2 * x] << 8) + segment[2 + 2 * x] : segment[1 + x];
+                }
+                segment += 1 + tableSize;
+            }
+        } else if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+            // SOF, chroma is subsampled if its sampling factors differ from luma
+            if (size < 8 || size < 8 + 3 * (unsigned long) segment[5])
+                return 0;
+
+            // Grayscale has no chroma that could be finer than ours
+            if (segment[5] == 1)
+                *subsampled = 1;
+
+            for (int x = 1; x < segment[5]; x++) {
+                if (segment[7 + x * 3] != segment[7])
+                    *subsampled = 1;
+            }
+            haveFrame = 1;
+        }
+
+        pos += 2 + size;
+    }
+
+    if (!haveFrame || !lumaSum)
+        return 0;
+
+    // Undo the scaling of jpeg_set_quality
+    for (int x = 0; x < DCTSIZE2; x++)
+        standardSum += standardLuma[x];
+
+    scale = lumaSum * 100.0f / standardSum;
+    if (scale <= 100)
+        return MAX(1, (int) ((200 - scale) / 2 + 0.5f));
+
+    return MAX(1, (int) (5000 / scale + 0.5f));
+}
@@ -8,6 +8,9 @@
 #include <sys/types.h>
 #include <jpeglib.h>
 
+// Start of the COM marker jpeg-recompress adds to its output
+#define RECOMPRESS_COMMENT "Compressed by jpeg-recompress"
+
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
@@ -28,6 +31,18 @@ enum SUBSAMPLING_METHOD {
     SUBSAMPLE_444
 };
 
+// Most scans a scan script may have
+#define MAX_SCANS 64
+
+/*
+    A progressive scan script, the same as cjpeg reads with -scans.
+    Component indexes not used by a scan are 0.
+*/
+struct scanScript {
+    int count;
+    jpeg_scan_info scans[MAX_SCANS];
+};
+
 enum filetype {
     FILETYPE_UNKNOWN,
     FILETYPE_AUTO,
@@ -46,9 +61,73 @@ void error(const char *format, ...);
 */
 long readFile(char *name, void **buffer);
 
+/* Read everything left in an open file into a buffer and return the length. */
+long readStream(FILE *file, void **buffer);
+
+/*
+    Read a file (or stdin) and split it into non-empty lines, e.g. a
+    list of paths. The lines point into buf, both must be freed by the
+    caller. Returns the number of lines.
+*/
+long readLines(char *name, char **buf, char ***lines);
+
+/*
+    Return 1 if both names refer to the same file on disk. Standard
+    input/output ("-") never matches.
+*/
+int isSameFile(const char *name1, const char *name2);
+
+/*
+    Copy everything left in input to output in fixed-size chunks.
+    Returns the number of bytes copied or -1 on error.
+*/
+long copyStream(FILE *input, FILE *output);
+
+/*
+    Copy a file from disk to an already opened output. On Linux the
+    data is reflinked (FICLONE) or copied in-kernel with copy_file_range
+    when both are regular files, falling back to sendfile and finally a
+    plain read/write loop. Returns the number of bytes copied or -1.
+*/
+long copyFileTo(const char *name, FILE *output);
+
+/* A contiguous piece of data to be written out. */
+struct slice {
+    const void *data;
+    size_t size;
+};
+
+/*
+    Write several slices to a file in order, using a single writev
+    call where available. Returns 0 on success.
+*/
+int writeSlices(FILE *file, const struct slice *slices, int count);
+
+#ifndef _WIN32
+/* Like writeSlices, but to a file descriptor such as a socket. */
+int writeSlicesFd(int fd, const struct slice *slices, int count);
+#endif
+
+/*
+    Walk the marker segments of a JPEG file up to the first SOS marker
+    and return 1 if a COM marker starting with comment is found. Only
+    the headers are read, the entropy-coded data is skipped entirely.
+    The file position is left somewhere inside the headers.
+*/
+int findJpegComment(FILE *file, const char *comment);
+
+/*
+    Like findJpegComment, but also copy the rest of the matching comment
+    after the given text into rest, NUL-terminated and truncated to fit
+    into restSize bytes.
+*/
+int readJpegComment(FILE *file, const char *comment, char *rest, size_t restSize);
+int readJpegCommentFromBuffer(const unsigned char *buf, unsigned long bufSize, const char *comment, char *rest, size_t restSize);
+
 /*
     Decode a buffer into a JPEG image with the given pixel format.
-    Returns the size of the image pixel array.
+    Returns the size of the image pixel array, or 0 if libjpeg fails
+    in which case nothing is left allocated.
     See libjpeg.txt for a (very long) explanation.
 */
 int checkJpegMagic(const unsigned char *buf, unsigned long size);
@@ -62,9 +141,106 @@ int checkPpmMagic(const unsigned char *buf, unsigned long size);
 unsigned long decodePpm(unsigned char *buf, unsigned long bufSize, unsigned char **image, int *width, int *height);
 
 /*
-    Encode a buffer of image pixels into a JPEG.
+    Called with each chunk of rows of an image while it is being read.
+*/
+typedef void (*rowCallback)(const unsigned char *rows, int width, int height, int firstRow, int count, void *data);
+
+/*
+    Read a PPM image from a file or stdin ("-") straight into its pixel
+    buffer, without first buffering the whole file. The callback (if not
+    NULL) gets each chunk of rows as it arrives, so processing overlaps
+    with a producer such as dcraw still writing to the pipe. Returns the
+    number of pixels and sets fileSize to the number of bytes read.
 */
-unsigned long encodeJpeg(unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, int quality, int progressive, int optimize, int subsample);
+unsigned long readPpm(const char *name, unsigned char **image, int *width, int *height, long *fileSize, rowCallback callback, void *data);
+
+/*
+    Encode a buffer of image pixels into a JPEG. A fractional quality
+    scales the quantization tables in between those of the qualities
+    around it. Optimized progressive output uses the given scan script
+    if it is not NULL, rather than trying several scripts. Returns the
+    size of the JPEG, or 0 if libjpeg fails in which case *jpeg is NULL.
+*/
+unsigned long encodeJpeg(unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, float quality, int progressive, int optimize, int subsample, const struct scanScript *scans);
+
+/*
+    Read an image a few rows at a time instead of decoding all of it
+    into memory at once. Only JPEG and PPM (RGB only) are supported.
+    Returns NULL if the image cannot be read.
+*/
+struct rowReader;
+struct rowReader *openRowReader(const unsigned char *buf, unsigned long bufSize, enum filetype type, int pixelFormat, int *width, int *height);
+
+/*
+    Read up to count rows into the rows buffer. Returns the number of
+    rows read, which is only less than count at the end of the image,
+    or -1 on error.
+*/
+int readRows(struct rowReader *reader, unsigned char *rows, int count);
+void closeRowReader(struct rowReader *reader);
+
+/*
+    Number of libjpeg warnings (e.g. corrupt data) a reader has seen so
+    far. Fatal libjpeg errors never exit, they make the call fail instead.
+*/
+unsigned long rowReaderWarnings(const struct rowReader *reader);
+
+/*
+    Encode all rows of a freshly opened row reader into a JPEG, so the
+    source image never has to be fully in memory.
+*/
+unsigned long encodeJpegFromReader(unsigned char **jpeg, struct rowReader *reader, float quality, int progressive, int optimize, int subsample, const struct scanScript *scans);
+
+/*
+    An RGB image converted to YCbCr once, so it can be encoded many times
+    without converting and downsampling it again. The Y plane is the
+    width x height grayscale version of the image, as made by grayscale(),
+    and is not owned. The chroma planes are downsampled and padded out to
+    whole blocks exactly as libjpeg does it, so encodes are the same as
+    those of the RGB image.
+*/
+struct yccImage {
+    int width;
+    int height;
+    int subsample;
+    const unsigned char *y;
+    unsigned char *cb;
+    unsigned char *cr;
+    int chromaWidth;
+    int chromaHeight;
+};
+
+/*
+    Convert the chroma of an RGB image for the given subsampling method,
+    keeping a pointer to its grayscale version. Returns 0 on success.
+*/
+int convertYcc(const unsigned char *rgb, const unsigned char *gray, int width, int height, int subsample, struct yccImage *ycc);
+void freeYcc(struct yccImage *ycc);
+
+/* Encode a converted image into a JPEG, see encodeJpeg. */
+unsigned long encodeJpegFromYcc(unsigned char **jpeg, const struct yccImage *ycc, float quality, int progressive, int optimize, const struct scanScript *scans);
+
+/*
+    Losslessly rewrite a JPEG with optimized Huffman tables and, if
+    progressive is set, progressive scans from the given script or else
+    the default ones. The coefficients are copied as they are, so the
+    image decodes to the same pixels. Returns the size of the new JPEG,
+    or 0 if libjpeg fails in which case *jpeg is NULL.
+*/
+unsigned long recodeJpeg(unsigned char **jpeg, const unsigned char *buf, unsigned long bufSize, int progressive, const struct scanScript *scans);
+
+/*
+    Decode a JPEG to grayscale at the smallest DCT scale, down to 1/8,
+    that keeps both sides at least minSize pixels. At 1/8 scale only
+    the DC coefficients are used, so for progressive images decoding
+    stops after the first scan with the luma DC and the rest of the
+    file is never read. Reads from file if it is not NULL, otherwise
+    from buf. Returns the number of pixels, or 0 on error.
+*/
+unsigned long decodeJpegPreview(FILE *file, const unsigned char *buf, unsigned long bufSize, int minSize, unsigned char **image, int *width, int *height);
+
+/* The scale denominator (1, 2, 4 or 8) decodeJpegPreview picks for an image. */
+int previewScale(unsigned int width, unsigned int height, int minSize);
 
 /* Automatically detect the file type of a given file. */
 enum filetype detectFiletype(const char *filename);
@@ -86,4 +262,21 @@ unsigned long decodeFileFromBuffer(unsigned char *buf, long bufSize, unsigned ch
 */
 int getMetadata(const unsigned char *buf, unsigned int bufSize, unsigned char **meta, unsigned int *metaSize, const char *comment);
 
+/*
+    Turn a metadata blob into markers like those getMetadata returns.
+    The blob may be JPEG markers or a whole JPEG file, of which only the
+    metadata is used, EXIF data with or without its "Exif" header, or an
+    XMP packet. Returns 0 on success.
+*/
+int metadataFromBlob(const unsigned char *buf, unsigned long bufSize, unsigned char **meta, unsigned int *metaSize);
+
+/*
+    Estimate the quality a JPEG was saved at from its luma quantization
+    table, as if it was scaled from the IJG table like jpeg_set_quality
+    does, and tell whether its chroma is subsampled, which grayscale
+    counts as. Returns the quality (1-100), or 0 if the header could not
+    be read.
+*/
+int estimateJpegQuality(const unsigned char *buf, unsigned long bufSize, int *subsampled);
+
 #endif
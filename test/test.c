@@ -1,9 +1,139 @@
+// Needed for pipe and dup2 under -std=c99
+#define _GNU_SOURCE
+
+#include "../src/dedupe.h"
 #include "../src/edit.h"
 #include "../src/hash.h"
+#include "../src/hashcache.h"
+#include "../src/index.h"
+#include "../src/jpegarchive.h"
+#include "../src/journal.h"
+#include "../src/resultcache.h"
+#include "../src/scans.h"
 #include "../src/util.h"
 
 #include "../src/test/describe.h"
 
+#ifndef _WIN32
+    #include <unistd.h>
+#endif
+
+/* A 64x64 RGB pattern with detail in every block. */
+static unsigned char *patternPixels(void) {
+    unsigned char *pixels = malloc(64 * 64 * 3);
+
+    for (int x = 0; x < 64 * 64 * 3; x++)
+        pixels[x] = (x * 7 + x / 192 * 13) % 256;
+
+    return pixels;
+}
+
+/*
+    A 64x64 gradient saved at quality 100, which always recompresses to
+    something smaller, and default options that print nothing.
+*/
+static unsigned long gradientJpeg(unsigned char **jpeg, struct jpeg_archive_ctx *ctx) {
+    unsigned char *pixels = malloc(64 * 64 * 3);
+    unsigned long jpegSize;
+
+    for (int x = 0; x < 64 * 64 * 3; x++)
+        pixels[x] = (x / 3 % 64) * 4;
+
+    jpegSize = encodeJpeg(jpeg, pixels, 64, 64, JCS_RGB, 100, 0, 0, 0, NULL);
+    free(pixels);
+
+    jpeg_archive_init(ctx);
+    ctx->quiet = 1;
+
+    return jpegSize;
+}
+
+/*
+    Write the gradient JPEG with the given 16x16 hash embedded in our
+    comment right after SOI, so hashing the file gives exactly that hash.
+*/
+static unsigned long hashTaggedJpeg(const uint64_t *hash, unsigned char **tagged) {
+    char comment[sizeof RECOMPRESS_COMMENT HASH_COMMENT + HASH_TEXT_SIZE(16)];
+    struct jpeg_archive_ctx ctx;
+    unsigned char *jpeg;
+    unsigned long jpegSize;
+    unsigned long taggedSize;
+
+    strcpy(comment, RECOMPRESS_COMMENT HASH_COMMENT);
+    formatHash(hash, 16, comment + strlen(comment));
+
+    jpegSize = gradientJpeg(&jpeg, &ctx);
+    taggedSize = jpegSize + 4 + strlen(comment);
+    *tagged = malloc(taggedSize);
+    memcpy(*tagged, jpeg, 2);
+    (*tagged)[2] = 0xff;
+    (*tagged)[3] = 0xfe;
+    (*tagged)[4] = (strlen(comment) + 2) >> 8;
+    (*tagged)[5] = (strlen(comment) + 2) & 0xff;
+    memcpy(*tagged + 6, comment, strlen(comment));
+    memcpy(*tagged + 6 + strlen(comment), jpeg + 2, jpegSize - 2);
+    free(jpeg);
+
+    return taggedSize;
+}
+
+/* Write a JPEG file whose hash is exactly the given one. */
+static void writeHashedJpeg(const char *filename, const uint64_t *hash) {
+    unsigned char *tagged;
+    unsigned long taggedSize = hashTaggedJpeg(hash, &tagged);
+    FILE *file = fopen(filename, "wb");
+
+    fwrite(tagged, taggedSize, 1, file);
+    fclose(file);
+    free(tagged);
+}
+
+/* Files for the index test and how many bits their hashes have set. */
+static char *indexPaths[] = {"test-index-0.jpg", "test-index-1.jpg", "test-index-2.jpg", "test-index-3.jpg"};
+static const int indexDistances[] = {0, 5, 6, 40};
+
+/*
+    Hashes of size 16 for the dedupe test: 1 and 2 are within a radius
+    of 4 of each other, 1 of 0 and 5 of 3, but 2 is further from 0 and
+    4 is not hashed at all.
+*/
+static void dedupeHashes(uint64_t *hashes, char *hashed) {
+    memset(hashes, 0, 6 * HASH_WORDS(16) * sizeof(uint64_t));
+    memset(hashed, 1, 6);
+
+    hashes[1 * HASH_WORDS(16)] = 0x7;
+    hashes[2 * HASH_WORDS(16)] = 0x3f;
+    memset(hashes + 3 * HASH_WORDS(16), 0xff, HASH_WORDS(16) * sizeof(uint64_t));
+    memset(hashes + 5 * HASH_WORDS(16), 0xff, HASH_WORDS(16) * sizeof(uint64_t));
+    hashed[4] = 0;
+}
+
+/* Size readPpm reports for a PPM read from stdin through a pipe. */
+static long pipedPpmSize(const char *ppm, int size) {
+#ifdef _WIN32
+    return size;
+#else
+    unsigned char *imageData;
+    int width;
+    int height;
+    long fileSize = 0;
+    int fds[2];
+
+    if (pipe(fds))
+        return 0;
+    if (write(fds[1], ppm, size) != size)
+        return 0;
+    close(fds[1]);
+    dup2(fds[0], 0);
+    close(fds[0]);
+
+    readPpm("-", &imageData, &width, &height, &fileSize, NULL, NULL);
+    free(imageData);
+
+    return fileSize;
+#endif
+}
+
 describe ("Unit Tests", {
     it ("Should clamp values", {
         assert_equal_float(0.0, clamp(0.0, -10.0, 100.0));
@@ -61,7 +191,7 @@ describe ("Unit Tests", {
 
     it ("Should generate an image hash", {
         unsigned char *image;
-        unsigned char *hash;
+        uint64_t *hash;
 
         image = malloc(16);
 
@@ -79,18 +209,96 @@ describe ("Unit Tests", {
         // Hash should be 101010100101010
         genHash(image, 4, 4, &hash);
 
-        assert_equal(1, hash[0]);
-        assert_equal(0, hash[1]);
-        assert_equal(0, hash[5]);
-        assert_equal(1, hash[9]);
+        assert_equal(1, hashBit(hash, 0));
+        assert_equal(0, hashBit(hash, 1));
+        assert_equal(0, hashBit(hash, 5));
+        assert_equal(1, hashBit(hash, 9));
+        assert_equal(0, hashBit(hash, 15));
 
         free(hash);
         free(image);
     });
 
     it ("Should calculate hamming distance", {
-        int dist = hammingDist((unsigned char *) "101010", (unsigned char *) "111011", 6);
+        // 101010 vs. 111011
+        uint64_t hash1[2];
+        uint64_t hash2[2];
+
+        hash1[0] = 0x2a;
+        hash2[0] = 0x3b;
+
+        int dist = hammingDist(hash1, hash2, 1);
         assert_equal(2, dist);
+
+        // Bits in every word count
+        hash1[1] = 0xffffffffffffffffULL;
+        hash2[1] = 0x1;
+
+        dist = hammingDist(hash1, hash2, 2);
+        assert_equal(65, dist);
+    });
+
+    it ("Should hash every pyramid level from one plane", {
+        unsigned char *image = malloc(64 * 64);
+        uint64_t *hashes[HASH_LEVELS];
+        uint64_t *hash;
+
+        for (int x = 0; x < 64 * 64; x++)
+            image[x] = (x % 64) * (x / 64) % 251;
+
+        hashPyramid(image, 64, 64, hashes);
+        for (int level = 0; level < HASH_LEVELS; level++) {
+            hashImage(image, 64, 64, &hash, hashLevelSizes[level]);
+            assert_equal(0, (int) hashDiff(hashes[level], hash, hashLevelSizes[level]));
+            free(hash);
+        }
+
+        freeHashPyramid(hashes);
+        free(image);
+    });
+
+    it ("Should not judge a threshold by another hash size", {
+        unsigned char *image1 = malloc(64 * 64);
+        unsigned char *image2 = malloc(64 * 64);
+        uint64_t *hashes1[HASH_LEVELS];
+        uint64_t *hashes2[HASH_LEVELS];
+
+        // Only the columns the 32x32 level samples between those of the
+        // 16x16 level differ, in opposite directions
+        for (int x = 0; x < 64 * 64; x++) {
+            image1[x] = x % 4 == 2 ? 50 : 100;
+            image2[x] = x % 4 == 2 ? 150 : 100;
+        }
+
+        hashPyramid(image1, 64, 64, hashes1);
+        hashPyramid(image2, 64, 64, hashes2);
+
+        // Within any threshold at 16x16, so --threshold must keep it
+        assert_equal(0, (int) hashDiff(hashes1[1], hashes2[1], 16));
+        assert_ok(hashDiff(hashes1[2], hashes2[2], 32) > 90);
+
+        freeHashPyramid(hashes1);
+        freeHashPyramid(hashes2);
+        free(image1);
+        free(image2);
+    });
+
+    it ("Should format and parse a hash", {
+        uint64_t hash[4];
+        uint64_t *parsed;
+        char text[HASH_TEXT_SIZE(16)];
+
+        hash[0] = 0x0123456789abcdefULL;
+        hash[1] = 0;
+        hash[2] = ~(uint64_t) 0;
+        hash[3] = 42;
+
+        formatHash(hash, 16, text);
+        assert_equal(0, parseHash(text, &parsed, 16));
+        assert_equal(0, (int) hammingDist(hash, parsed, 4));
+        assert_equal(1, parseHash(text, &parsed, 8));
+
+        free(parsed);
     });
 
     it ("Should decode a PPM", {
@@ -107,5 +315,628 @@ describe ("Unit Tests", {
         assert_equal('\xc', imageData[11]);
 
         free(imageData);
-    })
+    });
+
+    it ("Should read a PPM file", {
+        char *ppm = "P6\n# comment\n2 2\n255\n\x1\x2\x3\x4\x5\x6\x7\x8\x9\xa\xb\xc";
+        unsigned char *imageData;
+        int width;
+        int height;
+        long fileSize;
+        FILE *file = fopen("test-read.ppm", "wb");
+
+        fwrite(ppm, 33, 1, file);
+        fclose(file);
+
+        readPpm("test-read.ppm", &imageData, &width, &height, &fileSize, NULL, NULL);
+        remove("test-read.ppm");
+
+        assert_equal(2, width);
+        assert_equal(2, height);
+        assert_equal(33, (int) fileSize);
+        assert_equal('\x1', imageData[0]);
+        assert_equal('\xc', imageData[11]);
+
+        free(imageData);
+
+        // The size of piped input is counted while reading, not asked of the pipe
+        assert_equal(33, (int) pipedPpmSize(ppm, 33));
+    });
+
+    it ("Should find a comment in the JPEG headers", {
+        // SOI, APP0, COM "abcd" and the start of SOS
+        char *jpeg = "\xff\xd8\xff\xe0\x00\x04\x00\x00"
+                     "\xff\xfe\x00\x06" "abcd" "\xff\xda\x00\x02";
+        FILE *file = tmpfile();
+
+        fwrite(jpeg, 20, 1, file);
+
+        rewind(file);
+        assert_equal(1, findJpegComment(file, "abc"));
+
+        rewind(file);
+        assert_equal(0, findJpegComment(file, "abd"));
+
+        fclose(file);
+
+        assert_equal(1, readJpegCommentFromBuffer((unsigned char *) jpeg, 20, "abc", NULL, 0));
+        assert_equal(0, readJpegCommentFromBuffer((unsigned char *) jpeg, 20, "abd", NULL, 0));
+    });
+
+    it ("Should use an embedded hash from any source", {
+        unsigned char *tagged;
+        unsigned long taggedSize;
+        uint64_t embedded[HASH_WORDS(16)];
+        uint64_t *fromFile;
+        uint64_t *fromBuffer;
+
+        // A hash no decode gives
+        memset(embedded, 0xa5, sizeof embedded);
+        taggedSize = hashTaggedJpeg(embedded, &tagged);
+        writeHashedJpeg("test-hash.jpg", embedded);
+
+        assert_equal(0, jpegHash("test-hash.jpg", &fromFile, 16));
+        assert_equal(0, jpegHashFromBuffer(tagged, taggedSize, &fromBuffer, 16));
+        assert_equal(0, memcmp(embedded, fromFile, sizeof embedded));
+        assert_equal(0, memcmp(embedded, fromBuffer, sizeof embedded));
+
+        remove("test-hash.jpg");
+        free(tagged);
+        free(fromFile);
+        free(fromBuffer);
+    });
+
+    it ("Should find exactly the indexed hashes within the radius", {
+        uint64_t hash[HASH_WORDS(16)];
+        uint64_t *matches;
+        struct hashIndex index;
+        int found[4] = {0};
+        long count;
+
+        for (int x = 0; x < 4; x++) {
+            memset(hash, 0, sizeof hash);
+            for (int bit = 0; bit < indexDistances[x]; bit++)
+                hash[bit % HASH_WORDS(16)] |= (uint64_t) 1 << (bit * 13 % 64);
+            writeHashedJpeg(indexPaths[x], hash);
+        }
+
+        assert_equal(0, updateIndex("test-index.db", indexPaths, 4, 16, 2));
+        assert_equal(0, openIndex("test-index.db", &index));
+
+        // One hash right at the radius, one just past it
+        memset(hash, 0, sizeof hash);
+        count = queryIndex(&index, hash, 5, &matches);
+        assert_equal(2, (int) count);
+        for (long x = 0; x < count; x++) {
+            for (int y = 0; y < 4; y++)
+                found[y] |= !strcmp(indexPaths[y], indexPath(&index, matches[x]));
+        }
+        assert_ok(found[0] && found[1] && !found[2] && !found[3]);
+        free(matches);
+
+        assert_equal(3, (int) queryIndex(&index, hash, 6, &matches));
+        free(matches);
+
+        closeIndex(&index);
+        remove("test-index.db");
+        for (int x = 0; x < 4; x++)
+            remove(indexPaths[x]);
+    });
+
+    it ("Should cluster hashes within the radius", {
+        uint64_t hashes[6 * HASH_WORDS(16)];
+        char hashed[6];
+        struct dedupePair *pairs;
+        uint32_t parent[6];
+        long count;
+
+        dedupeHashes(hashes, hashed);
+
+        count = findPairs(hashes, hashed, 6, 16, 4, 2, &pairs);
+        assert_equal(3, (int) count);
+        assert_ok(pairs[0].a == 0 && pairs[0].b == 1 && pairs[0].confirmed);
+        assert_ok(pairs[1].a == 1 && pairs[1].b == 2 && pairs[1].confirmed);
+        assert_ok(pairs[2].a == 3 && pairs[2].b == 5 && pairs[2].confirmed);
+
+        // 0 and 2 end up together through 1
+        assert_equal(3, (int) mergePairs(pairs, count, 6, parent));
+        assert_ok(findRoot(parent, 0) == findRoot(parent, 2));
+        assert_ok(findRoot(parent, 3) == findRoot(parent, 5));
+        assert_ok(findRoot(parent, 0) != findRoot(parent, 3));
+        assert_equal(4, (int) findRoot(parent, 4));
+
+        // Unconfirmed pairs are not merged
+        pairs[2].confirmed = 0;
+        assert_equal(2, (int) mergePairs(pairs, count, 6, parent));
+        assert_ok(findRoot(parent, 3) != findRoot(parent, 5));
+
+        free(pairs);
+    });
+
+    it ("Should reuse a cached hash", {
+        unsigned char *pixels = malloc(32 * 32);
+        unsigned char *jpeg;
+        unsigned long jpegSize;
+        uint64_t *hash1;
+        uint64_t *hash2;
+        struct hashCache cache;
+        FILE *file;
+
+        for (int x = 0; x < 32 * 32; x++)
+            pixels[x] = x * 7;
+
+        jpegSize = encodeJpeg(&jpeg, pixels, 32, 32, JCS_GRAYSCALE, 90, 0, 0, 0, NULL);
+        file = fopen("test-cache.jpg", "wb");
+        fwrite(jpeg, jpegSize, 1, file);
+        fclose(file);
+        remove("test-cache.db");
+
+        openHashCache("test-cache.db", 8, &cache);
+        assert_equal(0, cachedJpegHash(&cache, "test-cache.jpg", &hash1, 8));
+        closeHashCache(&cache);
+
+        openHashCache("test-cache.db", 8, &cache);
+        assert_equal(1, (int) cache.count);
+        assert_equal(0, cachedJpegHash(&cache, "test-cache.jpg", &hash2, 8));
+        assert_equal(0, (int) hammingDist(hash1, hash2, HASH_WORDS(8)));
+        closeHashCache(&cache);
+
+        remove("test-cache.jpg");
+        remove("test-cache.db");
+        free(pixels);
+        free(jpeg);
+        free(hash1);
+        free(hash2);
+    });
+
+    it ("Should wrap a metadata blob in a marker", {
+        const unsigned char *exif = (const unsigned char *) "II*\0\x08\0\0\0";
+        const unsigned char *marker = (const unsigned char *) "\xff\xe1\0\x0c" "Exif\0\0II*\0";
+        unsigned char *meta;
+        unsigned int metaSize;
+
+        assert_equal(0, metadataFromBlob(exif, 8, &meta, &metaSize));
+        assert_equal(18, (int) metaSize);
+        assert_equal(0xe1, meta[1]);
+        assert_equal(0, memcmp(meta + 4, "Exif", 5));
+        assert_equal(0, memcmp(meta + 10, exif, 8));
+        free(meta);
+
+        // Markers are taken as they are
+        assert_equal(0, metadataFromBlob(marker, 14, &meta, &metaSize));
+        assert_equal(14, (int) metaSize);
+        free(meta);
+
+        assert_equal(1, metadataFromBlob((unsigned char *) "hello", 5, &meta, &metaSize));
+    });
+
+    it ("Should resume from a journal", {
+        uint8_t options[DIGEST_SIZE];
+        uint8_t other[DIGEST_SIZE];
+        struct journalRecord record;
+        const struct journalRecord *found;
+        struct journal journal;
+
+        digestBuffer("ssim", 4, options);
+        digestBuffer("smallfry", 8, other);
+        remove("test-journal.db");
+
+        memset(&record, 0, sizeof record);
+        record.size = 1234;
+        record.status = JOURNAL_COMPRESSED;
+        openJournal("test-journal.db", options, &journal);
+        assert_equal(0, appendJournal(&journal, "a/b.jpg", &record));
+        record.quality = 80;
+        assert_equal(0, appendJournal(&journal, "a/b.jpg", &record));
+        closeJournal(&journal);
+
+        openJournal("test-journal.db", options, &journal);
+        assert_equal(2, (int) journal.count);
+        found = findJournal(&journal, "a/b.jpg");
+        assert_ok(found != NULL && found->quality == 80 && found->size == 1234);
+        assert_ok(findJournal(&journal, "a/c.jpg") == NULL);
+        closeJournal(&journal);
+
+        openJournal("test-journal.db", other, &journal);
+        assert_equal(1, journal.restarted);
+        assert_ok(findJournal(&journal, "a/b.jpg") == NULL);
+        closeJournal(&journal);
+
+        remove("test-journal.db");
+    });
+
+    it ("Should recompress a buffer", {
+        unsigned char *jpeg;
+        unsigned char *out;
+        unsigned char *again;
+        unsigned long jpegSize;
+        unsigned long outSize;
+        unsigned long againSize;
+        struct jpeg_archive_ctx ctx;
+        struct jpeg_archive_stats stats;
+
+        jpegSize = gradientJpeg(&jpeg, &ctx);
+
+        assert_equal(JPEG_ARCHIVE_OK, recompress_buffer(&ctx, jpeg, jpegSize, &out, &outSize, &stats));
+        assert_ok(outSize < jpegSize);
+        assert_equal((int) outSize, (int) stats.size);
+        assert_equal(1, checkJpegMagic(out, outSize));
+
+        // The output carries our comment, so it is never processed twice
+        assert_equal(JPEG_ARCHIVE_PROCESSED, recompress_buffer(&ctx, out, outSize, &again, &againSize, NULL));
+        assert_ok(again == NULL);
+
+        free(jpeg);
+        free(out);
+    });
+
+    it ("Should fail on a corrupt JPEG without exiting", {
+        unsigned char *jpeg;
+        unsigned char *out;
+        unsigned char *decoded;
+        unsigned long jpegSize;
+        unsigned long outSize;
+        int width;
+        int height;
+        struct jpeg_archive_ctx ctx;
+        struct jpeg_archive_stats stats;
+
+        jpegSize = gradientJpeg(&jpeg, &ctx);
+
+        // Cut off within the headers, which libjpeg cannot get past
+        assert_equal(0, (int) decodeJpeg(jpeg, 100, &decoded, &width, &height, JCS_RGB));
+        assert_equal(JPEG_ARCHIVE_FAILED, recompress_buffer(&ctx, jpeg, 100, &out, &outSize, &stats));
+        assert_ok(out == NULL);
+
+        // Cut off within the image data, which only warns
+        assert_ok(recompress_buffer(&ctx, jpeg, jpegSize / 2, &out, &outSize, &stats) != JPEG_ARCHIVE_FAILED);
+        assert_ok(stats.warnings > 0);
+        free(out);
+
+        // Nothing is left broken for later calls
+        assert_equal(64 * 64 * 3, (int) decodeJpeg(jpeg, jpegSize, &decoded, &width, &height, JCS_RGB));
+        assert_equal(JPEG_ARCHIVE_OK, recompress_buffer(&ctx, jpeg, jpegSize, &out, &outSize, &stats));
+        assert_equal(0, (int) stats.warnings);
+
+        free(jpeg);
+        free(out);
+        free(decoded);
+    });
+
+    it ("Should encode fractional qualities", {
+        unsigned char *pixels = patternPixels();
+        unsigned char *jpeg;
+        unsigned long sizes[3];
+
+        // Tables in between those of the qualities around it
+        for (int x = 0; x < 3; x++) {
+            sizes[x] = encodeJpeg(&jpeg, pixels, 64, 64, JCS_RGB, 60 + x * 0.5f, 0, 0, 0, NULL);
+            free(jpeg);
+        }
+
+        assert_ok(sizes[0] < sizes[1] && sizes[1] < sizes[2]);
+
+        free(pixels);
+    });
+
+    it ("Should estimate the quality of a JPEG", {
+        unsigned char *pixels = patternPixels();
+        unsigned char *jpeg;
+        unsigned long jpegSize;
+        int subsampled;
+
+        // The fast profile uses the standard tables
+        jpegSize = encodeJpeg(&jpeg, pixels, 64, 64, JCS_RGB, 75, 0, 0, 0, NULL);
+        assert_equal(75, estimateJpegQuality(jpeg, jpegSize, &subsampled));
+        assert_equal(1, subsampled);
+        free(jpeg);
+
+        jpegSize = encodeJpeg(&jpeg, pixels, 64, 64, JCS_RGB, 30, 0, 0, SUBSAMPLE_444, NULL);
+        assert_equal(30, estimateJpegQuality(jpeg, jpegSize, &subsampled));
+        assert_equal(0, subsampled);
+
+        assert_equal(0, estimateJpegQuality(jpeg, 100, &subsampled));
+        free(jpeg);
+
+        // Grayscale has no chroma to keep
+        jpegSize = encodeJpeg(&jpeg, pixels, 64, 64, JCS_GRAYSCALE, 60, 0, 0, SUBSAMPLE_444, NULL);
+        assert_equal(60, estimateJpegQuality(jpeg, jpegSize, &subsampled));
+        assert_equal(1, subsampled);
+
+        free(pixels);
+        free(jpeg);
+    });
+
+    it ("Should keep the original when the search cannot save enough", {
+        unsigned char *pixels = patternPixels();
+        unsigned char *jpeg;
+        unsigned char *out;
+        unsigned long jpegSize;
+        unsigned long outSize;
+        struct jpeg_archive_ctx ctx;
+        struct jpeg_archive_stats stats;
+
+        jpegSize = encodeJpeg(&jpeg, pixels, 64, 64, JCS_RGB, 50, 0, 0, 0, NULL);
+
+        jpeg_archive_init(&ctx);
+        ctx.quiet = 1;
+        ctx.copyFiles = 1;
+        ctx.minSavings = 30;
+
+        // Even the lowest quality we may pick saves too little, so there is no search
+        ctx.jpegMin = 50;
+        assert_equal(JPEG_ARCHIVE_LARGER, recompress_buffer(&ctx, jpeg, jpegSize, &out, &outSize, &stats));
+        assert_ok(out == NULL);
+        assert_equal(0, (int) stats.quality);
+
+        // A low target may pick qualities well below that of the input
+        ctx.jpegMin = 10;
+        ctx.target = 0.5;
+        assert_equal(JPEG_ARCHIVE_OK, recompress_buffer(&ctx, jpeg, jpegSize, &out, &outSize, &stats));
+        assert_ok(outSize * 10 < jpegSize * 7);
+        free(out);
+
+        free(pixels);
+        free(jpeg);
+    });
+
+    it ("Should recode a JPEG losslessly", {
+        unsigned char *pixels = patternPixels();
+        unsigned char *jpeg;
+        unsigned char *recoded;
+        unsigned char *decoded;
+        unsigned char *decodedRecoded;
+        unsigned long jpegSize;
+        unsigned long recodedSize;
+        int width;
+        int height;
+
+        jpegSize = encodeJpeg(&jpeg, pixels, 64, 64, JCS_RGB, 80, 0, 0, 0, NULL);
+        recodedSize = recodeJpeg(&recoded, jpeg, jpegSize, 1, NULL);
+        assert_ok(recodedSize > 0);
+
+        assert_equal(64 * 64, (int) decodeJpeg(jpeg, jpegSize, &decoded, &width, &height, JCS_GRAYSCALE));
+        assert_equal(64 * 64, (int) decodeJpeg(recoded, recodedSize, &decodedRecoded, &width, &height, JCS_GRAYSCALE));
+        assert_equal(0, memcmp(decoded, decodedRecoded, 64 * 64));
+
+        free(pixels);
+        free(jpeg);
+        free(recoded);
+        free(decoded);
+        free(decodedRecoded);
+    });
+
+    it ("Should reuse probes for the final encode", {
+        unsigned char *jpeg;
+        unsigned char *out;
+        unsigned char *pixels;
+        unsigned char *fresh;
+        unsigned char *decoded;
+        unsigned char *decodedFresh;
+        unsigned long jpegSize;
+        unsigned long outSize;
+        unsigned long freshSize;
+        int width;
+        int height;
+        struct jpeg_archive_ctx ctx;
+        struct jpeg_archive_stats stats;
+
+        jpegSize = gradientJpeg(&jpeg, &ctx);
+        decodeJpeg(jpeg, jpegSize, &pixels, &width, &height, JCS_RGB);
+        ctx.accurate = 1;
+        // The search ends at its first probe
+        ctx.target = 0.5;
+        ctx.tolerance = 1;
+
+        // Every probe is optimized, so the final baseline encode is one of them as it was
+        ctx.noProgressive = 1;
+        assert_equal(JPEG_ARCHIVE_OK, recompress_buffer(&ctx, jpeg, jpegSize, &out, &outSize, &stats));
+        assert_equal(67, (int) stats.quality);
+        freshSize = encodeJpeg(&fresh, pixels, width, height, JCS_RGB, stats.quality, 0, 1, 0, NULL);
+        assert_ok(outSize > freshSize - 20);
+        assert_equal(0, memcmp(out + outSize - (freshSize - 20), fresh + 20, freshSize - 20));
+        free(out);
+
+        // A progressive final encode is recoded from a probe, which leaves the pixels alone
+        ctx.noProgressive = 0;
+        assert_equal(JPEG_ARCHIVE_OK, recompress_buffer(&ctx, jpeg, jpegSize, &out, &outSize, &stats));
+        assert_equal(64 * 64, (int) decodeJpeg(out, outSize, &decoded, &width, &height, JCS_GRAYSCALE));
+        assert_equal(64 * 64, (int) decodeJpeg(fresh, freshSize, &decodedFresh, &width, &height, JCS_GRAYSCALE));
+        assert_equal(0, memcmp(decoded, decodedFresh, 64 * 64));
+
+        free(jpeg);
+        free(out);
+        free(pixels);
+        free(fresh);
+        free(decoded);
+        free(decodedFresh);
+    });
+
+    it ("Should encode converted YCbCr planes like RGB pixels", {
+        unsigned char *pixels = malloc(45 * 37 * 3);
+        unsigned char *gray;
+        unsigned char *jpeg;
+        unsigned char *raw;
+        unsigned long jpegSize;
+        unsigned long rawSize;
+        struct yccImage ycc;
+
+        // Odd sizes, so the planes need padding on both edges
+        for (int x = 0; x < 45 * 37 * 3; x++)
+            pixels[x] = (x * 7 + x / 135 * 13 + x * x % 31) % 256;
+        grayscale(pixels, &gray, 45, 37);
+
+        for (int subsample = SUBSAMPLE_DEFAULT; subsample <= SUBSAMPLE_444; subsample++) {
+            assert_equal(0, convertYcc(pixels, gray, 45, 37, subsample, &ycc));
+
+            jpegSize = encodeJpeg(&jpeg, pixels, 45, 37, JCS_RGB, 70, 0, 0, subsample, NULL);
+            rawSize = encodeJpegFromYcc(&raw, &ycc, 70, 0, 0, NULL);
+            assert_equal((int) jpegSize, (int) rawSize);
+            assert_equal(0, memcmp(jpeg, raw, jpegSize));
+
+            free(jpeg);
+            free(raw);
+            freeYcc(&ycc);
+        }
+
+        free(pixels);
+        free(gray);
+    });
+
+    it ("Should learn a scan script", {
+        unsigned char *pixels = patternPixels();
+        unsigned char *jpeg;
+        unsigned long jpegSize;
+        struct scanScripts learned;
+        struct scanScripts loaded;
+        const struct scanScript *script;
+
+        memset(&learned, 0, sizeof learned);
+        jpegSize = encodeJpeg(&jpeg, pixels, 64, 64, JCS_RGB, 80, 1, 0, 0, NULL);
+        assert_equal(0, learnScanScript(&learned, 0, jpeg, jpegSize));
+        free(jpeg);
+
+        // Baseline output has no scans to learn
+        jpegSize = encodeJpeg(&jpeg, pixels, 64, 64, JCS_RGB, 80, 0, 0, 0, NULL);
+        assert_equal(1, learnScanScript(&learned, 0, jpeg, jpegSize));
+        free(jpeg);
+
+        assert_equal(0, saveScanScripts("test-scans.txt", &learned));
+        assert_equal(0, loadScanScripts("test-scans.txt", &loaded));
+        assert_equal(1, (int) loaded.count);
+        assert_ok(findScanScript(&loaded, 3, SUBSAMPLE_444, 64, 64) == NULL);
+
+        script = findScanScript(&loaded, 3, 0, 64, 64);
+        assert_ok(script != NULL);
+        assert_equal(0, memcmp(script, &learned.entries[0].script, sizeof *script));
+
+        // Optimized output uses the script as it is
+        jpegSize = encodeJpeg(&jpeg, pixels, 64, 64, JCS_RGB, 80, 1, 1, 0, script);
+        assert_equal(0, learnScanScript(&learned, 0, jpeg, jpegSize));
+        assert_equal(1, (int) learned.count);
+        assert_equal(2, (int) learned.entries[0].votes);
+
+        free(pixels);
+        free(jpeg);
+        freeScanScripts(&learned);
+        freeScanScripts(&loaded);
+        remove("test-scans.txt");
+    });
+
+    it ("Should recompress in strips like in memory", {
+        unsigned char *pixels = malloc(256 * 192 * 3);
+        unsigned char *jpeg;
+        unsigned char *out;
+        unsigned long jpegSize;
+        unsigned long outSize;
+        struct jpeg_archive_ctx ctx;
+        struct jpeg_archive_stats stats;
+        struct jpeg_archive_stats stripStats;
+
+        // A smooth gradient with some texture on top
+        for (int x = 0; x < 256 * 192 * 3; x++)
+            pixels[x] = (x / 3 % 256) / 2 + (x / 768) / 3 + (x * 7 % 13);
+
+        jpegSize = encodeJpeg(&jpeg, pixels, 256, 192, JCS_RGB, 100, 0, 0, 0, NULL);
+
+        jpeg_archive_init(&ctx);
+        ctx.quiet = 1;
+        ctx.target = 0.98;
+
+        assert_equal(JPEG_ARCHIVE_OK, recompress_buffer(&ctx, jpeg, jpegSize, &out, &outSize, &stats));
+        free(out);
+
+        // Too little memory for anything but the smallest strips
+        ctx.maxMemory = 1;
+        assert_equal(JPEG_ARCHIVE_OK, recompress_buffer(&ctx, jpeg, jpegSize, &out, &outSize, &stripStats));
+        free(out);
+
+        // Windows at strip edges differ, so the metric is only close
+        assert_equal((int) stats.quality, (int) stripStats.quality);
+        assert_ok(stats.metric - stripStats.metric < 0.0001 && stripStats.metric - stats.metric < 0.0001);
+
+        free(pixels);
+        free(jpeg);
+    });
+
+    it ("Should stop searching within tolerance", {
+        unsigned char *jpeg;
+        unsigned char *out;
+        unsigned long jpegSize;
+        unsigned long outSize;
+        struct jpeg_archive_ctx ctx;
+        struct jpeg_archive_stats stats;
+
+        jpegSize = gradientJpeg(&jpeg, &ctx);
+        ctx.target = 0.5;
+
+        // Without a tolerance, the search goes on below the first probe
+        assert_equal(JPEG_ARCHIVE_OK, recompress_buffer(&ctx, jpeg, jpegSize, &out, &outSize, &stats));
+        assert_ok(stats.quality < 67);
+        free(out);
+
+        ctx.tolerance = 1;
+        assert_equal(JPEG_ARCHIVE_OK, recompress_buffer(&ctx, jpeg, jpegSize, &out, &outSize, &stats));
+        assert_equal(67, (int) stats.quality);
+        free(out);
+
+        free(jpeg);
+    });
+
+    it ("Should reuse a cached result", {
+        unsigned char *jpeg;
+        unsigned char *out;
+        unsigned char *cached;
+        unsigned long jpegSize;
+        unsigned long outSize;
+        unsigned long cachedSize;
+        struct jpeg_archive_ctx ctx;
+        struct jpeg_archive_image image;
+        struct jpeg_archive_stats stats;
+        struct cachedResult result;
+        uint8_t key[DIGEST_SIZE];
+        char path[32 + 2 * DIGEST_SIZE];
+
+        jpegSize = gradientJpeg(&jpeg, &ctx);
+        ctx.cacheDir = "test-cache";
+        ctx.cacheOutput = 1;
+        openResultCache(ctx.cacheDir);
+
+        assert_equal(JPEG_ARCHIVE_OK, recompress_buffer(&ctx, jpeg, jpegSize, &out, &outSize, NULL));
+
+        memset(&image, 0, sizeof image);
+        resultKey(jpeg, jpegSize, &ctx, key);
+        assert_equal(0, loadResult(ctx.cacheDir, key, &result, &image));
+        assert_ok(image.compressedSize > 0);
+
+        // A metric no search gives, which only comes back from the cache
+        result.metric = 0.5;
+        assert_equal(0, storeResult(ctx.cacheDir, key, &result, &image));
+        jpeg_archive_free_image(&image);
+
+        // Other options are another result
+        ctx.strip = 1;
+        resultKey(jpeg, jpegSize, &ctx, key);
+        assert_equal(1, loadResult(ctx.cacheDir, key, &result, &image));
+        ctx.strip = 0;
+
+        assert_equal(JPEG_ARCHIVE_OK, recompress_buffer(&ctx, jpeg, jpegSize, &cached, &cachedSize, &stats));
+        assert_equal_float(0.5, stats.metric);
+        assert_equal((int) outSize, (int) cachedSize);
+        assert_equal(0, memcmp(out, cached, outSize));
+
+        // The one entry, its subdirectory and the cache
+        resultKey(jpeg, jpegSize, &ctx, key);
+        sprintf(path, "test-cache/%02x/", key[0]);
+        for (int x = 0; x < DIGEST_SIZE; x++)
+            sprintf(path + strlen(path), "%02x", key[x]);
+        assert_equal(0, remove(path));
+        *strrchr(path, '/') = '\0';
+        remove(path);
+        remove("test-cache");
+
+        free(jpeg);
+        free(out);
+        free(cached);
+    });
 });